@@ -0,0 +1,326 @@
+/*
+ *	Mercury 236 non-blocking API.
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mercury-async.h"
+#include "mercury-crc.h"
+
+// -- Set up the channel of the context for the event loop
+int asyncInit(MercuryAsync* a, MercuryCtx* ctx)
+{
+	int fd = ctx->fd;
+	bzero(a, sizeof(MercuryAsync));
+	a->fd = fd;
+	a->stream = isBrokerChannel(fd);
+	a->ctx = ctx;
+
+	int flags = fcntl(fd, F_GETFL);
+	return (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) ? -1 : 0;
+}
+
+// -- Drop the requests queued, no callbacks are invoked
+void asyncClose(MercuryAsync* a)
+{
+	while (a->head)
+	{
+		MercuryRequest* r = a->head;
+		a->head = r->next;
+		free(r);
+	}
+	a->tail = NULL;
+	a->state = AS_IDLE;
+}
+
+// -- Start (or repeat) the request at the head of the queue
+static void start(MercuryAsync* a)
+{
+	MercuryRequest* r = a->head;
+
+	// Drop leftovers of earlier (late or broken) responces
+	byte junk[ASYNC_BSZ];
+	while (read(a->fd, junk, ASYNC_BSZ) > 0);
+
+	printPackage(a->ctx, r->cmd, r->cmdLen, 0);
+
+	r->written = 0;
+	r->len = 0;
+	bzero(&r->timing, sizeof(TxTiming));
+	r->timing.start = txClock();
+
+	a->state = AS_WRITE;
+	a->deadline = r->timing.start + a->ctx->timeoutUs;
+}
+
+// -- Queue the request, the command buffer is filled in by the caller
+static MercuryRequest* submit(MercuryAsync* a, const void* cmd, int cmdLen, int expected,
+	MercuryCallback cb, void* arg)
+{
+	MercuryRequest* r = calloc(1, sizeof(MercuryRequest));
+	if (!r)
+		return NULL;
+
+	memcpy(r->cmd, cmd, cmdLen);
+	r->cmdLen = cmdLen;
+	r->expected = (expected < ASYNC_BSZ) ? expected : ASYNC_BSZ;
+	r->cb = cb;
+	r->arg = arg;
+
+	if (a->tail)
+		a->tail->next = r;
+	else
+		a->head = r;
+	a->tail = r;
+
+	if (AS_IDLE == a->state)
+		start(a);
+	return r;
+}
+
+/*
+ * Queue the channel check (see checkChannel).
+ *
+ * Returns:
+ *	request handle, valid until its callback returns, NULL if out of memory.
+ */
+MercuryRequest* asyncCheckChannel(MercuryAsync* a, MercuryCallback cb, void* arg)
+{
+	TestCmd testCmd = { .address = a->ctx->meter.address, .command = 0x00 };
+	testCmd.CRC = ModRTU_CRC((byte*)&testCmd, sizeof(testCmd) - sizeof(UInt16));
+
+	MercuryRequest* r = submit(a, &testCmd, sizeof(testCmd), sizeof(Result_1b), cb, arg);
+	if (r)
+		r->isCheck = 1;
+	return r;
+}
+
+// -- Queue the connection initialisation (see initConnection)
+MercuryRequest* asyncInitConnection(MercuryAsync* a, MercuryCallback cb, void* arg)
+{
+	InitCmd initCmd = {
+		.address = a->ctx->meter.address,
+		.command = 0x01,
+		.accessLevel = a->ctx->meter.accessLevel,
+	};
+	memcpy(initCmd.password, a->ctx->meter.password, sizeof(initCmd.password));
+	initCmd.CRC = ModRTU_CRC((byte*)&initCmd, sizeof(initCmd) - sizeof(UInt16));
+
+	return submit(a, &initCmd, sizeof(initCmd), sizeof(Result_1b), cb, arg);
+}
+
+// -- Queue the connection finalisation (see closeConnection)
+MercuryRequest* asyncCloseConnection(MercuryAsync* a, MercuryCallback cb, void* arg)
+{
+	ByeCmd byeCmd = { .address = a->ctx->meter.address, .command = 0x02 };
+	byeCmd.CRC = ModRTU_CRC((byte*)&byeCmd, sizeof(byeCmd) - sizeof(UInt16));
+
+	return submit(a, &byeCmd, sizeof(byeCmd), sizeof(Result_1b), cb, arg);
+}
+
+// -- Queue the parameter read (see readParam), the descriptor is copied
+MercuryRequest* asyncReadParam(MercuryAsync* a, const ParamDesc* desc, MercuryCallback cb, void* arg)
+{
+	ReadParamCmd cmd =
+	{
+		.address = a->ctx->meter.address,
+		.command = desc->command,
+		.paramId = desc->paramId,
+		.BWRI = desc->BWRI
+	};
+	cmd.CRC = ModRTU_CRC((byte*)&cmd, sizeof(cmd) - sizeof(UInt16));
+
+	MercuryRequest* r = submit(a, &cmd, sizeof(cmd), desc->replySize, cb, arg);
+	if (r)
+	{
+		r->isParam = 1;
+		r->desc = *desc;
+	}
+	return r;
+}
+
+// -- Queue the parameter read (PARAM_U, PARAM_I etc.)
+MercuryRequest* asyncGetParam(MercuryAsync* a, int param, MercuryCallback cb, void* arg)
+{
+	return asyncReadParam(a, &paramTable[param], cb, arg);
+}
+
+// -- Queue the power counters read for the period (see getW)
+MercuryRequest* asyncGetW(MercuryAsync* a, int periodId, int month, int tariffNo, MercuryCallback cb, void* arg)
+{
+	ParamDesc desc = paramTable[PARAM_PR];
+	desc.paramId = (periodId << 4) | (month & 0xF);
+	desc.BWRI = tariffNo;
+
+	return asyncReadParam(a, &desc, cb, arg);
+}
+
+/*
+ * Cancel the request. A request in flight completes on the bus (its
+ * responce is dropped), the callback is not invoked either way.
+ */
+void asyncCancel(MercuryAsync* a, MercuryRequest* req)
+{
+	if (req == a->head)
+	{
+		req->cb = NULL;
+		return;
+	}
+
+	for (MercuryRequest* r = a->head; r; r = r->next)
+		if (r->next == req)
+		{
+			r->next = req->next;
+			if (a->tail == req)
+				a->tail = r;
+			free(req);
+			return;
+		}
+}
+
+int asyncFd(const MercuryAsync* a)
+{
+	return a->fd;
+}
+
+// -- poll() events to wait for, 0 if idle
+int asyncEvents(const MercuryAsync* a)
+{
+	switch (a->state)
+	{
+		case AS_WRITE: return POLLOUT;
+		case AS_READ: return POLLIN;
+		default: return 0;
+	}
+}
+
+// -- Time to call asyncHandle() even without events (us, txClock()), -1 if idle
+int64_t asyncDeadline(const MercuryAsync* a)
+{
+	return (AS_IDLE == a->state) ? -1 : a->deadline;
+}
+
+// -- poll() timeout up to the deadline (ms, rounded up), -1 if idle
+int asyncTimeout(const MercuryAsync* a)
+{
+	if (AS_IDLE == a->state)
+		return -1;
+
+	int64_t left = a->deadline - txClock();
+	return (left > 0) ? (int)((left + 999) / 1000) : 0;
+}
+
+// -- Requests queued, including the one in flight
+int asyncPending(const MercuryAsync* a)
+{
+	int n = 0;
+	for (const MercuryRequest* r = a->head; r; r = r->next)
+		n++;
+	return n;
+}
+
+// -- Check the responce of the head request: retry, or complete it and start the next one
+static void finish(MercuryAsync* a)
+{
+	MercuryRequest* r = a->head;
+
+	int result = (r->len > 0) ? checkResponce(r->buf, r->len, r->expected) : COMMUNICATION_ERROR;
+	if (r->len > 0)
+		printPackage(a->ctx, r->buf, r->len, 1);
+	else
+		printError(a->ctx, r->len);
+
+	if ((WRONG_CRC == result || WRONG_RESULT_SIZE == result) && r->retries < a->ctx->retries)
+	{
+		r->retries++;
+		start(a);
+		return;
+	}
+	recordTx(&a->ctx->stats, r->cmd, r->cmdLen, &r->timing, result, r->retries);
+
+	// the next request goes on the bus while the callback runs
+	a->head = r->next;
+	if (!a->head)
+		a->tail = NULL;
+	a->state = AS_IDLE;
+	if (a->head)
+		start(a);
+
+	float values[4];
+	if (r->isParam && OK == result)
+		decodeParam(&r->desc, r->buf, values);
+	if (r->isCheck && COMMUNICATION_ERROR == result)
+		result = CHECK_CHANNEL_FAILURE;
+
+	if (r->cb)
+		r->cb(r, result, (r->isParam && OK == result) ? values : NULL, r->arg);
+	free(r);
+}
+
+/*
+ * Advance the request in flight: send, receive, complete on the full
+ * responce, the end of the frame or the timeout. Call it on the events
+ * of asyncFd() (revents of poll()) and on asyncDeadline() with 0.
+ */
+void asyncHandle(MercuryAsync* a, int revents)
+{
+	while (AS_IDLE != a->state)
+	{
+		MercuryRequest* r = a->head;
+		int done = 0;
+
+		if (AS_WRITE == a->state)
+		{
+			int w = write(a->fd, r->cmd + r->written, r->cmdLen - r->written);
+			if (w > 0)
+				r->written += w;
+			else if (w < 0 && EAGAIN != errno && EWOULDBLOCK != errno)
+				done = 1;
+
+			if (r->written == r->cmdLen)
+			{
+				r->timing.written = txClock();
+				a->state = AS_READ;
+				a->deadline = r->timing.written + a->ctx->timeoutUs;
+			}
+			else if (!done && txClock() < a->deadline)
+				return;
+			else
+				done = 1;
+		}
+
+		if (AS_READ == a->state && !done)
+		{
+			while (r->len < r->expected)
+			{
+				int n = read(a->fd, r->buf + r->len, ASYNC_BSZ - r->len);
+				if (n <= 0)
+				{
+					// end of the broker stream or a channel error; a tty
+					// (VMIN = VTIME = 0) reads 0 bytes while none are waiting
+					if ((!n && a->stream) || (n < 0 && EAGAIN != errno && EWOULDBLOCK != errno))
+						done = 1;
+					break;
+				}
+
+				r->timing.lastByte = txClock();
+				if (!r->len)
+					r->timing.firstByte = r->timing.lastByte;
+				r->len += n;
+				// a status frame ends after a pause, a data frame may come in bursts
+				a->deadline = r->timing.lastByte +
+					((isStatusFrame(r->buf, r->len)) ? a->ctx->frameGapUs : a->ctx->timeoutUs);
+			}
+
+			if (!done && r->len < r->expected && txClock() < a->deadline)
+				return;
+		}
+
+		finish(a);
+	}
+}
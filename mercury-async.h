@@ -0,0 +1,101 @@
+/*
+ *	Mercury 236 non-blocking API: the same requests as checkChannel,
+ *	initConnection, getU ... getW, driven by the caller's event loop.
+ *
+ *	Requests are queued per channel and sent one at a time. The caller
+ *	polls asyncFd() for asyncEvents() until asyncDeadline(), then calls
+ *	asyncHandle() with the events received (0 on timeout). A completed
+ *	request invokes its callback with the result code and the decoded
+ *	values, the request handle is freed when the callback returns.
+ *
+ *	Commands are addressed to the meter of the context (ctx->meter) at
+ *	the time the request is queued, timeouts, retries, trace and
+ *	statistics are those of the context too.
+ *
+ *	The channel is switched to O_NONBLOCK, don't mix it with the blocking
+ *	calls. Bus access (MERCURY_SEMAPHORE) stays with the caller, as with
+ *	the blocking API; channels of several meters can share one loop.
+ *
+ *	for (;;)
+ *	{
+ *		struct pollfd p = { asyncFd(&a), asyncEvents(&a), 0 };
+ *		poll(&p, 1, asyncTimeout(&a));
+ *		asyncHandle(&a, p.revents);
+ *	}
+ */
+#ifndef MERCURY_ASYNC_H
+#define MERCURY_ASYNC_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define ASYNC_BSZ		255
+
+typedef struct MercuryRequest MercuryRequest;
+
+/*
+ * Completion callback.
+ *
+ * Parameters:
+ *	result - ResultCode, as the blocking call would return.
+ *	values - desc.count decoded values if the request reads a parameter
+ *		and result is OK, NULL otherwise.
+ */
+typedef void (*MercuryCallback)(MercuryRequest*, int result, const float* values, void* arg);
+
+// Request states
+typedef enum
+{
+	AS_IDLE = 0,		// nothing in flight
+	AS_WRITE,		// sending command
+	AS_READ			// receiving responce
+} AsyncState;
+
+struct MercuryRequest
+{
+	byte		cmd[ASYNC_BSZ];
+	int		cmdLen;
+	int		written;		// command bytes sent
+	byte		buf[ASYNC_BSZ];		// responce
+	int		len;
+	int		expected;		// responce size
+	int		isParam;		// desc describes the values to decode
+	ParamDesc	desc;
+	int		isCheck;		// checkChannel: no responce is CHECK_CHANNEL_FAILURE
+	int		retries;
+	TxTiming	timing;
+	MercuryCallback	cb;
+	void*		arg;
+	MercuryRequest*	next;
+};
+
+// Channel with its request queue, the head is in flight
+typedef struct
+{
+	int		fd;
+	int		stream;			// broker socket: a zero read is its end, not "no data yet" as on a tty
+	MercuryCtx*	ctx;
+	int		state;			// AsyncState
+	int64_t		deadline;		// us, txClock(), of the state
+	MercuryRequest*	head;
+	MercuryRequest*	tail;
+} MercuryAsync;
+
+// Function prototypes:
+int asyncInit(MercuryAsync*, MercuryCtx*);
+void asyncClose(MercuryAsync*);
+MercuryRequest* asyncCheckChannel(MercuryAsync*, MercuryCallback, void* arg);
+MercuryRequest* asyncInitConnection(MercuryAsync*, MercuryCallback, void* arg);
+MercuryRequest* asyncCloseConnection(MercuryAsync*, MercuryCallback, void* arg);
+MercuryRequest* asyncReadParam(MercuryAsync*, const ParamDesc*, MercuryCallback, void* arg);
+MercuryRequest* asyncGetParam(MercuryAsync*, int param, MercuryCallback, void* arg);
+MercuryRequest* asyncGetW(MercuryAsync*, int periodId, int month, int tariffNo, MercuryCallback, void* arg);
+void asyncCancel(MercuryAsync*, MercuryRequest*);
+int asyncFd(const MercuryAsync*);
+int asyncEvents(const MercuryAsync*);
+int64_t asyncDeadline(const MercuryAsync*);
+int asyncTimeout(const MercuryAsync*);
+int asyncPending(const MercuryAsync*);
+void asyncHandle(MercuryAsync*, int revents);
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ *      Mercury power meter bus broker. The broker owns the RS485 dongle and
+ *      serves power meter requests of local clients over a Unix socket.
+ *
+ *      Clients send the usual command frames and receive the meter responces,
+ *      so the library get* functions work unchanged on the socket descriptor
+ *      (openChannel() connects to the broker when given the socket path, e.g.
+ *      mercury236 /tmp/mercury-broker.sock --json).
+ *
+ *      Identical requests pending from several clients are sent to the bus
+ *      once and the responce is fanned out to every caller. Connection
+ *      termination (bye) is answered by the broker itself so that the
+ *      session stays open for the other clients.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "mercury236.h"
+#include "mercury-crc.h"
+
+#define OPT_DEBUG		"--debug"
+#define OPT_HELP		"--help"
+
+#define BSZ			255
+#define MAX_CLIENTS		32
+
+int debugPrint = 0;
+
+typedef enum
+{
+	EXIT_OK = 0,
+	EXIT_FAIL = 1
+} ExitCode;
+
+// Connected client
+typedef struct
+{
+	int	sd;		// socket, < 0 if the slot is free
+	byte	buf[BSZ];	// bytes received
+	int	len;		// bytes in buf
+	int	frameLen;	// size of complete command frame in buf, 0 if none yet
+} Client;
+
+Client clients[MAX_CLIENTS];
+int terminateBrokerNow = 0;
+
+// Broker statistics
+long busRequests = 0;		// transactions sent to the bus
+long clientRequests = 0;	// requests received from the clients
+
+// -- Command line usage help
+void printUsage()
+{
+	printf("Usage: mercury-broker RS485 [SOCKET] [OPTIONS] ...\n\r\n\r");
+	printf("  RS485\t\taddress of RS485 dongle (e.g. /dev/ttyUSB0), required\n\r");
+	printf("  SOCKET\tUnix socket to serve (default %s)\n\r", MERCURY_BROKER);
+	printf("  %s\tto print extra debug info\n\r", OPT_DEBUG);
+	printf("\n\r");
+	printf("  %s\tprints this screen\n\r", OPT_HELP);
+}
+
+// -- Signal Handler for SIGINT, SIGTERM
+void sigterm_handler(int sig_num)
+{
+	terminateBrokerNow = 1;
+}
+
+// -- Drop client connection
+void dropClient(Client* c)
+{
+	close(c->sd);
+	c->sd = -1;
+	c->len = c->frameLen = 0;
+}
+
+// -- Read what the client sent, detect complete command frame
+void readClient(Client* c)
+{
+	int r = read(c->sd, c->buf + c->len, BSZ - c->len);
+	if (r <= 0)
+	{
+		dropClient(c);
+		return;
+	}
+	c->len += r;
+
+	int size = commandSize(c->buf, c->len);
+	if (size < 0)
+	{
+		if (debugPrint)
+			printf("Unknown command %02X, client dropped\n\r", c->buf[1]);
+		dropClient(c);
+	}
+	else if (size > 0 && c->len >= size && !c->frameLen)
+	{
+		c->frameLen = size;
+		clientRequests++;
+	}
+}
+
+// -- Poll all clients for input, wait up to timeoutUs
+void pollClients(int listenSd, long timeoutUs)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	FD_SET(listenSd, &set);
+	int maxSd = listenSd;
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].sd >= 0)
+		{
+			FD_SET(clients[i].sd, &set);
+			if (clients[i].sd > maxSd)
+				maxSd = clients[i].sd;
+		}
+
+	struct timeval timeout = { .tv_sec = timeoutUs / 1000000, .tv_usec = timeoutUs % 1000000 };
+	if (select(maxSd + 1, &set, NULL, NULL, (timeoutUs < 0) ? NULL : &timeout) <= 0)
+		return;
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].sd >= 0 && FD_ISSET(clients[i].sd, &set))
+			readClient(&clients[i]);
+
+	if (FD_ISSET(listenSd, &set))
+	{
+		int sd = accept(listenSd, NULL, NULL);
+		if (sd < 0)
+			return;
+
+		for (int i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i].sd < 0)
+			{
+				clients[i].sd = sd;
+				return;
+			}
+		close(sd);	// no free slots
+	}
+}
+
+// -- Send responce to every client waiting for this very command frame
+void fanOut(byte* cmd, int cmdLen, byte* reply, int replyLen)
+{
+	for (int i = 0; i < MAX_CLIENTS; i++)
+	{
+		Client* c = &clients[i];
+		if (c->sd < 0 || c->frameLen != cmdLen || memcmp(c->buf, cmd, cmdLen))
+			continue;
+
+		if (replyLen > 0 && write(c->sd, reply, replyLen) != replyLen)
+		{
+			dropClient(c);
+			continue;
+		}
+
+		// keep the bytes of the next request if any
+		c->len -= cmdLen;
+		memmove(c->buf, c->buf + cmdLen, c->len);
+		c->frameLen = 0;
+
+		int size = commandSize(c->buf, c->len);
+		if (size > 0 && c->len >= size)
+		{
+			c->frameLen = size;
+			clientRequests++;
+		}
+	}
+}
+
+// -- Serve one pending request (and all identical ones), returns 0 if nothing pending
+int serveRequest(MercuryCtx* ctx, sem_t* semptr, int listenSd)
+{
+	byte cmd[BSZ];
+	int cmdLen = 0;
+
+	for (int i = 0; i < MAX_CLIENTS && !cmdLen; i++)
+		if (clients[i].sd >= 0 && clients[i].frameLen)
+		{
+			cmdLen = clients[i].frameLen;
+			memcpy(cmd, clients[i].buf, cmdLen);
+		}
+
+	if (!cmdLen)
+		return 0;
+
+	byte reply[BSZ];
+	int replyLen;
+
+	if (0x02 == cmd[1])
+	{
+		// keep the session open for the others, confirm bye locally
+		Result_1b bye = { .address = cmd[0], .result = OK };
+		bye.CRC = ModRTU_CRC((byte*)&bye, sizeof(bye) - sizeof(UInt16));
+		memcpy(reply, &bye, sizeof(bye));
+		replyLen = sizeof(bye);
+	}
+	else
+	{
+		if (sem_wait(semptr))
+			return 0;
+		TxTiming timing;
+		int expected = replySize(cmd);
+		replyLen = sendReceive(ctx, cmd, cmdLen, reply, expected, BSZ, ctx->timeoutUs, &timing);
+		sem_post(semptr);
+		busRequests++;
+		recordTx(&ctx->stats, cmd, cmdLen, &timing,
+			(replyLen > 0) ? checkResponce(reply, replyLen, expected) : COMMUNICATION_ERROR, 0);
+
+		// identical requests arrived while the bus was busy get the same responce
+		pollClients(listenSd, 0);
+	}
+
+	// no responce on timeout: clients time out the same way as on direct access
+	fanOut(cmd, cmdLen, reply, replyLen);
+	return 1;
+}
+
+int main(int argc, const char** args)
+{
+	// must have RS485 address (1st required param)
+	if (argc < 2)
+	{
+		printf("Error: no RS485 device specified\n\r\n\r");
+		printUsage();
+		exit(EXIT_FAIL);
+	}
+
+	char dev[BSZ];
+	strncpy(dev, args[1], BSZ);
+
+	char path[BSZ];
+	strncpy(path, MERCURY_BROKER, BSZ);
+
+	for (int i=2; i<argc; i++)
+	{
+		if (!strcmp(OPT_DEBUG, args[i]))
+			debugPrint = 1;
+		else if (!strcmp(OPT_HELP, args[i]))
+		{
+			printUsage();
+			exit(EXIT_OK);
+		}
+		else if (2 == i && '-' != args[i][0])
+			strncpy(path, args[i], BSZ);
+		else
+		{
+			printf("Error: %s option is not recognised\n\r\n\r", args[i]);
+			printUsage();
+			exit(EXIT_FAIL);
+		}
+	}
+
+	signal(SIGINT, sigterm_handler);
+	signal(SIGTERM, sigterm_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	int ttyd = openChannel(dev);
+	if (ttyd < 0 || isBrokerChannel(ttyd))
+	{
+		printf("Cannot open %s terminal channel.\n\r", dev);
+		exit(EXIT_FAIL);
+	}
+
+	MercuryCtx ctx;
+	initCtx(&ctx, ttyd);
+	ctx.debug = (debugPrint) ? stdout : NULL;
+
+	// mercury-mon and mercury236 may still use the dongle directly
+	char semName[NAME_MAX];
+	semaphoreName(dev, semName, sizeof(semName));
+	int prevMask = umask(0000);
+	sem_t* semptr = sem_open(semName, O_CREAT, MERCURY_ACCESS_PERM, 1);
+	umask(prevMask);
+	if (SEM_FAILED == semptr)
+	{
+		printf("Semaphore open error.\n\r");
+		exit(EXIT_FAIL);
+	}
+
+	struct sockaddr_un addr;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+
+	int listenSd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSd < 0 ||
+		bind(listenSd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+		listen(listenSd, MAX_CLIENTS) < 0)
+	{
+		printf("Cannot listen on %s.\n\r", path);
+		exit(EXIT_FAIL);
+	}
+	chmod(path, MERCURY_ACCESS_PERM);
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		clients[i].sd = -1;
+
+	while (!terminateBrokerNow)
+	{
+		pollClients(listenSd, -1);
+		while (serveRequest(&ctx, semptr, listenSd));
+
+		if (debugPrint)
+			printf("Requests: %ld, bus transactions: %ld\n\r", clientRequests, busRequests);
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].sd >= 0)
+			dropClient(&clients[i]);
+
+	if (debugPrint)
+		printTxStats(&ctx.stats, stdout);
+
+	close(listenSd);
+	unlink(path);
+	close(ttyd);
+	sem_close(semptr);
+
+	exit(EXIT_OK);
+}
@@ -2,24 +2,33 @@
  *      Mercury power meter command line data fetching utility.
  * 
  * 	Implementation note:
- * 	Exclusive access to the power meter implemented using semaphore (MERCURY_SEMAPHORE)
+ * 	Exclusive access to the power meter implemented using semaphore (MERCURY_SEMAPHORE.PORT)
  * 	so that multiple utilites can get data simultaneously without conflicts. Please make 
  * 	sure all users have proper rights to the semaphore e.g.
  * 	
- * 	$ ls -l /dev/shm/sem.MERCURY_RS485 
- * 	-rw-rw-rw- 1 root root 16 Mar 26 23:52 /dev/shm/sem.MERCURY_RS485
+ * 	$ ls -l /dev/shm/sem.MERCURY_RS485.ttyUSB0 
+ * 	-rw-rw-rw- 1 root root 16 Mar 26 23:52 /dev/shm/sem.MERCURY_RS485.ttyUSB0
  */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/select.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <fcntl.h>
-#include <termios.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
 #include <unistd.h>
 #include "mercury236.h"
+#include "mercury-shm.h"
+#include "mercury-presence.h"
+#include "mercury-profile.h"
+#include "mercury-energy.h"
 
 #define OPT_DEBUG		"--debug"
 #define OPT_HELP		"--help"
@@ -29,10 +38,21 @@
 #define OPT_CSV			"--csv"
 #define OPT_JSON		"--json"
 #define OPT_HEADER		"--header"
+#define OPT_SHM			"--shm"
+#define OPT_FIELDS		"--fields"
+#define OPT_INTERVAL		"--interval"
+#define OPT_COUNT		"--count"
+#define OPT_STATS		"--stats"
+#define OPT_BATCH		"--batch"
+#define OPT_METER		"--meter"
+#define OPT_PROFILE		"--profile"
+#define OPT_BINARY		"--binary"
+#define OPT_HISTORY		"--history"
+#define OPT_CACHE		"--cache"
 
 #define BSZ			255
 
-int debugPrint = 0;
+int terminateNow = 0;
 
 typedef enum
 {
@@ -44,7 +64,8 @@ typedef enum			// Output formatting
 {
 	OF_HUMAN = 0,		// human readable
 	OF_CSV = 1,		// comma-separated values
-	OF_JSON = 2		// json
+	OF_JSON = 2,		// json
+	OF_BINARY = 3		// ProfileRecord structures (load profile only)
 } OutputFormat;
 
 void getDateTimeStr(char *str, int length, time_t time)
@@ -56,6 +77,12 @@ void getDateTimeStr(char *str, int length, time_t time)
 		ti->tm_hour, ti->tm_min, ti->tm_sec);
 }
 
+// -- Signal Handler for SIGINT, SIGTERM (stops streaming)
+void sigint_handler(int sig_num)
+{
+	terminateNow = 1;
+}
+
 // -- Command line usage help
 void printUsage()
 {
@@ -64,78 +91,123 @@ void printUsage()
 	printf("  %s\tto print extra debug info\n\r", OPT_DEBUG);
 	printf("  %s\tdry run to see output sample, as if the mains was ON\n\r", OPT_TEST_RUN);
 	printf("  %s\tdry run to get output sample, as if the mains was OFF\n\r", OPT_TEST_FAIL);
+	printf("  %s\t\tread the last sample published by mercury-mon, no RS485 access\n\r", OPT_SHM);
+	printf("  %s\tto print bus transaction statistics to stderr on exit\n\r", OPT_STATS);
+	printf("  %s\tread U, I, CosF, F, P, S with one request, test/mercury-sim only\n\r", OPT_BATCH);
+	printf("  %s ADDR[:PASSWORD[:LEVEL]]\n\r", OPT_METER);
+	printf("\t\tmeter RS485 address (default %d - the only meter on the line),\n\r", PM_ADDRESS);
+	printf("\t\tpassword digits (default 111111) and access level (default 1)\n\r");
 	printf("\n\r");
 	printf("  Output formatting:\n\r");
 	printf("  %s\thuman readable (default)\n\r", OPT_HUMAN);
 	printf("  %s\t\tCSV\n\r", OPT_CSV);
 	printf("  %s\tjson\n\r", OPT_JSON);
 	printf("  %s\tto print data header (with %s only)\n\r", OPT_HEADER, OPT_CSV);
+	printf("  %s LIST\tpoll and print only the fields listed, e.g. P,S,PT\n\r", OPT_FIELDS);
+	printf("\t\t(U,I,CosF,F,A,P,S,PR,PR-day,PR-night,PY,PT; with %s only the fields\n\r", OPT_SHM);
+	printf("\t\tthe monitor refreshed are printed)\n\r");
+	printf("\n\r");
+	printf("  Streaming (one process and meter session, a line per sample):\n\r");
+	printf("  %s MS\tsample period (milliseconds)\n\r", OPT_INTERVAL);
+	printf("  %s N\tnumber of samples (default 1, or unlimited with %s)\n\r", OPT_COUNT, OPT_INTERVAL);
+	printf("\n\r");
+	printf("  Load profile (the average power by period, oldest first):\n\r");
+	printf("  %s DAYS\tread the last DAYS of the profile archive\n\r", OPT_PROFILE);
+	printf("  %s\tProfileRecord structures instead of text (with %s only)\n\r", OPT_BINARY, OPT_PROFILE);
+	printf("\n\r");
+	printf("  Energy history (months, years, days by tariff):\n\r");
+	printf("  %s\tprint the energy counters, only the ones that may have changed are read\n\r", OPT_HISTORY);
+	printf("  %s FILE\tcache file (default %s.PORT[.ADDR])\n\r", OPT_CACHE, ENERGY_CACHE);
 	printf("\n\r");
 	printf("  %s\tprints this screen\n\r", OPT_HELP);
 }
 
+// -- Read the fields requested, batched if asked for and the meter supports it
+int getFields(MercuryCtx* ctx, OutputBlock* o, int fields)
+{
+	int params = 0, read;
+	for (int i = 0; i < PARAM_COUNT; i++)
+		if (fields & paramTable[i].field)
+			params |= 1 << i;
+
+	return getParams(ctx, params, o, &read);
+}
+
 // -- Output formatting and print
-void printOutput(int format, OutputBlock o, int header)
+void printOutput(int format, OutputBlock o, int fields, int header, time_t sampleTime)
 {
-	// getting current time for timestamp
+	// sample timestamp
 	char timeStamp[BSZ];
-	getDateTimeStr(timeStamp, BSZ, time(NULL));
+	getDateTimeStr(timeStamp, BSZ, sampleTime);
 
 	switch(format)
 	{
 		case OF_HUMAN:
 			printf("  Mains status:                         %8s\n\r", (o.ms) ? "On" : "Off");
-			printf("  Voltage (V):             		%8.2f %8.2f %8.2f\n\r", o.U.p1, o.U.p2, o.U.p3);
-			printf("  Current (A):             		%8.2f %8.2f %8.2f\n\r", o.I.p1, o.I.p2, o.I.p3);
-			printf("  Cos(f):                  		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.C.p1, o.C.p2, o.C.p3, o.C.sum);
-			printf("  Frequency (Hz):          		%8.2f\n\r", o.f);
-			printf("  Phase angles (deg):      		%8.2f %8.2f %8.2f\n\r", o.A.p1, o.A.p2, o.A.p3);
-			printf("  Active power (W):        		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.P.p1, o.P.p2, o.P.p3, o.P.sum);
-			printf("  Reactive power (VA):     		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.S.p1, o.S.p2, o.S.p3, o.S.sum);
-			printf("  Total consumed, all tariffs (KW):	%8.2f\n\r", o.PR.ap);
-			printf("    including day tariff (KW):		%8.2f\n\r", o.PRT[0].ap);
-			printf("    including night tariff (KW):	%8.2f\n\r", o.PRT[1].ap);
-			printf("  Yesterday consumed (KW): 		%8.2f\n\r", o.PY.ap);
-			printf("  Today consumed (KW):     		%8.2f\n\r", o.PT.ap);
+			if (fields & OB_U) printf("  Voltage (V):             		%8.2f %8.2f %8.2f\n\r", o.U.p1, o.U.p2, o.U.p3);
+			if (fields & OB_I) printf("  Current (A):             		%8.2f %8.2f %8.2f\n\r", o.I.p1, o.I.p2, o.I.p3);
+			if (fields & OB_C) printf("  Cos(f):                  		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.C.p1, o.C.p2, o.C.p3, o.C.sum);
+			if (fields & OB_F) printf("  Frequency (Hz):          		%8.2f\n\r", o.f);
+			if (fields & OB_A) printf("  Phase angles (deg):      		%8.2f %8.2f %8.2f\n\r", o.A.p1, o.A.p2, o.A.p3);
+			if (fields & OB_P) printf("  Active power (W):        		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.P.p1, o.P.p2, o.P.p3, o.P.sum);
+			if (fields & OB_S) printf("  Reactive power (VA):     		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.S.p1, o.S.p2, o.S.p3, o.S.sum);
+			if (fields & OB_PR) printf("  Total consumed, all tariffs (KW):	%8.2f\n\r", o.PR.ap);
+			if (fields & OB_PRT0) printf("    including day tariff (KW):		%8.2f\n\r", o.PRT[0].ap);
+			if (fields & OB_PRT1) printf("    including night tariff (KW):	%8.2f\n\r", o.PRT[1].ap);
+			if (fields & OB_PY) printf("  Yesterday consumed (KW): 		%8.2f\n\r", o.PY.ap);
+			if (fields & OB_PT) printf("  Today consumed (KW):     		%8.2f\n\r", o.PT.ap);
 			break;
 
 		case OF_CSV:
 			if (header)
 			{
 				// to be the same order as params below
-				printf("DT,U1,U2,U3,I1,I2,I3,P1,P2,P2,Psum,S1,S2,S3,Ssum,C1,C2,C3,Csum,F,A1,A2,A3,PRa,PYa,PTa,MS\n\r");
-
+				printf("DT");
+				if (fields & OB_U) printf(",U1,U2,U3");
+				if (fields & OB_I) printf(",I1,I2,I3");
+				if (fields & OB_P) printf(",P1,P2,P3,Psum");
+				if (fields & OB_S) printf(",S1,S2,S3,Ssum");
+				if (fields & OB_C) printf(",C1,C2,C3,Csum");
+				if (fields & OB_F) printf(",F");
+				if (fields & OB_A) printf(",A1,A2,A3");
+				if (fields & OB_PR) printf(",PRa");
+				if (fields & OB_PRT0) printf(",PRDa");
+				if (fields & OB_PRT1) printf(",PRNa");
+				if (fields & OB_PY) printf(",PYa");
+				if (fields & OB_PT) printf(",PTa");
+				printf(",MS\n\r");
 			}
-			printf("%s,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%d\n\r",
-				timeStamp,
-				o.U.p1, o.U.p2, o.U.p3,
-				o.I.p1, o.I.p2, o.I.p3,
-				o.P.p1, o.P.p2, o.P.p3, o.P.sum,
-				o.S.p1, o.S.p2, o.S.p3, o.S.sum,
-				o.C.p1, o.C.p2, o.C.p3, o.C.sum,
-				o.f,
-				o.A.p1, o.A.p2, o.A.p3,
-				o.PR.ap, o.PRT[0].ap, o.PRT[1].ap,
-				o.PY.ap,
-				o.PT.ap,
-				o.ms
-			);
+			printf("%s", timeStamp);
+			if (fields & OB_U) printf(",%.2f,%.2f,%.2f", o.U.p1, o.U.p2, o.U.p3);
+			if (fields & OB_I) printf(",%.2f,%.2f,%.2f", o.I.p1, o.I.p2, o.I.p3);
+			if (fields & OB_P) printf(",%.2f,%.2f,%.2f,%.2f", o.P.p1, o.P.p2, o.P.p3, o.P.sum);
+			if (fields & OB_S) printf(",%.2f,%.2f,%.2f,%.2f", o.S.p1, o.S.p2, o.S.p3, o.S.sum);
+			if (fields & OB_C) printf(",%.2f,%.2f,%.2f,%.2f", o.C.p1, o.C.p2, o.C.p3, o.C.sum);
+			if (fields & OB_F) printf(",%.2f", o.f);
+			if (fields & OB_A) printf(",%.2f,%.2f,%.2f", o.A.p1, o.A.p2, o.A.p3);
+			if (fields & OB_PR) printf(",%.2f", o.PR.ap);
+			if (fields & OB_PRT0) printf(",%.2f", o.PRT[0].ap);
+			if (fields & OB_PRT1) printf(",%.2f", o.PRT[1].ap);
+			if (fields & OB_PY) printf(",%.2f", o.PY.ap);
+			if (fields & OB_PT) printf(",%.2f", o.PT.ap);
+			printf(",%d\n\r", o.ms);
 			break;
 
 		case OF_JSON:
-			printf("{\"mainsStatus\":%d,\"U\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"I\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"CosF\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"F\":%.2f,\"A\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"P\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"S\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"PR\":{\"ap\":%.2f},\"PR-day\":{\"ap\":%.2f},\"PR-night\":{\"ap\":%.2f},\"PY\":{\"ap\":%.2f},\"PT\":{\"ap\":%.2f}}\n\r",
-				o.ms,
-				o.U.p1, o.U.p2, o.U.p3,
-				o.I.p1, o.I.p2, o.I.p3,
-				o.C.p1, o.C.p2, o.C.p3, o.C.sum,
-				o.f,
-				o.A.p1, o.A.p2, o.A.p3,
-				o.P.p1, o.P.p2, o.P.p3, o.P.sum,
-				o.S.p1, o.S.p2, o.S.p3, o.S.sum,
-				o.PR.ap, o.PRT[0].ap, o.PRT[1].ap,
-				o.PY.ap,
-				o.PT.ap
-			);
+			printf("{\"mainsStatus\":%d", o.ms);
+			if (fields & OB_U) printf(",\"U\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f}", o.U.p1, o.U.p2, o.U.p3);
+			if (fields & OB_I) printf(",\"I\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f}", o.I.p1, o.I.p2, o.I.p3);
+			if (fields & OB_C) printf(",\"CosF\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f}", o.C.p1, o.C.p2, o.C.p3, o.C.sum);
+			if (fields & OB_F) printf(",\"F\":%.2f", o.f);
+			if (fields & OB_A) printf(",\"A\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f}", o.A.p1, o.A.p2, o.A.p3);
+			if (fields & OB_P) printf(",\"P\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f}", o.P.p1, o.P.p2, o.P.p3, o.P.sum);
+			if (fields & OB_S) printf(",\"S\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f}", o.S.p1, o.S.p2, o.S.p3, o.S.sum);
+			if (fields & OB_PR) printf(",\"PR\":{\"ap\":%.2f}", o.PR.ap);
+			if (fields & OB_PRT0) printf(",\"PR-day\":{\"ap\":%.2f}", o.PRT[0].ap);
+			if (fields & OB_PRT1) printf(",\"PR-night\":{\"ap\":%.2f}", o.PRT[1].ap);
+			if (fields & OB_PY) printf(",\"PY\":{\"ap\":%.2f}", o.PY.ap);
+			if (fields & OB_PT) printf(",\"PT\":{\"ap\":%.2f}", o.PT.ap);
+			printf("}\n\r");
 			break;
 
 		default:
@@ -144,6 +216,332 @@ void printOutput(int format, OutputBlock o, int header)
 	}
 }
 
+/*
+ * Poll the power meter for the fields requested. The session opened is
+ * kept for the next samples and reopened when the meter has dropped it.
+ * The presence detector tells the mains off in milliseconds once the
+ * meter latency is learned, the verdict is shared with the other callers.
+ *
+ * Returns:
+ *	OK or the first error occurred, the fields read so far are valid.
+ */
+int pollMeter(MercuryCtx* ctx, Presence* presence, OutputBlock* o, int fields, int* session)
+{
+	if (!*session)
+	{
+		if (OK != presenceCheck(presence, ctx))
+		{
+			// assume that we are here because mains power supply is off 
+			// which caused power meter comm channel time out.
+			o->ms = MS_OFF;
+			return CHECK_CHANNEL_FAILURE;
+		}
+
+		// Seems that power is on
+		o->ms = MS_ON;
+
+		if (OK != initConnection(ctx))
+			return COMMUNICATION_ERROR;
+		*session = 1;
+	}
+	else
+		o->ms = MS_ON;
+
+	int res = getFields(ctx, o, fields);
+	if (CHANNEL_ISNT_OPEN == res)
+	{
+		res = initConnection(ctx);
+		if (OK == res)
+			res = getFields(ctx, o, fields);
+	}
+
+	// check the channel again with the next sample
+	if (COMMUNICATION_ERROR == res)
+	{
+		*session = 0;
+		presenceLost(presence);
+	}
+
+	return res;
+}
+
+// -- Sleep until the next deadline, returns non zero if interrupted
+int waitDeadline(struct timespec* deadline, long interval)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// skip the deadlines missed (e.g. after a long meter timeout)
+	do
+	{
+		deadline->tv_sec += interval / 1000;
+		deadline->tv_nsec += (interval % 1000) * 1000000;
+		if (deadline->tv_nsec >= 1000000000)
+		{
+			deadline->tv_sec++;
+			deadline->tv_nsec -= 1000000000;
+		}
+	} while (interval && (deadline->tv_sec < now.tv_sec ||
+		(deadline->tv_sec == now.tv_sec && deadline->tv_nsec < now.tv_nsec)));
+
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL))
+		if (terminateNow)
+			return 1;
+
+	return terminateNow;
+}
+
+// -- Open the meter session unless it is open, the presence check first
+int openSession(MercuryCtx* ctx, Presence* presence, int* session)
+{
+	if (*session)
+		return OK;
+
+	int res = presenceCheck(presence, ctx);
+	if (OK == res)
+		res = initConnection(ctx);
+	*session = (OK == res);
+	return res;
+}
+
+// -- Print power value of the profile record, empty (null) if not measured
+static void printPower(int format, const char* sep, float value)
+{
+	if (isnan(value))
+		printf("%s%s", sep, (OF_JSON == format) ? "null" : (OF_HUMAN == format) ? "       -" : "");
+	else
+		printf((OF_HUMAN == format) ? "%s%8.2f" : "%s%.2f", sep, value);
+}
+
+// -- Load profile record formatting and print
+void printRecord(int format, const ProfileRecord* r, int header)
+{
+	char timeStamp[BSZ];
+	getDateTimeStr(timeStamp, BSZ, (time_t)r->time);
+
+	switch(format)
+	{
+		case OF_HUMAN:
+			if (header)
+				printf("  Period start           Min       P+ (W)   P- (W) Q+ (var) Q- (var)\n\r");
+			printf("  %s %4d ", timeStamp, r->period);
+			printPower(format, " ", r->ap);
+			printPower(format, " ", r->am);
+			printPower(format, " ", r->rp);
+			printPower(format, " ", r->rm);
+			printf("\n\r");
+			break;
+
+		case OF_CSV:
+			if (header)
+				printf("DT,Period,AP,AM,RP,RM\n\r");
+			printf("%s,%d", timeStamp, r->period);
+			printPower(format, ",", r->ap);
+			printPower(format, ",", r->am);
+			printPower(format, ",", r->rp);
+			printPower(format, ",", r->rm);
+			printf("\n\r");
+			break;
+
+		case OF_JSON:
+			printf("{\"time\":\"%s\",\"period\":%d", timeStamp, r->period);
+			printPower(format, ",\"AP\":", r->ap);
+			printPower(format, ",\"AM\":", r->am);
+			printPower(format, ",\"RP\":", r->rp);
+			printPower(format, ",\"RM\":", r->rm);
+			printf("}\n\r");
+			break;
+
+		case OF_BINARY:
+			fwrite(r, sizeof(*r), 1, stdout);
+			break;
+
+		default:
+			printf("Invalid formatting.\n\r");
+			exit(EXIT_FAIL);
+	}
+}
+
+/*
+ * Read the last days of the load profile, oldest records first, and print
+ * them as they come. The bus is taken for one memory read at a time so
+ * that the other users keep polling during the walk; the session is
+ * reopened when the meter has dropped it.
+ *
+ * Returns:
+ *	OK or the error that stopped the walk.
+ */
+int dumpProfile(MercuryCtx* ctx, Presence* presence, sem_t* semptr, int days, int format, int header, int* session)
+{
+	ProfileHead head;
+	ProfileCursor cursor = { 0, 0 };
+	ProfileRecord block[PROFILE_BLOCK];
+	int res = OK, located = 0, retries = ctx->retries;
+	long total = 0;
+	ctx->retries = PROFILE_RETRIES;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!terminateNow && (!located || cursor.left))
+	{
+		if (semptr && sem_wait(semptr))
+			continue;
+
+		int decoded = 0;
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			res = openSession(ctx, presence, session);
+			if (OK != res)
+				break;
+
+			res = (located) ? profileNext(ctx, &cursor, block, &decoded) : getProfileHead(ctx, &head);
+			if (CHANNEL_ISNT_OPEN != res)
+				break;
+			*session = 0;
+		}
+
+		if (COMMUNICATION_ERROR == res)
+		{
+			*session = 0;
+			presenceLost(presence);
+		}
+		if (semptr)
+			sem_post(semptr);
+		if (OK != res)
+			break;
+
+		if (!located)
+		{
+			profileSeek(&cursor, &head, days * 24 * 60 / head.period);
+			located = 1;
+			continue;
+		}
+
+		for (int i = 0; i < decoded; i++, total++)
+			printRecord(format, &block[i], (header || OF_HUMAN == format) && !total);
+		fflush(stdout);
+	}
+
+	ctx->retries = retries;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%ld records in %.1f s (%.1f records/s)\n", total, elapsed, (elapsed > 0) ? total / elapsed : 0.0);
+	if (OK != res)
+		fprintf(stderr, "Profile readout stopped: %s.\n",
+			(CHECK_CHANNEL_FAILURE == res) ? "the meter does not answer" : "communication error");
+	return res;
+}
+
+// -- Energy history formatting and print, the counters never read are skipped
+void printEnergy(int format, const EnergyCache* cache, int header, time_t now)
+{
+	// oldest first, the months in the calendar order
+	int order[ES_COUNT], n = 0;
+	struct tm tm;
+	localtime_r(&now, &tm);
+	order[n++] = ES_RESET;
+	order[n++] = ES_LAST_YEAR;
+	order[n++] = ES_YTD;
+	for (int i = 1; i <= 12; i++)
+		order[n++] = ES_MONTH + (tm.tm_mon + i) % 12;
+	order[n++] = ES_YESTERDAY;
+	order[n++] = ES_TODAY;
+
+	if (OF_HUMAN == format)
+		printf("  Consumed (KW)          All tariffs      Day    Night\n\r");
+	else if (OF_CSV == format && header)
+		printf("Period,Tariff,AP,AM,RP,RM,Age\n\r");
+
+	for (int i = 0; i < ES_COUNT; i++)
+	{
+		char label[BSZ];
+		energyLabel(order[i], now, label, BSZ);
+		const EnergyEntry* e = cache->entries[order[i]];
+
+		if (OF_HUMAN == format)
+		{
+			printf("  %-20s", label);
+			for (int t = 0; t < ENERGY_TARIFFS; t++)
+				if (energyCurrent(&e[t], order[i], now))
+					printf(" %11.2f", e[t].W.ap);
+				else
+					printf(" %11s", "-");
+			printf("\n\r");
+			continue;
+		}
+
+		for (int t = 0; t < ENERGY_TARIFFS; t++)
+		{
+			if (!energyCurrent(&e[t], order[i], now))
+				continue;
+			long age = (long)(now - e[t].readAt);
+			if (OF_CSV == format)
+				printf("%s,%d,%.3f,%.3f,%.3f,%.3f,%ld\n\r", label, t,
+					e[t].W.ap, e[t].W.am, e[t].W.rp, e[t].W.rm, age);
+			else
+				printf("{\"period\":\"%s\",\"tariff\":%d,\"AP\":%.3f,\"AM\":%.3f,\"RP\":%.3f,\"RM\":%.3f,\"age\":%ld}\n\r",
+					label, t, e[t].W.ap, e[t].W.am, e[t].W.rp, e[t].W.rm, age);
+		}
+	}
+}
+
+/*
+ * Print the energy history: the counters that cannot have changed come
+ * from the cache, only the others are read from the meter (within one bus
+ * lock) and stored back.
+ *
+ * Returns:
+ *	OK or the error that stopped the readout, the cached counters are
+ *	printed anyway.
+ */
+int dumpEnergy(MercuryCtx* ctx, Presence* presence, sem_t* semptr, const char* path, int format, int header, int* session)
+{
+	EnergyCache cache;
+	time_t now = time(NULL);
+	loadEnergy(path, ctx->meter.address, &cache);
+
+	int stale = 0, read = 0, res = OK;
+	for (int slot = 0; slot < ES_COUNT; slot++)
+		for (int t = 0; t < ENERGY_TARIFFS; t++)
+			if (!energyFresh(&cache.entries[slot][t], slot, now))
+				stale++;
+
+	if (stale && (!semptr || !sem_wait(semptr)))
+	{
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			int more = 0;
+			res = openSession(ctx, presence, session);
+			if (OK == res)
+				res = fetchEnergy(ctx, &cache, now, &more);
+			read += more;
+			if (CHANNEL_ISNT_OPEN != res)
+				break;
+			*session = 0;
+		}
+
+		if (COMMUNICATION_ERROR == res)
+		{
+			*session = 0;
+			presenceLost(presence);
+		}
+		if (semptr)
+			sem_post(semptr);
+
+		if (read && saveEnergy(path, &cache))
+			fprintf(stderr, "Cannot write %s.\n", path);
+	}
+
+	printEnergy(format, &cache, header, now);
+	fprintf(stderr, "%d counters, %d read from the meter\n", ES_COUNT * ENERGY_TARIFFS, read);
+	if (OK != res)
+		fprintf(stderr, "Energy history is incomplete: %s.\n",
+			(CHECK_CHANNEL_FAILURE == res) ? "the meter does not answer" :
+			(COMMUNICATION_ERROR == res) ? "communication error" : "the meter rejected a counter");
+	return res;
+}
+
 int main(int argc, const char** args)
 {
 	// must have RS485 address (1st required param)
@@ -155,7 +553,13 @@ int main(int argc, const char** args)
 	}
 
 	// get command line options
-	int dryRun = 0, dryFail = 0, format = OF_HUMAN, header = 0; 
+	int dryRun = 0, dryFail = 0, shm = 0, stats = 0, format = OF_HUMAN, header = 0, fields = OB_ALL; 
+	long interval = -1, count = -1, profileDays = 0;
+	int history = 0;
+	const char* cachePath = NULL;
+	MeterConfig meter = METER_DEFAULT;
+	MercuryCtx ctx;
+	initCtx(&ctx, -1);
 
 	char dev[BSZ];
 	strncpy(dev, args[1], BSZ);
@@ -163,7 +567,7 @@ int main(int argc, const char** args)
 	for (int i=2; i<argc; i++)
 	{
 		if (!strcmp(OPT_DEBUG, args[i]))
-			debugPrint = 1;
+			ctx.debug = stdout;
 		else if (!strcmp(OPT_TEST_RUN, args[i]))
 			dryRun = 1;
 		else if (!strcmp(OPT_TEST_FAIL, args[i]))
@@ -176,6 +580,61 @@ int main(int argc, const char** args)
 			format = OF_JSON;
 		else if (!strcmp(OPT_HEADER, args[i]))
 			header = 1;
+		else if (!strcmp(OPT_SHM, args[i]))
+			shm = 1;
+		else if (!strcmp(OPT_STATS, args[i]))
+			stats = 1;
+		else if (!strcmp(OPT_BATCH, args[i]))
+			ctx.batch = 1;
+		else if (!strcmp(OPT_FIELDS, args[i]) && i + 1 < argc)
+		{
+			fields = parseFields(args[++i]);
+			if (!fields)
+			{
+				printf("Error: %s list %s is not recognised\n\r\n\r", OPT_FIELDS, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_METER, args[i]) && i + 1 < argc)
+		{
+			if (parseMeter(args[++i], &meter))
+			{
+				printf("Error: %s %s is not recognised\n\r\n\r", OPT_METER, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_INTERVAL, args[i]) && i + 1 < argc)
+		{
+			char* end;
+			interval = strtol(args[++i], &end, 10);
+			if (end == args[i] || *end || interval <= 0)
+			{
+				printf("Error: %s %s is not a period in milliseconds (> 0)\n\r\n\r", OPT_INTERVAL, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_COUNT, args[i]) && i + 1 < argc)
+		{
+			char* end;
+			count = strtol(args[++i], &end, 10);
+			if (end == args[i] || *end || count < 0)
+			{
+				printf("Error: %s %s is not a number of samples (>= 0)\n\r\n\r", OPT_COUNT, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_PROFILE, args[i]) && i + 1 < argc)
+			profileDays = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_BINARY, args[i]))
+			format = OF_BINARY;
+		else if (!strcmp(OPT_HISTORY, args[i]))
+			history = 1;
+		else if (!strcmp(OPT_CACHE, args[i]) && i + 1 < argc)
+			cachePath = args[++i];
 		else if (!strcmp(OPT_HELP, args[i]))
 		{
 			printUsage();
@@ -195,135 +654,163 @@ int main(int argc, const char** args)
 		exit(EXIT_FAIL);
 	}
 
-	OutputBlock o;
-	bzero(&o, sizeof(o));
+	if ((OF_BINARY == format && profileDays <= 0) || (profileDays && (profileDays < 0 || shm || dryRun || dryFail)))
+	{
+		printf("Error: %s needs %s DAYS, which reads the meter only.\n\r", OPT_BINARY, OPT_PROFILE);
+		exit(EXIT_FAIL);
+	}
+
+	if (history && (profileDays || OF_BINARY == format || shm || dryRun || dryFail))
+	{
+		printf("Error: %s reads the meter only, in a text format.\n\r", OPT_HISTORY);
+		exit(EXIT_FAIL);
+	}
 
-	if (dryRun) o.ms = MS_ON;
-	if (dryFail) o.ms = MS_OFF;
+	// single sample by default, unlimited stream when the period given
+	if (count < 0)
+		count = (interval < 0) ? 1 : 0;
+	if (interval < 0)
+		interval = 0;	// back to back samples
 
-	int exitCode = OK;
+	MercurySnapshot* snapshot = NULL;
+	Presence* presenceTable = NULL;
+	int fd = -1;
+	sem_t* semptr = NULL;
 
-	if (!dryRun && !dryFail)
+	if (shm && !dryRun && !dryFail)
+	{
+		// Lock free reads of the samples published by mercury-mon
+		snapshot = openSnapshot(dev, meter.address, 0);
+		if (NULL == snapshot)
+		{
+			printf("No data published by mercury-mon.\n\r");
+			exit(EXIT_FAIL);
+		}
+	}
+	else if (!dryRun && !dryFail)
 	{
-		// Open RS485 dongle
-		// O_RDWR Read/Write access to serial port
-		// O_NOCTTY - No terminal will control the process  
-		// O_NDELAY - Non blocking open
-		int fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
+		// Open RS485 dongle (or mercury-broker socket)
+		fd = openChannel(dev);
 
 		if (fd < 0)
 		{
 			printf("Cannot open %s terminal channel.\n\r", dev);
 			exit(EXIT_FAIL);
 		}
+		ctx.fd = fd;
+		ctx.meter = meter;
+		presenceTable = openPresence(dev);
+		if (NULL == presenceTable)
+		{
+			printf("Out of memory.\n\r");
+			exit(EXIT_FAIL);
+		}
+
+		// semaphore to ensure exclusive access to the power meter,
+		// not needed when the broker owns the bus
+		char semName[NAME_MAX];
+		semaphoreName(dev, semName, sizeof(semName));
+		if (!isBrokerChannel(fd))
+		{
+			semptr = sem_open(
+					semName,           		/* name */
+					O_CREAT,                        /* create the semaphore */
+					MERCURY_ACCESS_PERM,         	/* protection perms */
+					1);                             /* initial value */
+			if (SEM_FAILED == semptr)
+			{
+				fprintf(stderr, "Semaphore open error.");
+				exit(EXIT_FAIL);      
+			}
+			/* kept, as mercury-mon and the broker keep it: an unlinked */
+			/* one would not exclude the processes that start later    */
+		}
+	}
 
-		fcntl(fd, F_SETFL, 0);
+	// Samples are taken at absolute deadlines so that the period does not drift
+	signal(SIGINT, sigint_handler);
+	signal(SIGTERM, sigint_handler);
 
-		struct termios serialPortSettings;
-		bzero(&serialPortSettings, sizeof(serialPortSettings));
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
 
-		cfsetispeed(&serialPortSettings, BAUDRATE);
-		cfsetospeed(&serialPortSettings, BAUDRATE);
+	int exitCode = OK, session = 0;
 
-		serialPortSettings.c_cflag &= PARENB;				/* Disables the Parity Enable bit(PARENB),So No Parity   */
-		serialPortSettings.c_cflag &= ~CSTOPB;				/* CSTOPB = 2 Stop bits,here it is cleared so 1 Stop bit */
-		serialPortSettings.c_cflag &= ~CSIZE;				/* Clears the mask for setting the data size             */
-		serialPortSettings.c_cflag |=  CS8;				/* Set the data bits = 8                                 */
+	if (profileDays && OK != dumpProfile(&ctx, &presenceTable[meter.address], semptr, profileDays, format, header, &session))
+		exitCode = EXIT_FAIL;
 
-		serialPortSettings.c_cflag |= CREAD | CLOCAL;			/* Enable receiver,Ignore Modem Control lines       */ 
+	char cacheName[PATH_MAX];
+	if (history)
+	{
+		if (!cachePath)
+		{
+			energyCacheName(dev, meter.address, cacheName, sizeof(cacheName));
+			cachePath = cacheName;
+		}
+		if (OK != dumpEnergy(&ctx, &presenceTable[meter.address], semptr, cachePath, format, header, &session))
+			exitCode = EXIT_FAIL;
+	}
 
-		serialPortSettings.c_iflag &= ~(IXON | IXOFF | IXANY);		/* Disable XON/XOFF flow control both i/p and o/p */
-		serialPortSettings.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);	/* Non Cannonical mode                            */
+	for (long n = 0; !profileDays && !history && !terminateNow && (!count || n < count); n++)
+	{
+		if (n && waitDeadline(&deadline, interval))
+			break;
 
-		serialPortSettings.c_oflag &= ~OPOST;				/* No Output Processing */
+		OutputBlock o;
+		bzero(&o, sizeof(o));
+		time_t sampleTime = time(NULL);
+		int sampleFields = fields;
 
-		tcflush(fd, TCIOFLUSH);
-		tcsetattr(fd, TCSANOW, &serialPortSettings);
+		if (dryRun) o.ms = MS_ON;
+		if (dryFail) o.ms = MS_OFF;
 
-		// semaphore to ensure exclusive access to the power meter 
-		sem_t* semptr = sem_open(
-					MERCURY_SEMAPHORE,           	/* name */
-					O_CREAT,                        /* create the semaphore */
-					MERCURY_ACCESS_PERM,         	/* protection perms */
-					1);                             /* initial value */
-		if (SEM_FAILED == semptr)
+		if (snapshot)
 		{
-			fprintf(stderr, "Semaphore open error.");
-			exit(EXIT_FAIL);      
-		}
-		/* unlink prevents the semaphore existing forever */
-		/* if a crash occurs during the execution         */
-		sem_unlink(MERCURY_SEMAPHORE);      
+			uint32_t valid;
+			int64_t timestamp;
 
-		// obtain exclusive access
-		if (!sem_wait(semptr))
+			if (readSnapshot(snapshot, &o, &valid, &timestamp))
+			{
+				printf("No data published by mercury-mon.\n\r");
+				exitCode = EXIT_FAIL;
+				break;
+			}
+			sampleTime = timestamp / 1000;
+			sampleFields &= valid | OB_MS;
+		}
+		else if (fd >= 0)
 		{
-			switch(checkChannel(fd))
+			// obtain exclusive access for this sample only
+			if (!semptr || !sem_wait(semptr))
 			{
-				case OK:
-					// Seems that power is on
-					o.ms = MS_ON;
-
-					if (OK != initConnection(fd)) goto stop_conversation;
-
-					// Get voltage by phases
-					if (OK != getU(fd, &o.U)) goto stop_conversation;
-
-					// Get current by phases
-					if (OK != getI(fd, &o.I)) goto stop_conversation;
-
-					// Get power cos(f) by phases
-					if (OK != getCosF(fd, &o.C)) goto stop_conversation;
-
-					// Get grid frequency
-					if (OK != getF(fd, &o.f)) goto stop_conversation;
-
-					// Get phase angles
-					if (OK != getA(fd, &o.A)) goto stop_conversation;
-
-					// Get active power consumption by phases
-					if (OK != getP(fd, &o.P)) goto stop_conversation;
-
-					// Get reactive power consumption by phases
-					if (OK != getS(fd, &o.S)) goto stop_conversation;
-
-					// Get power counter from reset, for yesterday and today
-					if (
-						OK != getW(fd, &o.PR, PP_RESET, 0, 0) ||	// total from reset
-						OK != getW(fd, &o.PRT[0], PP_RESET, 0, 0+1) ||	// day tariff from reset
-						OK != getW(fd, &o.PRT[1], PP_RESET, 0, 1+1) ||	// night tariff from reset
-						OK != getW(fd, &o.PY, PP_YESTERDAY, 0, 0) ||
-						OK != getW(fd, &o.PT, PP_TODAY, 0, 0)) goto stop_conversation;
-						
-
-				stop_conversation:
-					closeConnection(fd);
-					close(fd);
-					exitCode = OK;
-					break;
-
-				case CHECK_CHANNEL_FAILURE:
-					close(fd);
-					// assume that we are here because mains power supply is off 
-					// which caused power meter comm channel time out.
-					o.ms = MS_OFF;
-					exitCode = OK;
-					break;
-
-				default:
-					close(fd);
-					// assume that we are here because mains power supply is off 
-					o.ms = MS_OFF;
-					exitCode = OK;
-					break;
+				pollMeter(&ctx, &presenceTable[meter.address], &o, fields, &session);
+				if (semptr)
+					sem_post(semptr);
 			}
 		}
-		sem_post(semptr);
-		sem_close(semptr);
+
+		// print the results
+		printOutput(format, o, sampleFields, header && !n, sampleTime);
+		fflush(stdout);
 	}
 
-	// print the results
-	printOutput(format, o, header);
+	if (fd >= 0)
+	{
+		if (session && (!semptr || !sem_wait(semptr)))
+		{
+			closeConnection(&ctx);
+			if (semptr)
+				sem_post(semptr);
+		}
+		close(fd);
+	}
+	if (semptr)
+		sem_close(semptr);
+	closeSnapshot(snapshot);
+	closePresence(presenceTable);
+
+	if (stats)
+		printTxStats(&ctx.stats, stderr);
 
 	exit(exitCode);
 }
@@ -0,0 +1,113 @@
+/*
+ *	MODBUS RTU CRC (CRC-16/MODBUS) used by Mercury 236 protocol.
+ */
+#include <pthread.h>
+#include "mercury-crc.h"
+
+#define CRC_POLY		0xA001	// reflected 0x8005
+#define CRC_SLICES		8
+
+// crcTable[0] is the usual byte table, crcTable[k] advances the CRC by k more zero bytes
+static uint16_t crcTable[CRC_SLICES][256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+// -- Fill in the lookup tables (once per process)
+static void crcTableInit()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		uint16_t crc = i;
+		for (int bit = 8; bit != 0; bit--)
+			crc = (crc & 0x0001) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+		crcTable[0][i] = crc;
+	}
+
+	for (int k = 1; k < CRC_SLICES; k++)
+		for (int i = 0; i < 256; i++)
+			crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xFF];
+}
+
+// Compute the MODBUS RTU CRC
+// Source: http://www.ccontrolsys.com/w/How_to_Compute_the_Modbus_RTU_Message_CRC
+uint16_t crc16Bitwise(const unsigned char* buf, int len)
+{
+  uint16_t crc = 0xFFFF;
+
+  for (int pos = 0; pos < len; pos++) {
+    crc ^= (uint16_t)buf[pos];        // XOR byte into least sig. byte of crc
+
+    for (int i = 8; i != 0; i--) {    // Loop over each bit
+      if ((crc & 0x0001) != 0) {      // If the LSB is set
+        crc >>= 1;                    // Shift right and XOR 0xA001
+        crc ^= CRC_POLY;
+      }
+      else                            // Else LSB is not set
+        crc >>= 1;                    // Just shift right
+    }
+  }
+  // Note, this number has low and high bytes swapped, so use it accordingly (or swap bytes)
+  return crc;
+}
+
+// -- Continue CRC one byte at a time
+static uint16_t crc16Bytes(uint16_t crc, const unsigned char* buf, int len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *buf++) & 0xFF];
+	return crc;
+}
+
+// -- One table lookup per byte
+uint16_t crc16Table(const unsigned char* buf, int len)
+{
+	pthread_once(&crcTableOnce, crcTableInit);
+	return crc16Bytes(0xFFFF, buf, len);
+}
+
+// -- Slicing by 4: four lookups combined per 4 bytes
+uint16_t crc16Slice4(const unsigned char* buf, int len)
+{
+	pthread_once(&crcTableOnce, crcTableInit);
+
+	uint16_t crc = 0xFFFF;
+	for (; len >= 4; len -= 4, buf += 4)
+	{
+		crc ^= buf[0] | (buf[1] << 8);
+		crc = crcTable[3][crc & 0xFF] ^ crcTable[2][crc >> 8] ^
+			crcTable[1][buf[2]] ^ crcTable[0][buf[3]];
+	}
+	return crc16Bytes(crc, buf, len);
+}
+
+// -- Slicing by 8: eight lookups combined per 8 bytes
+uint16_t crc16Slice8(const unsigned char* buf, int len)
+{
+	pthread_once(&crcTableOnce, crcTableInit);
+
+	uint16_t crc = 0xFFFF;
+	for (; len >= 8; len -= 8, buf += 8)
+	{
+		crc ^= buf[0] | (buf[1] << 8);
+		crc = crcTable[7][crc & 0xFF] ^ crcTable[6][crc >> 8] ^
+			crcTable[5][buf[2]] ^ crcTable[4][buf[3]] ^
+			crcTable[3][buf[4]] ^ crcTable[2][buf[5]] ^
+			crcTable[1][buf[6]] ^ crcTable[0][buf[7]];
+	}
+	return crc16Bytes(crc, buf, len);
+}
+
+// -- CRC of the frame, variant chosen at build time
+uint16_t ModRTU_CRC(unsigned char* buf, int len)
+{
+#if CRC_SLICING == 0
+	return crc16Bitwise(buf, len);
+#elif CRC_SLICING == 1
+	return crc16Table(buf, len);
+#elif CRC_SLICING == 4
+	return crc16Slice4(buf, len);
+#elif CRC_SLICING == 8
+	return crc16Slice8(buf, len);
+#else
+#error CRC_SLICING must be 0, 1, 4 or 8
+#endif
+}
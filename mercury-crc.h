@@ -0,0 +1,27 @@
+/*
+ *	MODBUS RTU CRC (CRC-16/MODBUS) used by Mercury 236 protocol.
+ *
+ *	Table driven variants, the one used by ModRTU_CRC() is chosen at build
+ *	time with CRC_SLICING:
+ *		0 - bit by bit loop (no tables)
+ *		1 - one table lookup per byte
+ *		4 - slicing by 4 bytes
+ *		8 - slicing by 8 bytes (default)
+ */
+#ifndef MERCURY_CRC_H
+#define MERCURY_CRC_H
+
+#include <stdint.h>
+
+#ifndef CRC_SLICING
+#define CRC_SLICING		8
+#endif
+
+// Function prototypes:
+uint16_t ModRTU_CRC(unsigned char*, int);
+uint16_t crc16Bitwise(const unsigned char*, int);
+uint16_t crc16Table(const unsigned char*, int);
+uint16_t crc16Slice4(const unsigned char*, int);
+uint16_t crc16Slice8(const unsigned char*, int);
+
+#endif
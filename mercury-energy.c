@@ -0,0 +1,233 @@
+/*
+ *	Mercury 236 energy history with the local cache.
+ */
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "mercury-energy.h"
+
+// -- Default cache file of the meter on the port
+void energyCacheName(const char* dev, int address, char* name, int size)
+{
+	char port[NAME_MAX];
+	portName(dev, port, sizeof(port));
+
+	if (PM_ADDRESS == address)
+		snprintf(name, size, "%s.%s", ENERGY_CACHE, port);
+	else
+		snprintf(name, size, "%s.%s.%d", ENERGY_CACHE, port, address);
+}
+
+// -- Local time of the day start, the day may be out of the month range (mktime normalises)
+static time_t dayStart(int year, int month, int day)
+{
+	struct tm tm =
+	{
+		.tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day, .tm_isdst = -1
+	};
+	return mktime(&tm);
+}
+
+// -- Calendar period the register holds at the time given (0 where not applicable)
+void energyPeriod(int slot, time_t now, int* year, int* month, int* day)
+{
+	struct tm tm;
+	localtime_r(&now, &tm);
+	int y = tm.tm_year + 1900, m = tm.tm_mon + 1;
+
+	*year = *month = *day = 0;
+	switch (slot)
+	{
+		case ES_RESET:
+			break;
+
+		case ES_YTD:
+			*year = y;
+			break;
+
+		case ES_LAST_YEAR:
+			*year = y - 1;
+			break;
+
+		case ES_TODAY:
+			*year = y;
+			*month = m;
+			*day = tm.tm_mday;
+			break;
+
+		case ES_YESTERDAY:
+		{
+			time_t yesterday = dayStart(y, m, tm.tm_mday - 1);
+			localtime_r(&yesterday, &tm);
+			*year = tm.tm_year + 1900;
+			*month = tm.tm_mon + 1;
+			*day = tm.tm_mday;
+			break;
+		}
+
+		default:
+			// this year up to the current month, last year after it
+			*month = slot - ES_MONTH + 1;
+			*year = (*month <= m) ? y : y - 1;
+			break;
+	}
+}
+
+// -- The period closes (the counters stop changing), -1 if it never does
+static time_t closesAt(int slot, int year, int month, int day)
+{
+	switch (slot)
+	{
+		case ES_LAST_YEAR: return dayStart(year + 1, 1, 1);
+		case ES_YESTERDAY: return dayStart(year, month, day + 1);
+		case ES_RESET:
+		case ES_YTD:
+		case ES_TODAY: return -1;
+		default: return dayStart(year, month + 1, 1);
+	}
+}
+
+// -- Printable name of the period the register holds, e.g. 2026-03
+void energyLabel(int slot, time_t now, char* label, int size)
+{
+	int year, month, day;
+	energyPeriod(slot, now, &year, &month, &day);
+
+	if (ES_RESET == slot)
+		snprintf(label, size, "reset");
+	else if (day)
+		snprintf(label, size, "%04d-%02d-%02d", year, month, day);
+	else if (month)
+		snprintf(label, size, "%04d-%02d", year, month);
+	else
+		snprintf(label, size, "%04d", year);
+}
+
+// -- The cached counters are of the period the register holds now (maybe not fresh)
+int energyCurrent(const EnergyEntry* e, int slot, time_t now)
+{
+	int year, month, day;
+	energyPeriod(slot, now, &year, &month, &day);
+	return e->readAt && e->year == year && e->month == month && e->day == day;
+}
+
+/*
+ * The cached counters can be used instead of reading the meter: the same
+ * period, closed (and settled) when read, or read less than
+ * ENERGY_MAX_AGE ago.
+ */
+int energyFresh(const EnergyEntry* e, int slot, time_t now)
+{
+	if (!energyCurrent(e, slot, now))
+		return 0;
+
+	int year, month, day;
+	energyPeriod(slot, now, &year, &month, &day);
+	time_t closes = closesAt(slot, year, month, day);
+	if (closes >= 0 && e->readAt >= closes + ENERGY_SETTLE)
+		return 1;
+	return e->readAt <= now && now - e->readAt < ENERGY_MAX_AGE;
+}
+
+// -- Load the cache of the meter, returns -1 (and an empty cache) if there is none
+int loadEnergy(const char* path, int address, EnergyCache* cache)
+{
+	memset(cache, 0, sizeof(EnergyCache));
+
+	FILE* f = fopen(path, "rb");
+	int ok = (NULL != f && 1 == fread(cache, sizeof(EnergyCache), 1, f) &&
+		!memcmp(cache->magic, ENERGY_MAGIC, sizeof(cache->magic)) &&
+		ENERGY_VERSION == cache->version && address == cache->address);
+	if (f)
+		fclose(f);
+
+	if (!ok)
+	{
+		memset(cache, 0, sizeof(EnergyCache));
+		memcpy(cache->magic, ENERGY_MAGIC, sizeof(cache->magic));
+		cache->version = ENERGY_VERSION;
+		cache->address = address;
+		return -1;
+	}
+	return 0;
+}
+
+// -- Store the cache, replaced atomically so that a crash leaves the old or the new one
+int saveEnergy(const char* path, const EnergyCache* cache)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE* f = fopen(tmp, "wb");
+	if (NULL == f)
+		return -1;
+
+	int ok = (1 == fwrite(cache, sizeof(EnergyCache), 1, f));
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp, path))
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the counters that are not fresh in the cache from the meter.
+ *
+ * Parameters:
+ *	read - receives the number of registers read.
+ *
+ * Returns:
+ *	COMMUNICATION_ERROR, CHANNEL_ISNT_OPEN - stopped, the registers read
+ *		so far are in the cache.
+ *	ILLEGAL_CMD etc. - the first register the meter has rejected, the
+ *		others are read.
+ *	OK - means ok.
+ */
+int fetchEnergy(MercuryCtx* ctx, EnergyCache* cache, time_t now, int* read)
+{
+	int result = OK;
+	*read = 0;
+
+	for (int slot = 0; slot < ES_COUNT; slot++)
+	{
+		int periodId, month = 0;
+		switch (slot)
+		{
+			case ES_RESET: periodId = PP_RESET; break;
+			case ES_YTD: periodId = PP_YTD; break;
+			case ES_LAST_YEAR: periodId = PP_LAST_YEAR; break;
+			case ES_TODAY: periodId = PP_TODAY; break;
+			case ES_YESTERDAY: periodId = PP_YESTERDAY; break;
+			default: periodId = PP_MONTH; month = slot - ES_MONTH + 1; break;
+		}
+
+		for (int tariff = 0; tariff < ENERGY_TARIFFS; tariff++)
+		{
+			EnergyEntry* e = &cache->entries[slot][tariff];
+			if (energyFresh(e, slot, now))
+				continue;
+
+			PWV W;
+			int res = getW(ctx, &W, periodId, month, tariff);
+			if (COMMUNICATION_ERROR == res || CHANNEL_ISNT_OPEN == res)
+				return res;
+			if (OK != res)
+			{
+				if (OK == result)
+					result = res;
+				continue;
+			}
+
+			e->readAt = now;
+			energyPeriod(slot, now, &e->year, &e->month, &e->day);
+			e->W = W;
+			(*read)++;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,75 @@
+/*
+ *	Mercury 236 energy history: the counters of the last 12 months, this
+ *	year, last year, today, yesterday and from reset, for all tariffs and
+ *	by tariff (getW()), with a local cache file.
+ *
+ *	The counters of a closed period (a past month, last year, yesterday)
+ *	do not change, the cached value is kept until the meter reuses the
+ *	register for another period: month registers hold the current year
+ *	up to the current month and last year after it, as the meter keeps
+ *	them. Open periods (today, this month, this year, from reset) are
+ *	read again once older than ENERGY_MAX_AGE. A value read just after
+ *	the period closed is not trusted as closed until ENERGY_SETTLE has
+ *	passed, the meter clock may lag behind the host one.
+ *
+ *	Periods are in the host local time. The cache is a small file per
+ *	meter, ENERGY_CACHE.PORT for PM_ADDRESS and ENERGY_CACHE.PORT.ADDR for
+ *	the others (see portName()), replaced atomically when updated.
+ */
+#ifndef MERCURY_ENERGY_H
+#define MERCURY_ENERGY_H
+
+#include <stdint.h>
+#include <time.h>
+#include "mercury236.h"
+
+#define ENERGY_CACHE		"/var/tmp/mercury-energy"
+#define ENERGY_MAGIC		"MERCENRG"
+#define ENERGY_VERSION		1
+#define ENERGY_TARIFFS		(TARRIF_NUM + 1)	// all tariffs, then by tariff
+#define ENERGY_MAX_AGE		60		// open period counters are read again after (sec)
+#define ENERGY_SETTLE		300		// closed period counters trusted after (sec)
+
+// Counter registers of the meter
+typedef enum
+{
+	ES_RESET = 0,		// from reset
+	ES_YTD,			// this year
+	ES_LAST_YEAR,		// last year
+	ES_TODAY,		// today
+	ES_YESTERDAY,		// yesterday
+	ES_MONTH,		// January, ES_MONTH + 11 - December
+	ES_COUNT = ES_MONTH + 12
+} EnergySlot;
+
+// Cached counters of one register and tariff
+typedef struct
+{
+	int64_t		readAt;			// sec since epoch, 0 - never read
+	int32_t		year;			// calendar period the value is for,
+	int32_t		month;			// 0 where not applicable
+	int32_t		day;
+	int32_t		reserved;
+	PWV		W;			// kWh, kvarh
+} EnergyEntry;
+
+// Cache file of a meter
+typedef struct
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	address;		// RS485 address of the meter
+	EnergyEntry	entries[ES_COUNT][ENERGY_TARIFFS];
+} EnergyCache;
+
+// Function prototypes:
+void energyCacheName(const char* dev, int address, char* name, int size);
+void energyPeriod(int slot, time_t now, int* year, int* month, int* day);
+void energyLabel(int slot, time_t now, char* label, int size);
+int energyCurrent(const EnergyEntry*, int slot, time_t now);
+int energyFresh(const EnergyEntry*, int slot, time_t now);
+int loadEnergy(const char* path, int address, EnergyCache*);
+int saveEnergy(const char* path, const EnergyCache*);
+int fetchEnergy(MercuryCtx*, EnergyCache*, time_t now, int* read);
+
+#endif
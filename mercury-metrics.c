@@ -0,0 +1,362 @@
+/*
+ *	Mercury 236 metrics endpoint.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "mercury-metrics.h"
+
+#define SCRAPE_TIME_OUT		200	// wait for the request / client to read (ms)
+#define TRUNCATED_RESERVE	256	// room kept for the truncation counter
+
+// Poll cycle time histogram bounds (sec)
+static const double cycleBounds[METRICS_CYCLE_BUCKETS] =
+	{ 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+
+// ResultCode values and names, in the order of PollHealth.results
+static const int resultCodes[METRICS_RESULTS] =
+{
+	OK, ILLEGAL_CMD, INTERNAL_COUNTER_ERR, PERMISSION_DENIED, CLOCK_ALREADY_CORRECTED,
+	CHANNEL_ISNT_OPEN, WRONG_RESULT_SIZE, WRONG_CRC, CHECK_CHANNEL_FAILURE, COMMUNICATION_ERROR
+};
+static const char* resultNames[METRICS_RESULTS] =
+{
+	"OK", "ILLEGAL_CMD", "INTERNAL_COUNTER_ERR", "PERMISSION_DENIED", "CLOCK_ALREADY_CORRECTED",
+	"CHANNEL_ISNT_OPEN", "WRONG_RESULT_SIZE", "WRONG_CRC", "CHECK_CHANNEL_FAILURE", "COMMUNICATION_ERROR"
+};
+
+static const char* outcomeNames[TX_OUTCOMES] = { "ok", "crc", "size", "comm", "meter" };
+
+// Labels of the per meter lines, port and address
+#define METER_LABELS		"port=\"%s\",meter=\"%d\""
+
+// Published text, the server keeps its own copy while writing it out
+static char published[METRICS_BSZ];
+static int publishedLen = 0;
+static time_t publishedSample = 0;
+static pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int listenSd = -1;
+static char listenPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static pthread_t server;
+static unsigned long truncatedRenders = 0;	// renders cut short by the buffer size
+
+// -- Account one poll cycle
+void recordPoll(PollHealth* h, int result, int64_t cycleUs)
+{
+	h->polls++;
+	for (int i = 0; i < METRICS_RESULTS; i++)
+		if (resultCodes[i] == result)
+			h->results[i]++;
+
+	double sec = cycleUs / 1e6;
+	int b = 0;
+	while (b < METRICS_CYCLE_BUCKETS && sec > cycleBounds[b])
+		b++;
+	h->cycleHist[b]++;
+	h->cycleSum += sec;
+
+	if (OK == result)
+		h->lastSample = time(NULL);
+}
+
+// -- Value labels of the parameter
+static const char* valueLabel(const ParamDesc* p, int i)
+{
+	static const char* phases[] = { "p1", "p2", "p3" };
+	static const char* phasesSum[] = { "sum", "p1", "p2", "p3" };
+	static const char* power[] = { "ap", "am", "rp", "rm" };
+
+	if (0x05 == p->command)
+		return power[i];
+	return (4 == p->count) ? phasesSum[i] : phases[i];
+}
+
+/*
+ * Render readings and health of the meters into the buffer, bus
+ * transactions are accounted by port, the samples handed over to the
+ * sinks by sink and port. When the buffer is too small the text ends
+ * with the last complete line and mercury_metrics_truncated_total grows
+ * (one caller at a time).
+ *
+ * Returns:
+ *	text length.
+ */
+int renderMetrics(char* buf, int size, const MeterMetrics* meters, int count,
+	const PortMetrics* ports, int portCount, const SinkMetrics* sinks, int sinkCount)
+{
+	// every EMIT is a line, a line that does not fit ends the text
+	int len = 0, limit = size - TRUNCATED_RESERVE, truncated = 0;
+#define EMIT(...) do { \
+		if (!truncated) \
+		{ \
+			int n = snprintf(buf + len, limit - len, __VA_ARGS__); \
+			if (n < limit - len) \
+				len += n; \
+			else \
+				truncated = 1; \
+		} \
+	} while (0)
+
+	EMIT("# HELP mercury_value Latest power meter readings.\n");
+	EMIT("# TYPE mercury_value gauge\n");
+	for (int m = 0; m < count; m++)
+		for (int p = 0; p < PARAM_COUNT; p++)
+		{
+			const ParamDesc* desc = &paramTable[p];
+			if (!(meters[m].valid & desc->field))
+				continue;
+
+			const float* values = (const float*)((const byte*)meters[m].o + desc->target);
+			for (int i = 0; i < desc->count; i++)
+				if (1 == desc->count)
+					EMIT("mercury_value{" METER_LABELS ",param=\"%s\"} %.3f\n",
+						meters[m].port, meters[m].address, desc->name, values[i]);
+				else
+					EMIT("mercury_value{" METER_LABELS ",param=\"%s\",value=\"%s\"} %.3f\n",
+						meters[m].port, meters[m].address, desc->name, valueLabel(desc, i), values[i]);
+		}
+
+	EMIT("# HELP mercury_mains Mains status (1 - ON, 0 - OFF).\n");
+	EMIT("# TYPE mercury_mains gauge\n");
+	for (int m = 0; m < count; m++)
+		if (meters[m].valid & OB_MS)
+			EMIT("mercury_mains{" METER_LABELS "} %d\n",
+				meters[m].port, meters[m].address, (MS_ON == meters[m].o->ms) ? 1 : 0);
+
+	EMIT("# HELP mercury_polls_total Poll cycles by result code.\n");
+	EMIT("# TYPE mercury_polls_total counter\n");
+	for (int m = 0; m < count; m++)
+		for (int i = 0; i < METRICS_RESULTS; i++)
+			EMIT("mercury_polls_total{" METER_LABELS ",result=\"%s\"} %lu\n",
+				meters[m].port, meters[m].address, resultNames[i], meters[m].health->results[i]);
+
+	EMIT("# HELP mercury_poll_cycle_seconds Poll cycle time, bus lock included.\n");
+	EMIT("# TYPE mercury_poll_cycle_seconds histogram\n");
+	for (int m = 0; m < count; m++)
+	{
+		const PollHealth* h = meters[m].health;
+		unsigned long cumulative = 0;
+		for (int b = 0; b < METRICS_CYCLE_BUCKETS; b++)
+		{
+			cumulative += h->cycleHist[b];
+			EMIT("mercury_poll_cycle_seconds_bucket{" METER_LABELS ",le=\"%g\"} %lu\n",
+				meters[m].port, meters[m].address, cycleBounds[b], cumulative);
+		}
+		EMIT("mercury_poll_cycle_seconds_bucket{" METER_LABELS ",le=\"+Inf\"} %lu\n",
+			meters[m].port, meters[m].address, h->polls);
+		EMIT("mercury_poll_cycle_seconds_sum{" METER_LABELS "} %.6f\n",
+			meters[m].port, meters[m].address, h->cycleSum);
+		EMIT("mercury_poll_cycle_seconds_count{" METER_LABELS "} %lu\n",
+			meters[m].port, meters[m].address, h->polls);
+	}
+
+	EMIT("# HELP mercury_last_sample_timestamp_seconds Time of the last successful poll.\n");
+	EMIT("# TYPE mercury_last_sample_timestamp_seconds gauge\n");
+	for (int m = 0; m < count; m++)
+		EMIT("mercury_last_sample_timestamp_seconds{" METER_LABELS "} %ld\n",
+			meters[m].port, meters[m].address, (long)meters[m].health->lastSample);
+
+	TxStats tx[TX_KEYS];
+	EMIT("# HELP mercury_tx_total Bus transactions by request and outcome.\n");
+	EMIT("# TYPE mercury_tx_total counter\n");
+	for (int p = 0; p < portCount; p++)
+	{
+		int keys = getTxStats(ports[p].stats, tx, TX_KEYS);
+		for (int k = 0; k < keys; k++)
+			for (int i = 0; i < TX_OUTCOMES; i++)
+				if (tx[k].outcomes[i])
+					EMIT("mercury_tx_total{port=\"%s\",cmd=\"%02X\",param=\"%02X\",bwri=\"%02X\",outcome=\"%s\"} %lu\n",
+						ports[p].port, tx[k].command, tx[k].paramId, tx[k].BWRI, outcomeNames[i], tx[k].outcomes[i]);
+		for (int i = 0; i < TX_OUTCOMES; i++)
+			if (ports[p].stats->other.outcomes[i])
+				EMIT("mercury_tx_total{port=\"%s\",cmd=\"other\",param=\"\",bwri=\"\",outcome=\"%s\"} %lu\n",
+					ports[p].port, outcomeNames[i], ports[p].stats->other.outcomes[i]);
+	}
+	EMIT("# HELP mercury_tx_retries_total Commands repeated after broken responces.\n");
+	EMIT("# TYPE mercury_tx_retries_total counter\n");
+	for (int p = 0; p < portCount; p++)
+	{
+		int keys = getTxStats(ports[p].stats, tx, TX_KEYS);
+		for (int k = 0; k < keys; k++)
+			EMIT("mercury_tx_retries_total{port=\"%s\",cmd=\"%02X\",param=\"%02X\",bwri=\"%02X\"} %lu\n",
+				ports[p].port, tx[k].command, tx[k].paramId, tx[k].BWRI, tx[k].retries);
+		if (ports[p].stats->other.count)
+			EMIT("mercury_tx_retries_total{port=\"%s\",cmd=\"other\",param=\"\",bwri=\"\"} %lu\n",
+				ports[p].port, ports[p].stats->other.retries);
+	}
+
+	EMIT("# HELP mercury_sink_samples_total Samples handed over to the sinks by outcome.\n");
+	EMIT("# TYPE mercury_sink_samples_total counter\n");
+	for (int i = 0; i < sinkCount; i++)
+	{
+		const SinkMetrics* s = &sinks[i];
+		EMIT("mercury_sink_samples_total{sink=\"%s\",port=\"%s\",outcome=\"pushed\"} %llu\n",
+			s->sink, s->port, (unsigned long long)s->pushed);
+		EMIT("mercury_sink_samples_total{sink=\"%s\",port=\"%s\",outcome=\"dropped\"} %llu\n",
+			s->sink, s->port, (unsigned long long)s->dropped);
+		EMIT("mercury_sink_samples_total{sink=\"%s\",port=\"%s\",outcome=\"overwritten\"} %llu\n",
+			s->sink, s->port, (unsigned long long)s->overwritten);
+	}
+	EMIT("# HELP mercury_sink_queued Samples waiting for the sinks.\n");
+	EMIT("# TYPE mercury_sink_queued gauge\n");
+	for (int i = 0; i < sinkCount; i++)
+		EMIT("mercury_sink_queued{sink=\"%s\",port=\"%s\"} %llu\n",
+			sinks[i].sink, sinks[i].port, (unsigned long long)sinks[i].queued);
+#undef EMIT
+
+	if (truncated)
+		truncatedRenders++;
+	len += snprintf(buf + len, size - len,
+		"# HELP mercury_metrics_truncated_total Renders cut short, the metrics text did not fit.\n"
+		"# TYPE mercury_metrics_truncated_total counter\n"
+		"mercury_metrics_truncated_total %lu\n", truncatedRenders);
+	return (len < size) ? len : size - 1;
+}
+
+// -- Replace the text served, called once per poll (lastSample of the meter polled least recently)
+void publishMetrics(const char* text, int len, time_t lastSample)
+{
+	if (len > METRICS_BSZ)
+		len = METRICS_BSZ;
+
+	pthread_mutex_lock(&publishLock);
+	memcpy(published, text, len);
+	publishedLen = len;
+	publishedSample = lastSample;
+	pthread_mutex_unlock(&publishLock);
+}
+
+// -- Answer one scrape from the copy of the published text
+static void serveScrape(int sd, char* text)
+{
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = SCRAPE_TIME_OUT * 1000 };
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	// the request itself does not matter, everything is served on any path
+	char request[1024];
+	read(sd, request, sizeof(request));
+
+	pthread_mutex_lock(&publishLock);
+	int len = publishedLen;
+	time_t lastSample = publishedSample;
+	memcpy(text, published, len);
+	pthread_mutex_unlock(&publishLock);
+
+	// the age keeps growing if the polling loop is stuck
+	char age[256];
+	int ageLen = snprintf(age, sizeof(age),
+		"# HELP mercury_last_sample_age_seconds Seconds since the last successful poll of the meter polled least recently.\n"
+		"# TYPE mercury_last_sample_age_seconds gauge\n"
+		"mercury_last_sample_age_seconds %ld\n",
+		(lastSample) ? (long)(time(NULL) - lastSample) : -1L);
+	if (ageLen >= (int)sizeof(age))
+		ageLen = sizeof(age) - 1;
+
+	char header[128];
+	int headerLen = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",
+		len + ageLen);
+
+	// a scraper gone before the reply must not kill the monitor with SIGPIPE
+	if (send(sd, header, headerLen, MSG_NOSIGNAL) == headerLen && send(sd, text, len, MSG_NOSIGNAL) == len)
+		send(sd, age, ageLen, MSG_NOSIGNAL);
+}
+
+// -- Server thread: accept and answer scrapes one by one
+static void* serveMetrics(void* arg)
+{
+	char* text = malloc(METRICS_BSZ);
+	if (!text)
+		return NULL;
+
+	for (;;)
+	{
+		int sd = accept(listenSd, NULL, NULL);
+		if (sd < 0)
+			continue;
+		serveScrape(sd, text);
+		close(sd);
+	}
+	return NULL;
+}
+
+/*
+ * Start serving metrics. Numeric address is a TCP port on the loopback
+ * interface, anything else is a Unix socket path.
+ *
+ * Returns:
+ *	0 - serving, -1 - failed.
+ */
+int startMetrics(const char* addr)
+{
+	char* end;
+	long port = strtol(addr, &end, 10);
+	int bound;
+
+	if (!*end)
+	{
+		struct sockaddr_in in;
+		bzero(&in, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		int on = 1;
+		listenSd = socket(AF_INET, SOCK_STREAM, 0);
+		bound = listenSd >= 0 && port > 0 && port < 65536 &&
+			!setsockopt(listenSd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) &&
+			!bind(listenSd, (struct sockaddr*)&in, sizeof(in));
+	}
+	else
+	{
+		struct sockaddr_un un;
+		bzero(&un, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, addr, sizeof(un.sun_path) - 1);
+		unlink(un.sun_path);
+
+		listenSd = socket(AF_UNIX, SOCK_STREAM, 0);
+		bound = listenSd >= 0 && !bind(listenSd, (struct sockaddr*)&un, sizeof(un));
+		if (bound)
+		{
+			strcpy(listenPath, un.sun_path);
+			chmod(listenPath, MERCURY_ACCESS_PERM);
+		}
+	}
+
+	if (bound && !listen(listenSd, 8) && !pthread_create(&server, NULL, serveMetrics, NULL))
+		return 0;
+
+	if (listenSd >= 0)
+		close(listenSd);
+	listenSd = -1;
+	return -1;
+}
+
+// -- Stop serving, remove the Unix socket
+void stopMetrics()
+{
+	if (listenSd < 0)
+		return;
+
+	pthread_cancel(server);
+	pthread_join(server, NULL);
+	close(listenSd);
+	listenSd = -1;
+
+	if (*listenPath)
+		unlink(listenPath);
+}
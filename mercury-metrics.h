@@ -0,0 +1,70 @@
+/*
+ *	Mercury 236 metrics endpoint.
+ *
+ *	The monitor renders its latest readings and health into a text buffer
+ *	(Prometheus exposition format) once per poll and hands it over with
+ *	publishMetrics(). A server thread answers HTTP scrapes on a local TCP
+ *	port or a Unix socket from the copy of that buffer only, so scrapes
+ *	never touch the serial line nor wait for the polling loop.
+ *
+ *	$ curl http://127.0.0.1:9236/metrics
+ *	$ curl --unix-socket /tmp/mercury-metrics.sock http://localhost/metrics
+ */
+#ifndef MERCURY_METRICS_H
+#define MERCURY_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "mercury236.h"
+
+#define METRICS_BSZ		(1 << 20)	// rendered metrics text limit, about 7 KB per meter
+#define METRICS_RESULTS		10	// ResultCode values accounted
+#define METRICS_CYCLE_BUCKETS	10	// poll cycle time histogram buckets (+Inf excluded)
+
+// Poll loop health
+typedef struct
+{
+	unsigned long	polls;				// poll cycles done
+	unsigned long	results[METRICS_RESULTS];	// poll cycles by ResultCode
+	unsigned long	cycleHist[METRICS_CYCLE_BUCKETS + 1];	// non-cumulative, the last is +Inf
+	double		cycleSum;			// total poll cycle time (sec)
+	time_t		lastSample;			// time of the last successful poll, 0 if none
+} PollHealth;
+
+// Readings and health of one meter on the bus
+typedef struct
+{
+	const char*		port;			// port name (portName()), the port label
+	int			address;		// RS485 address, the meter label
+	const PollHealth*	health;
+	const OutputBlock*	o;
+	uint32_t		valid;			// fields of o to render (OutputField mask)
+} MeterMetrics;
+
+// Bus transactions of one port
+typedef struct
+{
+	const char*		port;
+	const TxStatsTable*	stats;
+} PortMetrics;
+
+// Samples handed over to one sink of the monitor by one port
+typedef struct
+{
+	const char*		sink;			// sink name, the sink label
+	const char*		port;
+	uint64_t		pushed;			// queued for the sink
+	uint64_t		dropped;		// not queued, the sink was behind
+	uint64_t		overwritten;		// queued, lost before the sink took them
+	uint64_t		queued;			// waiting for the sink
+} SinkMetrics;
+
+// Function prototypes:
+void recordPoll(PollHealth*, int result, int64_t cycleUs);
+int renderMetrics(char* buf, int size, const MeterMetrics*, int count, const PortMetrics*, int portCount,
+	const SinkMetrics*, int sinkCount);
+int startMetrics(const char* addr);
+void publishMetrics(const char* text, int len, time_t lastSample);
+void stopMetrics();
+
+#endif
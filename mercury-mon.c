@@ -44,20 +44,44 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <signal.h>
+#include <pthread.h>
 #include <semaphore.h>
 #include <syslog.h>
 #include <fcntl.h>
-#include <termios.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 #include "mercury236.h"
+#include "mercury-shm.h"
+#include "mercury-metrics.h"
+#include "mercury-tsdb.h"
+#include "mercury-rollup.h"
+#include "mercury-sched.h"
+#include "mercury-presence.h"
+#include "mercury-profile.h"
+#include "mercury-ring.h"
 
 #define BSZ	                255
 #define OPT_DEBUG		"--debug"
 #define OPT_HELP		"--help"
+#define OPT_METRICS		"--metrics"
+#define OPT_STORE		"--store"
+#define OPT_ROLLUP		"--rollup"
+#define OPT_PROFILE		"--profile"
+#define OPT_PERIODS		"--periods"
+#define OPT_METER		"--meter"
+#define OPT_PORT		"--port"
 
-int debugPrint = 0;
+#define KEEP_ALIVE_TIME		(SESSION_TIME_OUT / 2)	// Session keep-alive ping period (sec)
+#define MAX_METERS		16			// Meters polled on one bus
+#define MAX_PORTS		8			// Buses polled in parallel, a worker thread each
+#define PROFILE_SYNC_DELAY	60			// Load profile sync after the period closes (sec)
+#define PROFILE_RETRY_TIME	60			// Load profile sync retry after an error (sec)
 
 typedef enum
 {
@@ -72,21 +96,148 @@ void printUsage()
 	printf("  RS485\t\taddress of RS485 dongle (e.g. /dev/ttyUSB0), required.\n\r");
         printf("  MaxPower\tpower (Watt) allowed, if this value exceeded, monitor calls script to deactivate some consumers.");
         printf("  LogFactor\twrite to log 1 of LogFactor power measurments to log file.\n\r");
-        printf("  PollTime\tpower meter poll time cycle (seconds).\n\r");
+        printf("  PollTime\tpower (P, S) poll period (seconds), shortens while the load changes fast.\n\r");
 	printf("  %s\tto print extra debug info.\n\r", OPT_DEBUG);
+        printf("  %s ADDR\tserve readings and health for scraping, ADDR is a TCP port on\n\r", OPT_METRICS);
+        printf("\t\t127.0.0.1 (e.g. 9236) or a Unix socket path.\n\r");
+        printf("  %s FILE\tappend every sample to the time-series store (see mercury-query).\n\r", OPT_STORE);
+        printf("  %s FILE\tkeep minute, hour and day aggregates in the file (see mercury-query).\n\r", OPT_ROLLUP);
+        printf("  %s FILE\tappend the load profile records to the file (as mercury236 %s\n\r", OPT_PROFILE, OPT_PROFILE);
+        printf("\t\tDAYS --binary), only the ones after FILE.cursor are read.\n\r");
+        printf("  %s LIST\tpoll periods by parameter (seconds, 0 - do not poll), default\n\r", OPT_PERIODS);
+        printf("\t\tP=S=PollTime,U=I=5,F=A=CosF=30,PR=PR-day=PR-night=PY=PT=300, e.g. U=1,A=0\n\r");
+        printf("  %s ADDR[:PASSWORD[:LEVEL]][@WEIGHT]\n\r", OPT_METER);
+        printf("\t\tmeter on the bus (repeat for every meter, default the only meter at\n\r");
+        printf("\t\taddress %d), password digits (default 111111), access level (default 1),\n\r", PM_ADDRESS);
+        printf("\t\tWEIGHT times shorter poll periods; with several meters the store and\n\r");
+        printf("\t\trollup files get the .ADDR suffix.\n\r");
+        printf("  %s DEV\tone more RS485 dongle polled in parallel, %s options that follow\n\r", OPT_PORT, OPT_METER);
+        printf("\t\tgo to this port; with several ports the store and rollup files get the\n\r");
+        printf("\t\t.PORT suffix (e.g. .ttyUSB1).\n\r");
 	printf("\n\r");
 	printf("  %s\tprints this screen.\n\r", OPT_HELP);
 	printf("\n\r");
         printf("Press Ctrl+C to exit.\n\r");
 }
 
+// Monitor settings, read only once the port workers run
+typedef struct
+{
+        int             maxPower;               // power allowed (W), all meters together
+        int             logFactor;              // log 1 of logFactor power readings
+        int             periods[PARAM_COUNT];   // poll periods by parameter (ms)
+        int             debug;                  // trace the bus transactions
+        const char*     metrics;
+        const char*     store;
+        const char*     rollupFile;
+        const char*     profileFile;
+} Settings;
+
+Settings settings;
+
+// Guards the flags below, the meter views and the port statistics copies
+pthread_mutex_t monitorLock = PTHREAD_MUTEX_INITIALIZER;
 int terminateMonitorNow = 0;
+int channelLost = 0;
 
-// -- Signal Handler for SIGINT 
-void sigint_handler(int sig_num)
+// Event sources of a port worker
+typedef struct
+{
+        int     epfd;                   // epoll set of the descriptors below
+        int     timerfd;                // next poll or keep-alive deadline
+        int     wakefd;                 // eventfd: terminate or reload requested
+        int     channel;                // RS485 dongle or broker socket: hang up only
+} EventLoop;
+
+/*
+ * Block the signals in every thread, they come to the main thread through
+ * the signalfd. Call before any thread is started so that they inherit it.
+ *
+ * Returns:
+ *	signalfd for SIGINT, SIGTERM (exit) and SIGHUP (reload), -1 - failed.
+ */
+int openSignals()
 {
-        printf("\nTerminating monitor by Ctrl+C...\n");
-        terminateMonitorNow = 1;
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+
+        return (sigprocmask(SIG_BLOCK, &mask, NULL)) ? -1 : signalfd(-1, &mask, SFD_CLOEXEC);
+}
+
+/*
+ * Set up the event loop of a port worker.
+ *
+ * Returns:
+ *	0 - ok, -1 - failed.
+ */
+int openEventLoop(EventLoop* loop)
+{
+        loop->channel = -1;
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        loop->wakefd = eventfd(0, EFD_CLOEXEC);
+        if (loop->epfd < 0 || loop->timerfd < 0 || loop->wakefd < 0)
+                return -1;
+
+        struct epoll_event timer = { .events = EPOLLIN, .data.fd = loop->timerfd };
+        struct epoll_event wake = { .events = EPOLLIN, .data.fd = loop->wakefd };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &timer) ||
+                epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &wake))
+                return -1;
+        return 0;
+}
+
+// -- Watch the channel for hang up (unplugged dongle, broker gone), its data is read by the library
+int watchChannel(EventLoop* loop, int fd)
+{
+        struct epoll_event ev = { .events = 0, .data.fd = fd };
+        loop->channel = fd;
+        return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void closeEventLoop(EventLoop* loop)
+{
+        close(loop->wakefd);
+        close(loop->timerfd);
+        close(loop->epfd);
+}
+
+// -- Interrupt the wait of the worker (the flags to act on are set by the caller)
+void wakeEventLoop(EventLoop* loop)
+{
+        uint64_t one = 1;
+        write(loop->wakefd, &one, sizeof(one));
+}
+
+/*
+ * Wait until the deadline (ms, monotonic) or a wake up.
+ *
+ * Returns:
+ *	0 - ok, -1 - the channel hung up.
+ */
+int runEventLoop(EventLoop* loop, int64_t deadline)
+{
+        struct itimerspec at = { .it_value = { .tv_sec = deadline / 1000, .tv_nsec = deadline % 1000 * 1000000 } };
+        if (deadline <= 0)
+                at.it_value.tv_nsec = 1;        // zero would disarm the timer
+        timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &at, NULL);
+
+        for (;;)
+        {
+                struct epoll_event ev;
+                if (epoll_wait(loop->epfd, &ev, 1, -1) < 1)
+                        continue;
+                if (ev.data.fd == loop->channel)
+                        return -1;
+
+                // timer expirations or wake ups, either way the worker looks at its state
+                uint64_t count;
+                read(ev.data.fd, &count, sizeof(count));
+                return 0;
+        }
 }
 
 // -- All checks for current power go here
@@ -105,6 +256,979 @@ void handleConsumptionUpdate(float currentPower, float maxPower)
         }
 }
 
+// -- Exclusive access to the RS485 bus (no semaphore when connected to the broker)
+int lockBus(sem_t* semptr)
+{
+        return (semptr) ? sem_wait(semptr) : 0;
+}
+
+void unlockBus(sem_t* semptr)
+{
+        if (semptr)
+                sem_post(semptr);
+}
+
+// -- Power meter session kept open across poll cycles
+typedef struct
+{
+        int     open;                   // initConnection succeeded
+        time_t  lastExchange;           // last time the meter answered
+        Presence* presence;             // tells fast the meter is down
+} Session;
+
+// Copy of the meter state for the other threads (metrics, total power), under monitorLock
+typedef struct
+{
+        OutputBlock     o;
+        uint32_t        valid;
+        uint32_t        known;
+        PollHealth      health;
+} MeterView;
+
+// Load profile sync of the meter: the records after the mark are appended to the file
+typedef struct
+{
+        FILE*           file;                   // ProfileRecord structures, none - no sync
+        char            markPath[PATH_MAX];     // FILE.cursor: the last record stored
+        ProfileMark     mark;
+        ProfileCursor   walk;
+        int             walking;                // the walk is positioned, blocks are read
+        int             period;                 // integration period of the meter (minutes)
+        int64_t         due;                    // schedClock() of the next step (ms)
+} ProfileSync;
+
+// Power meter on the bus with its own session, schedule, readings and health
+typedef struct
+{
+        MeterConfig     config;
+        int             weight;                 // polled WEIGHT times as often
+        Session         session;
+        Schedule        sched;
+        OutputBlock     o;
+        uint32_t        known;                  // fields read since the meter is there
+        uint32_t        valid;                  // fields published
+        PollHealth      health;
+        MeterView       view;
+        MercurySnapshot* snapshot;
+        Tsdb*           tsdb;                   // the store sink only once running
+        Rollup*         rollup;
+        ProfileSync     profile;
+        int             loopCount;              // the log sink only
+} Meter;
+
+// RS485 port with the meters on its bus, polled by a worker thread of its own
+typedef struct
+{
+        char            dev[BSZ];
+        char            name[NAME_MAX];         // portName(): metrics label, file suffix
+        MercuryCtx      ctx;                    // channel, trace, bus statistics
+        TxStatsTable    stats;                  // copy of ctx.stats for the metrics, under monitorLock
+        sem_t*          semptr;                 // bus lock, none through the broker
+        Presence*       presence;
+        EventLoop       loop;
+        Meter           meters[MAX_METERS];
+        int             count;
+        int             result;                 // channel check at start
+        int             reload;                 // SIGHUP received, under monitorLock
+        pthread_t       worker;
+} Port;
+
+Port ports[MAX_PORTS];
+int portCount = 0;
+
+// -- The worker should leave its poll loop: the monitor terminates or the port reloads
+int interrupted(Port* port)
+{
+        pthread_mutex_lock(&monitorLock);
+        int stop = terminateMonitorNow || port->reload;
+        pthread_mutex_unlock(&monitorLock);
+        return stop;
+}
+
+// -- The channel of the port is gone (unplugged dongle, broker stopped): stop the monitor
+void channelHungUp(Port* port)
+{
+        syslog(LOG_NOTICE, "Power meter channel %s is lost.\n\r", port->dev);
+
+        pthread_mutex_lock(&monitorLock);
+        channelLost = terminateMonitorNow = 1;
+        pthread_mutex_unlock(&monitorLock);
+        kill(getpid(), SIGTERM);                // the main thread stops the other workers
+}
+
+// -- Open (or re-open after timeout) power meter session
+int openSession(MercuryCtx* ctx, Session* s)
+{
+        time_t now = time(NULL);
+        if (s->open && now - s->lastExchange < SESSION_TIME_OUT)
+                return OK;
+
+        s->open = (OK == initConnection(ctx));
+        if (!s->open)
+                return COMMUNICATION_ERROR;
+
+        s->lastExchange = now;
+        return OK;
+}
+
+// -- Poll the parameters due within the open session, re-authenticate if the meter dropped it
+int pollSession(MercuryCtx* ctx, Session* s, Schedule* sched, OutputBlock* o, int* read)
+{
+        int64_t now = schedClock();
+        int due = schedDue(sched, now);
+
+        // no session or the meter was down: the presence check answers fast while it is
+        int res = (s->open && !s->presence->off) ? OK : presenceCheck(s->presence, ctx);
+        if (CHECK_CHANNEL_FAILURE == res)
+        {
+                s->open = 0;
+                res = COMMUNICATION_ERROR;
+        }
+        else if (OK == res)
+                res = openSession(ctx, s);
+
+        // parameter by parameter, ctx->batch stays off for real meters
+        *read = 0;
+        if (OK == res)
+        {
+                res = getParams(ctx, due, o, read);
+                if (CHANNEL_ISNT_OPEN == res)
+                {
+                        s->open = 0;
+                        res = openSession(ctx, s);
+                        if (OK == res)
+                        {
+                                int more;
+                                res = getParams(ctx, due & ~*read, o, &more);
+                                *read |= more;
+                        }
+                }
+        }
+        for (int p = 0; p < PARAM_COUNT; p++)
+                if (*read & 1 << p)
+                        schedDone(sched, p, now, o);
+
+        // whatever was due but not read is retried shortly
+        for (int p = 0; p < PARAM_COUNT; p++)
+                if ((due & ~*read) & 1 << p)
+                        schedRetry(sched, p, now);
+
+        if (*read)
+                s->lastExchange = time(NULL);
+        if (COMMUNICATION_ERROR == res)
+        {
+                s->open = 0;                    // meter may have restarted, init again
+                if (!s->presence->off)
+                        presenceLost(s->presence);
+        }
+        return res;
+}
+
+// -- Next load profile sync: the period closed and written by the meter
+int64_t nextProfileSync(int period)
+{
+        time_t now = time(NULL);
+        time_t closes = (now / (period * 60) + 1) * period * 60 + PROFILE_SYNC_DELAY;
+        return schedClock() + (int64_t)(closes - now) * 1000;
+}
+
+/*
+ * One step of the load profile sync of the meter within the bus lock, so
+ * that a long backfill does not hold up the polls: the head and the check
+ * of the last record stored first, then a block of the records after it
+ * per step. Errors (mains off, outage) leave the mark where it was, the
+ * next sync backfills the gap.
+ */
+void syncProfile(Port* port, Meter* m)
+{
+        ProfileSync* ps = &m->profile;
+        int64_t now = schedClock();
+        if (!ps->file || now < ps->due)
+                return;
+
+        // within the session the polls keep open
+        if (!m->session.open)
+        {
+                ps->walking = 0;
+                ps->due = now + PROFILE_RETRY_TIME * 1000;
+                return;
+        }
+
+        MercuryCtx* ctx = &port->ctx;
+        ctx->meter = m->config;
+        ctx->retries = PROFILE_RETRIES;
+        int res;
+        if (!ps->walking)
+        {
+                ProfileHead head;
+                int wrapped;
+                res = getProfileHead(ctx, &head);
+                if (OK == res)
+                        res = profileResume(ctx, &ps->walk, &head, &ps->mark, &wrapped);
+                if (OK == res)
+                {
+                        if (wrapped)
+                                syslog(LOG_NOTICE, "Meter %d on %s: load profile wrapped since the last sync, records are lost.\n\r",
+                                        m->config.address, port->name);
+                        ps->walking = 1;
+                        ps->period = head.period;
+                }
+        }
+        else
+        {
+                ProfileRecord block[PROFILE_BLOCK];
+                int decoded, stored = 0;
+                res = profileNext(ctx, &ps->walk, block, &decoded);
+                if (OK == res)
+                {
+                        // records not newer than the mark are there already
+                        for (int i = 0; i < decoded; i++)
+                                if (block[i].time > ps->mark.time)
+                                {
+                                        fwrite(&block[i], sizeof(block[i]), 1, ps->file);
+                                        ps->mark.time = block[i].time;
+                                        stored++;
+                                }
+                        ps->mark.address = (ps->walk.address - PROFILE_RECORD_SIZE) & 0xFFFF;
+                        if ((stored && fflush(ps->file)) || writeProfileMark(ps->markPath, &ps->mark))
+                                syslog(LOG_NOTICE, "Cannot write %s.\n\r", ps->markPath);
+                }
+        }
+
+        ctx->retries = RETRIES;
+        if (OK == res)
+        {
+                m->session.lastExchange = time(NULL);
+                if (ps->walking && !ps->walk.left)
+                {
+                        ps->walking = 0;
+                        ps->due = nextProfileSync(ps->period);
+                }
+                return;
+        }
+
+        // the polls find out about the session and the meter
+        if (CHANNEL_ISNT_OPEN == res || COMMUNICATION_ERROR == res)
+                m->session.open = 0;
+        ps->walking = 0;
+        ps->due = now + PROFILE_RETRY_TIME * 1000;
+}
+
+// -- Wait for the next poll due, pinging the meters so that their sessions stay open
+void waitNextPoll(Port* port)
+{
+        Meter* meters = port->meters;
+        while (!interrupted(port))
+        {
+                int64_t now = schedClock();
+                int64_t next = INT64_MAX;
+                for (int k = 0; k < port->count; k++)
+                {
+                        if (schedNext(&meters[k].sched) < next)
+                                next = schedNext(&meters[k].sched);
+                        if (meters[k].profile.file && meters[k].profile.due < next)
+                                next = meters[k].profile.due;
+                }
+                if (next <= now)
+                        break;
+
+                int64_t wake = next;
+                for (int k = 0; k < port->count; k++)
+                {
+                        Session* s = &meters[k].session;
+                        if (!s->open)
+                                continue;
+
+                        int64_t ping = now + (int64_t)(s->lastExchange + KEEP_ALIVE_TIME - time(NULL)) * 1000;
+                        if (ping <= now)
+                        {
+                                if (!lockBus(port->semptr))
+                                {
+                                        port->ctx.meter = meters[k].config;
+                                        if (OK == presenceCheck(s->presence, &port->ctx))
+                                                s->lastExchange = time(NULL);
+                                        else
+                                                s->open = 0;    // the next poll finds out
+                                        unlockBus(port->semptr);
+                                }
+                                ping = now + KEEP_ALIVE_TIME * 1000;
+                        }
+                        if (ping < wake)
+                                wake = ping;
+                }
+
+                if (runEventLoop(&port->loop, wake))
+                {
+                        channelHungUp(port);
+                        break;
+                }
+        }
+}
+
+/*
+ * Parse poll periods list, e.g. S=1,U=5,PR=300 (seconds, 0 - not polled).
+ *
+ * Returns:
+ *	0 - ok, -1 - a name or a period is not recognised.
+ */
+int parsePeriods(const char* list, int* periods)
+{
+        char items[BSZ];
+        strncpy(items, list, BSZ - 1);
+        items[BSZ - 1] = 0;
+
+        for (char* item = strtok(items, ","); item; item = strtok(NULL, ","))
+        {
+                char* value = strchr(item, '=');
+                if (!value)
+                        return -1;
+                *value++ = 0;
+
+                char* end;
+                double sec = strtod(value, &end);
+                if (*end || sec < 0)
+                        return -1;
+
+                int found = 0;
+                for (int p = 0; p < PARAM_COUNT; p++)
+                        if (!strcmp(paramTable[p].name, item))
+                        {
+                                periods[p] = sec * 1000;
+                                found = 1;
+                        }
+                if (!found)
+                        return -1;
+        }
+        return 0;
+}
+
+/*
+ * Parse meter option ADDR[:PASSWORD[:LEVEL]][@WEIGHT].
+ *
+ * Returns:
+ *	0 - ok, -1 - not recognised.
+ */
+int parseMeterOption(const char* spec, Meter* m)
+{
+        char config[BSZ];
+        strncpy(config, spec, BSZ - 1);
+        config[BSZ - 1] = 0;
+
+        m->weight = 1;
+        char* weight = strchr(config, '@');
+        if (weight)
+        {
+                *weight++ = 0;
+                char* end;
+                m->weight = strtol(weight, &end, 10);
+                if (*end || m->weight < 1 || m->weight > SCHED_SPEEDUP * SCHED_SPEEDUP)
+                        return -1;
+        }
+        return parseMeter(config, &m->config);
+}
+
+// -- Per meter file name: FILE for the only meter, FILE[.PORT][.ADDR] with several ports or meters
+void meterPath(char* path, int size, const char* base, const Port* port, const Meter* m)
+{
+        int len = snprintf(path, size, "%s", base);
+        if (portCount > 1 && len < size)
+                len += snprintf(path + len, size - len, ".%s", port->name);
+        if (port->count > 1 && len < size)
+                snprintf(path + len, size - len, ".%d", m->config.address);
+}
+
+// -- Open the samples history and aggregates of the meter (not given - none)
+int openStoreFiles(const Port* port, Meter* m)
+{
+        const char* store = settings.store;
+        const char* rollupFile = settings.rollupFile;
+        char path[PATH_MAX];
+        if (store)
+        {
+                meterPath(path, sizeof(path), store, port, m);
+                if (NULL == (m->tsdb = tsdbOpen(path, 1)))
+                {
+                        syslog(LOG_NOTICE, "Cannot open %s time-series store.\n\r", path);
+                        return -1;
+                }
+        }
+        if (rollupFile)
+        {
+                meterPath(path, sizeof(path), rollupFile, port, m);
+                if (NULL == (m->rollup = rollupOpen(path, 1)))
+                {
+                        syslog(LOG_NOTICE, "Cannot open %s rollup file.\n\r", path);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+void closeStoreFiles(Meter* m)
+{
+        tsdbClose(m->tsdb);                     /* write the last samples out */
+        rollupClose(m->rollup);
+        m->tsdb = NULL;
+        m->rollup = NULL;
+}
+
+// -- Open the load profile file of the meter (not given - none)
+int openProfileFile(const Port* port, Meter* m)
+{
+        const char* profileFile = settings.profileFile;
+        char path[PATH_MAX];
+        if (profileFile)
+        {
+                ProfileSync* ps = &m->profile;
+                meterPath(path, sizeof(path), profileFile, port, m);
+                if (NULL == (ps->file = fopen(path, "ab")))
+                {
+                        syslog(LOG_NOTICE, "Cannot open %s profile file.\n\r", path);
+                        return -1;
+                }
+                snprintf(ps->markPath, sizeof(ps->markPath), "%s.cursor", path);
+                readProfileMark(ps->markPath, &ps->mark);
+                ps->walking = 0;
+                ps->due = schedClock();         // catch up right away
+        }
+        return 0;
+}
+
+void closeProfileFile(Meter* m)
+{
+        if (m->profile.file)
+                fclose(m->profile.file);
+        m->profile.file = NULL;
+}
+
+// -- Start over the poll schedule of the meter, WEIGHT times shorter periods
+void startSchedule(Meter* m)
+{
+        int meterPeriods[PARAM_COUNT];
+        for (int p = 0; p < PARAM_COUNT; p++)
+                meterPeriods[p] = settings.periods[p] / m->weight;
+        schedInit(&m->sched, meterPeriods);
+}
+
+/*
+ * Sinks: syslog, the power checks and the history files may stall on the
+ * disk or the network, so the port workers do not call them. A worker
+ * hands the timestamped samples over through a SampleRing per port and
+ * goes on polling, every sink consumes its rings on a thread of its own.
+ * A sink behind the workers loses samples by the policy of its rings and
+ * they are counted (mercury_sink_samples_total).
+ */
+typedef enum
+{
+        SINK_LOG = 0,           // syslog, 1 of logFactor samples
+        SINK_RULE,              // power checks on the total power
+        SINK_STORE,             // time-series store and rollup
+        SINK_COUNT
+} SinkId;
+
+typedef struct
+{
+        const char*     name;                   // metrics label
+        int             policy;                 // RingPolicy when the sink is behind
+        void            (*consume)(const Sample*);
+        void            (*rotate)();            // SIGHUP received, none - nothing to do
+        SampleRing      rings[MAX_PORTS];       // a ring per port, pushed by its worker
+        int             wakefd;                 // eventfd: samples pushed, stop or reload
+        int             stop;                   // under monitorLock
+        int             reload;                 // under monitorLock
+        int             running;                // the thread is started, set before the workers
+        pthread_t       thread;
+} Sink;
+
+// -- Log the power of the meter or the poll failure, 1 of logFactor
+void logSample(const Sample* s)
+{
+        const Port* port = &ports[s->port];
+        Meter* m = &ports[s->port].meters[s->meter];
+        if (!(s->read & 1 << PARAM_S || OK != s->status) || ++m->loopCount < settings.logFactor)
+                return;
+
+        m->loopCount = 0;
+        char meter[BSZ] = "";
+        if (portCount > 1)
+                snprintf(meter, sizeof(meter), "Meter %d on %s", m->config.address, port->name);
+        else if (port->count > 1)
+                snprintf(meter, sizeof(meter), "Meter %d", m->config.address);
+
+        if (*meter)
+                syslog(LOG_NOTICE, (OK == s->status)
+                        ? "%s power consumption: %8.2fW\n\r"
+                        : "%s: one or more errors occurred during data collection.\n\r",
+                        meter, s->o.S.sum);
+        else
+                syslog(LOG_NOTICE, (OK == s->status)
+                        ? "Current power consumption: %8.2fW\n\r"
+                        : "One or more errors occurred during data collection.\n\r", s->o.S.sum);
+}
+
+// -- Run all checks for the total power obtained
+void checkSample(const Sample* s)
+{
+        handleConsumptionUpdate(s->total, settings.maxPower);
+}
+
+// -- Append the sample to the history of the meter
+void storeSample(const Sample* s)
+{
+        Meter* m = &ports[s->port].meters[s->meter];
+        if (m->tsdb)
+                tsdbAppend(m->tsdb, s->time, &s->o);
+        if (m->rollup)
+                rollupAdd(m->rollup, s->time / 1000, &s->o, s->fresh);
+}
+
+// -- Let the history files be rotated
+void reopenStoreFiles()
+{
+        int reopened = 1;
+        for (int i = 0; i < portCount; i++)
+                for (int k = 0; k < ports[i].count; k++)
+                {
+                        Meter* m = &ports[i].meters[k];
+                        closeStoreFiles(m);
+                        if (openStoreFiles(&ports[i], m))
+                                reopened = 0;
+                }
+        if (!reopened)
+                syslog(LOG_NOTICE, "Cannot reopen the store or the rollup file.\n\r");
+}
+
+// the power checks and the log want the latest samples, the history a contiguous one
+Sink sinks[SINK_COUNT] =
+{
+        [SINK_LOG] = { .name = "log", .policy = RP_OVERWRITE_OLDEST, .consume = logSample },
+        [SINK_RULE] = { .name = "rule", .policy = RP_OVERWRITE_OLDEST, .consume = checkSample },
+        [SINK_STORE] = { .name = "store", .policy = RP_DROP_NEWEST, .consume = storeSample,
+                .rotate = reopenStoreFiles }
+};
+
+// -- Wake the sink up, the eventfd counter never blocks in practice
+void wakeSink(Sink* sink)
+{
+        uint64_t one = 1;
+        if (write(sink->wakefd, &one, sizeof(one)) != sizeof(one))
+                syslog(LOG_NOTICE, "Cannot wake the %s sink up.\n\r", sink->name);
+}
+
+// -- Hand the sample of the port over to the sink (not running - nobody wants it)
+void pushSample(const Port* port, int id, const Sample* s)
+{
+        Sink* sink = &sinks[id];
+        if (sink->running && !ringPush(&sink->rings[port - ports], s))
+                wakeSink(sink);
+}
+
+// -- Sink thread: consumes the samples of all ports as they come, drains them before it stops
+void* runSink(void* arg)
+{
+        Sink* sink = arg;
+        Sample s;
+
+        for (;;)
+        {
+                uint64_t count;
+                if (read(sink->wakefd, &count, sizeof(count)) != sizeof(count))
+                        continue;
+
+                pthread_mutex_lock(&monitorLock);
+                int stop = sink->stop, reload = sink->reload;
+                sink->reload = 0;
+                pthread_mutex_unlock(&monitorLock);
+
+                if (reload && sink->rotate)
+                        sink->rotate();
+                for (int i = 0; i < portCount; i++)
+                        while (!ringPop(&sink->rings[i], &s))
+                                sink->consume(&s);
+                if (stop)
+                        break;
+        }
+        return NULL;
+}
+
+/*
+ * Start the sinks in use, before the workers push anything.
+ *
+ * Returns:
+ *	0 - ok, -1 - failed (logged).
+ */
+int startSinks()
+{
+        for (int id = 0; id < SINK_COUNT; id++)
+        {
+                Sink* sink = &sinks[id];
+                if (SINK_STORE == id && !settings.store && !settings.rollupFile)
+                        continue;
+
+                for (int i = 0; i < portCount; i++)
+                        ringInit(&sink->rings[i], sink->policy);
+                if ((sink->wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+                {
+                        syslog(LOG_NOTICE, "Event loop set up error.\n\r");
+                        return -1;
+                }
+                if (pthread_create(&sink->thread, NULL, runSink, sink))
+                {
+                        syslog(LOG_NOTICE, "Cannot start the %s sink.\n\r", sink->name);
+                        close(sink->wakefd);
+                        return -1;
+                }
+                sink->running = 1;
+        }
+        return 0;
+}
+
+// -- Stop the sinks once the workers are done, the samples queued are consumed
+void stopSinks()
+{
+        for (int id = 0; id < SINK_COUNT; id++)
+        {
+                Sink* sink = &sinks[id];
+                if (!sink->running)
+                        continue;
+
+                pthread_mutex_lock(&monitorLock);
+                sink->stop = 1;
+                pthread_mutex_unlock(&monitorLock);
+                wakeSink(sink);
+                pthread_join(sink->thread, NULL);
+                close(sink->wakefd);
+                sink->running = 0;
+        }
+}
+
+// -- Publish the poll result of the meter: shared memory, then the samples for the history and the log
+void publishMeter(const Port* port, Meter* m, int status, int read)
+{
+        // publish the sample for the readers (mercury236 --shm)
+        uint32_t fresh = 0;
+        m->valid = 0;
+        if (read || OK == status)
+        {
+                m->o.ms = MS_ON;
+                fresh = schedFields(read) | OB_MS;
+                m->known |= fresh;
+                m->valid = m->known;
+        }
+        else if (COMMUNICATION_ERROR == status)
+        {
+                m->o.ms = MS_OFF;
+                fresh = m->valid = m->known = OB_MS;
+        }
+        publishSnapshot(m->snapshot, &m->o, m->valid);
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        Sample s =
+        {
+                .time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000,
+                .kind = SK_METER,
+                .port = port - ports,
+                .meter = m - port->meters,
+                .status = status,
+                .read = read,
+                .valid = m->valid,
+                .fresh = fresh,
+                .o = m->o
+        };
+        if (m->valid)
+                pushSample(port, SINK_STORE, &s);
+        if (read & 1 << PARAM_S || OK != status)
+                pushSample(port, SINK_LOG, &s);
+}
+
+
+// -- Render the metrics of all ports from the views, under monitorLock
+void renderAllMetrics()
+{
+        static MeterMetrics mm[MAX_PORTS * MAX_METERS];
+        static char text[METRICS_BSZ];
+        PortMetrics pm[MAX_PORTS];
+        SinkMetrics sm[SINK_COUNT * MAX_PORTS];
+        time_t lastSample = 0;
+        int count = 0, sinkCount = 0;
+
+        for (int i = 0; i < portCount; i++)
+        {
+                pm[i].port = ports[i].name;
+                pm[i].stats = &ports[i].stats;
+                for (int k = 0; k < ports[i].count; k++, count++)
+                {
+                        const Meter* m = &ports[i].meters[k];
+                        mm[count].port = ports[i].name;
+                        mm[count].address = m->config.address;
+                        mm[count].health = &m->view.health;
+                        mm[count].o = &m->view.o;
+                        mm[count].valid = m->view.valid;
+                        if (!count || m->view.health.lastSample < lastSample)
+                                lastSample = m->view.health.lastSample;
+                }
+        }
+
+        for (int id = 0; id < SINK_COUNT; id++)
+                for (int i = 0; sinks[id].running && i < portCount; i++, sinkCount++)
+                {
+                        RingStats st;
+                        ringStats(&sinks[id].rings[i], &st);
+                        sm[sinkCount].sink = sinks[id].name;
+                        sm[sinkCount].port = ports[i].name;
+                        sm[sinkCount].pushed = st.pushed;
+                        sm[sinkCount].dropped = st.dropped;
+                        sm[sinkCount].overwritten = st.overwritten;
+                        sm[sinkCount].queued = st.queued;
+                }
+
+        int len = renderMetrics(text, METRICS_BSZ, mm, count, pm, portCount, sm, sinkCount);
+        publishMetrics(text, len, lastSample);
+}
+
+// -- Publish the poll round of the port: meter outputs, then the views for the metrics and the power check
+void publishPort(Port* port, const int* status, const int* read, int polled)
+{
+        int powerRead = 0;
+        for (int k = 0; k < port->count; k++)
+                if (polled & 1 << k)
+                {
+                        publishMeter(port, &port->meters[k], status[k], read[k]);
+                        powerRead |= read[k] & 1 << PARAM_S;
+                }
+
+        pthread_mutex_lock(&monitorLock);
+        for (int k = 0; k < port->count; k++)
+        {
+                Meter* m = &port->meters[k];
+                m->view.o = m->o;
+                m->view.valid = m->valid;
+                m->view.known = m->known;
+                m->view.health = m->health;
+        }
+        port->stats = port->ctx.stats;
+
+        if (settings.metrics)
+                renderAllMetrics();
+
+        // all meters of all ports together
+        float total = 0;
+        for (int i = 0; i < portCount; i++)
+                for (int k = 0; k < ports[i].count; k++)
+                        if (ports[i].meters[k].view.known & OB_S)
+                                total += ports[i].meters[k].view.o.S.sum;
+        pthread_mutex_unlock(&monitorLock);
+
+        // run all checks for the power value obtained
+        if (powerRead)
+        {
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                Sample s =
+                {
+                        .time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000,
+                        .kind = SK_TOTAL,
+                        .port = port - ports,
+                        .meter = -1,
+                        .status = OK,
+                        .total = total
+                };
+                pushSample(port, SINK_RULE, &s);
+        }
+}
+
+// -- Start over the schedules, let the profile files be rotated (the store sink reopens the history)
+void reloadPort(Port* port)
+{
+        int reopened = 1;
+        for (int k = 0; k < port->count; k++)
+        {
+                Meter* m = &port->meters[k];
+                startSchedule(m);
+                closeProfileFile(m);
+                if (openProfileFile(port, m))
+                        reopened = 0;
+        }
+        if (!reopened)
+                syslog(LOG_NOTICE, "Cannot reopen the profile file.\n\r");
+        syslog(LOG_NOTICE, "Monitor reloaded (%s).\n\r", port->name);
+}
+
+/*
+ * Worker thread of the port: polls the meters due back to back within one
+ * bus lock, publishes them and waits for the next poll. Ports do not
+ * share anything on the bus, so they are polled in parallel.
+ */
+void* pollPort(void* arg)
+{
+        Port* port = arg;
+        Meter* meters = port->meters;
+        int first = 0;                          // meter polled first, rotates
+
+        for (;;)
+        {
+                int64_t cycleStart = txClock();
+                int64_t now = schedClock();
+                int status[MAX_METERS], read[MAX_METERS], polled = 0;
+
+                // the first one rotates so that a silent meter does not always
+                // hold up the same others
+                if (!lockBus(port->semptr))
+                {
+                        for (int i = 0; i < port->count; i++)
+                        {
+                                int k = (first + i) % port->count;
+                                Meter* m = &meters[k];
+                                if (!schedDue(&m->sched, now))
+                                        continue;
+
+                                port->ctx.meter = m->config;
+                                status[k] = pollSession(&port->ctx, &m->session, &m->sched, &m->o, &read[k]);
+                                recordPoll(&m->health, status[k], txClock() - cycleStart);
+                                polled |= 1 << k;
+                        }
+
+                        // a load profile block per meter at most, between the polls
+                        for (int k = 0; k < port->count; k++)
+                                syncProfile(port, &meters[k]);
+
+                        // increment semaphore to let other processes go
+                        unlockBus(port->semptr);
+                }
+                first = (first + 1) % port->count;
+
+                publishPort(port, status, read, polled);
+                waitNextPoll(port);
+
+                pthread_mutex_lock(&monitorLock);
+                int stop = terminateMonitorNow, reload = port->reload;
+                port->reload = 0;
+                pthread_mutex_unlock(&monitorLock);
+
+                if (stop)
+                        break;
+                if (reload)
+                        reloadPort(port);
+        }
+
+        if (!lockBus(port->semptr))
+        {
+                for (int k = 0; k < port->count; k++)
+                        if (meters[k].session.open)
+                        {
+                                port->ctx.meter = meters[k].config;
+                                closeConnection(&port->ctx);
+                        }
+                unlockBus(port->semptr);
+        }
+        return NULL;
+}
+
+/*
+ * Open the port: meter outputs and files, channel, bus lock.
+ *
+ * Returns:
+ *	0 - ok, -1 - failed (logged).
+ */
+int openPort(Port* port)
+{
+        initCtx(&port->ctx, -1);
+        port->ctx.debug = (settings.debug) ? stdout : NULL;
+        if (openEventLoop(&port->loop))
+        {
+                syslog(LOG_NOTICE, "Event loop set up error.\n\r");
+                return -1;
+        }
+
+        if (NULL == (port->presence = openPresence(port->dev)))
+        {
+                syslog(LOG_NOTICE, "Presence state open error.\n\r");
+                return -1;
+        }
+
+        for (int k = 0; k < port->count; k++)
+        {
+                Meter* m = &port->meters[k];
+                m->session.presence = &port->presence[m->config.address];
+
+                // output block shared with the readers
+                if (NULL == (m->snapshot = openSnapshot(port->dev, m->config.address, 1)))
+                {
+                        syslog(LOG_NOTICE, "Shared memory open error.");
+                        return -1;
+                }
+
+                // samples history, aggregates and load profile
+                if (openStoreFiles(port, m) || openProfileFile(port, m))
+                        return -1;
+                startSchedule(m);
+        }
+
+        // Open RS485 dongle (or mercury-broker socket)
+        port->ctx.fd = openChannel(port->dev);
+
+        if (port->ctx.fd < 0 || watchChannel(&port->loop, port->ctx.fd))
+        {
+                syslog(LOG_NOTICE, "Cannot open %s terminal channel.\n\r", port->dev);
+                return -1;
+        }
+
+        // semaphore code to lock the shared mem, the broker serialises the bus itself
+        if (!isBrokerChannel(port->ctx.fd))
+        {
+                char semName[NAME_MAX];
+                semaphoreName(port->dev, semName, sizeof(semName));
+                int prevMask = umask(0000);
+                port->semptr = sem_open(
+                                semName,                        /* name */
+                                O_CREAT,                        /* create the semaphore */
+                                MERCURY_ACCESS_PERM,            /* protection perms */
+                                1);                             /* initial value */
+                umask(prevMask);
+                if (SEM_FAILED == port->semptr)
+                {
+                        port->semptr = NULL;
+                        syslog(LOG_NOTICE, "Semaphore open error.");
+                        return -1;
+                }
+        }
+
+        // go on if any of the meters answers
+        port->result = CHECK_CHANNEL_FAILURE;
+        if (!lockBus(port->semptr))
+        {
+                for (int k = 0; k < port->count; k++)
+                {
+                        port->ctx.meter = port->meters[k].config;
+                        int res = checkChannel(&port->ctx);
+                        if (!k || OK == res)
+                                port->result = res;
+                }
+                unlockBus(port->semptr);
+        }
+        return 0;
+}
+
+void closePort(Port* port)
+{
+        for (int k = 0; k < port->count; k++)
+        {
+                char name[NAME_MAX];
+                closeStoreFiles(&port->meters[k]);
+                closeProfileFile(&port->meters[k]);
+                closeSnapshot(port->meters[k].snapshot);        /* unmap the storage */
+                snapshotName(port->dev, port->meters[k].config.address, name, sizeof(name));
+                shm_unlink(name);                               /* no fresh data any more */
+        }
+        closePresence(port->presence);
+        if (port->ctx.fd >= 0)
+                close(port->ctx.fd);
+        closeEventLoop(&port->loop);
+        if (port->semptr)
+                sem_close(port->semptr);
+}
+
 // Usage: mercury-mon [RS485] [MaxPower] [LogFactor] [options]
 int main(int argc, const char** args)
 {
@@ -146,12 +1270,18 @@ int main(int argc, const char** args)
                 exit(EXIT_FAIL);
         }
 
-        // Ctrl+C handler
-        signal(SIGINT, sigint_handler);
+        // Ctrl+C, service stop and reload come through the signalfd, workers inherit the mask
+        int sigfd = openSignals();
+        if (sigfd < 0)
+        {
+                syslog(LOG_NOTICE, "Event loop set up error.\n\r");
+                closelog();
+                exit(EXIT_FAIL);
+        }
 
-        // get RS485 device specification
-	char dev[BSZ];
-	strncpy(dev, args[1], BSZ);
+        // get RS485 device specification, the first port
+        Port* port = &ports[portCount++];
+	strncpy(port->dev, args[1], BSZ - 1);
 
         // get maximum allowed power
         int maxPower = strtol(args[2], NULL, 10);
@@ -180,11 +1310,63 @@ int main(int argc, const char** args)
                 exit(EXIT_FAIL);
         }
 
+        // default poll periods, nothing is polled faster than the power
+        static const int defaultPeriods[PARAM_COUNT] =
+        {
+                [PARAM_U] = 5, [PARAM_I] = 5, [PARAM_C] = 30, [PARAM_F] = 30, [PARAM_A] = 30,
+                [PARAM_P] = 0, [PARAM_S] = 0,
+                [PARAM_PR] = 300, [PARAM_PRT0] = 300, [PARAM_PRT1] = 300, [PARAM_PY] = 300, [PARAM_PT] = 300
+        };
+        settings.maxPower = maxPower;
+        settings.logFactor = logFactor;
+        int* periods = settings.periods;
+        for (int p = 0; p < PARAM_COUNT; p++)
+                periods[p] = ((defaultPeriods[p] > pollTime) ? defaultPeriods[p] : pollTime) * 1000;
+
 	// get command line options
 	for (int i=5; i<argc; i++)
 	{
 		if (!strcmp(OPT_DEBUG, args[i]))
-			debugPrint = 1;
+			settings.debug = 1;
+                else if (!strcmp(OPT_METRICS, args[i]) && i + 1 < argc)
+                        settings.metrics = args[++i];
+                else if (!strcmp(OPT_STORE, args[i]) && i + 1 < argc)
+                        settings.store = args[++i];
+                else if (!strcmp(OPT_ROLLUP, args[i]) && i + 1 < argc)
+                        settings.rollupFile = args[++i];
+                else if (!strcmp(OPT_PROFILE, args[i]) && i + 1 < argc)
+                        settings.profileFile = args[++i];
+                else if (!strcmp(OPT_PORT, args[i]) && i + 1 < argc)
+                {
+                        if (portCount == MAX_PORTS)
+                        {
+                                syslog(LOG_NOTICE, "Error: more than %d ports given.\n\r", MAX_PORTS);
+                                closelog();
+                                exit(EXIT_FAIL);
+                        }
+                        port = &ports[portCount++];
+                        strncpy(port->dev, args[++i], BSZ - 1);
+                }
+                else if (!strcmp(OPT_METER, args[i]) && i + 1 < argc)
+                {
+                        if (port->count == MAX_METERS || parseMeterOption(args[++i], &port->meters[port->count++]))
+                        {
+                                syslog(LOG_NOTICE, "Error: %s %s is not recognised\n\r", OPT_METER, args[i]);
+                                printUsage();
+                                closelog();
+                                exit(EXIT_FAIL);
+                        }
+                }
+                else if (!strcmp(OPT_PERIODS, args[i]) && i + 1 < argc)
+                {
+                        if (parsePeriods(args[++i], periods))
+                        {
+                                syslog(LOG_NOTICE, "Error: %s list %s is not recognised\n\r", OPT_PERIODS, args[i]);
+                                printUsage();
+                                closelog();
+                                exit(EXIT_FAIL);
+                        }
+                }
 		// else if (!strcmp(OPT_TEST_RUN, args[i]))
 		// 	dryRun = 1;
 		// else if (!strcmp(OPT_HUMAN, args[i]))
@@ -210,121 +1392,129 @@ int main(int argc, const char** args)
 		}
 	}
 
- 	OutputBlock o;
-	bzero(&o, sizeof(OutputBlock));
-
-        // semaphore code to lock the shared mem 
-        int prevMask = umask(0000);
-        sem_t* semptr = sem_open(
-                                MERCURY_SEMAPHORE,              /* name */
-                                O_CREAT,                        /* create the semaphore */
-                                MERCURY_ACCESS_PERM,            /* protection perms */
-                                1);                             /* initial value */
-        umask(prevMask);
-        if (SEM_FAILED == semptr)
+        for (int i = 0; i < portCount; i++)
         {
-                syslog(LOG_NOTICE, "Semaphore open error.");
-                closelog();
-                exit(EXIT_FAIL);      
-        }
+                port = &ports[i];
+                portName(port->dev, port->name, sizeof(port->name));
+                for (int j = 0; j < i; j++)
+                        if (!strcmp(ports[j].name, port->name))
+                        {
+                                syslog(LOG_NOTICE, "Error: port %s is given twice.\n\r", port->dev);
+                                closelog();
+                                exit(EXIT_FAIL);
+                        }
 
-        // Open RS485 dongle
-        // O_RDWR Read/Write access to serial port
-        // O_NOCTTY - No terminal will control the process  
-        // O_NDELAY - Non blocking open
-        int RS485 = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
+                // the only meter on the line by default, several ones need own addresses
+                Meter* meters = port->meters;
+                if (!port->count)
+                {
+                        MeterConfig def = METER_DEFAULT;
+                        meters[port->count].config = def;
+                        meters[port->count++].weight = 1;
+                }
+                for (int k = 0; port->count > 1 && k < port->count; k++)
+                {
+                        int clash = (PM_ADDRESS == meters[k].config.address);
+                        for (int j = 0; j < k; j++)
+                                clash |= (meters[j].config.address == meters[k].config.address);
+                        if (clash)
+                        {
+                                syslog(LOG_NOTICE, "Error: meters on one bus need distinct addresses other than %d.\n\r", PM_ADDRESS);
+                                closelog();
+                                exit(EXIT_FAIL);
+                        }
+                }
+        }
 
-        if (RS485 < 0)
+        // scrape endpoint, served from the text rendered after each poll
+        if (settings.metrics && startMetrics(settings.metrics))
         {
-                syslog(LOG_NOTICE, "Cannot open %s terminal channel.\n\r", dev);
+                syslog(LOG_NOTICE, "Cannot serve metrics on %s.\n\r", settings.metrics);
                 closelog();
                 exit(EXIT_FAIL);
         }
 
-        fcntl(RS485, F_SETFL, 0);
-
-        struct termios serialPortSettings;
-        bzero(&serialPortSettings, sizeof(serialPortSettings));
-
-        cfsetispeed(&serialPortSettings, BAUDRATE);
-        cfsetospeed(&serialPortSettings, BAUDRATE);
-
-        serialPortSettings.c_cflag &= PARENB;				/* Disables the Parity Enable bit(PARENB),So No Parity   */
-        serialPortSettings.c_cflag &= ~CSTOPB;				/* CSTOPB = 2 Stop bits,here it is cleared so 1 Stop bit */
-        serialPortSettings.c_cflag &= ~CSIZE;				/* Clears the mask for setting the data size             */
-        serialPortSettings.c_cflag |= CS8;				/* Set the data bits = 8                                 */
-
-        serialPortSettings.c_cflag |= CREAD | CLOCAL;			/* Enable receiver,Ignore Modem Control lines       */ 
-
-        serialPortSettings.c_iflag &= ~(IXON | IXOFF | IXANY);		/* Disable XON/XOFF flow control both i/p and o/p */
-        serialPortSettings.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);	/* Non Cannonical mode                            */
-
-        serialPortSettings.c_oflag &= ~OPOST;				/* No Output Processing */
-
-        tcflush(RS485, TCIOFLUSH);
-        tcsetattr(RS485, TCSANOW, &serialPortSettings);
-
+        // go on if any of the ports answers
         int exitCode = 0;
+        int workers = 0;                        // worker threads started
         int resCheckChannel = CHECK_CHANNEL_FAILURE;
-
-        if (!sem_wait(semptr))
+        for (int i = 0; i < portCount; i++)
         {
-                resCheckChannel = checkChannel(RS485);
-                sem_post(semptr);
+                if (openPort(&ports[i]))
+                {
+                        closelog();
+                        exit(EXIT_FAIL);
+                }
+                if (!i || OK == ports[i].result)
+                        resCheckChannel = ports[i].result;
         }
 
-        int loopCount = 0;
         switch(resCheckChannel)
         {
                 case OK:
-                        do
+                        // the sinks, a worker thread per port, the main thread waits for the signals
+                        if (startSinks())
+                        {
+                                pthread_mutex_lock(&monitorLock);
+                                terminateMonitorNow = 1;
+                                pthread_mutex_unlock(&monitorLock);
+                                exitCode = EXIT_FAIL;
+                        }
+                        for (; !exitCode && workers < portCount; workers++)
+                                if (pthread_create(&ports[workers].worker, NULL, pollPort, &ports[workers]))
+                                {
+                                        syslog(LOG_NOTICE, "Cannot start the %s worker.\n\r", ports[workers].dev);
+                                        pthread_mutex_lock(&monitorLock);
+                                        terminateMonitorNow = 1;
+                                        pthread_mutex_unlock(&monitorLock);
+                                        exitCode = EXIT_FAIL;
+                                        break;
+                                }
+
+                        pthread_mutex_lock(&monitorLock);
+                        int stop = terminateMonitorNow;
+                        pthread_mutex_unlock(&monitorLock);
+
+                        while (!stop)
                         {
-                                loopCount++;
-                                int loopStatus = OK;
-                                /* wait until semaphore != 0 */
-                                if (!sem_wait(semptr))
+                                struct signalfd_siginfo si;
+                                if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+                                        continue;
+
+                                pthread_mutex_lock(&monitorLock);
+                                if (SIGHUP == si.ssi_signo)
                                 {
-                                        loopStatus =
-                                                initConnection(RS485) +
-                                                
-                                                // getU(RS485, &o.U) +    // Get voltage by phases
-                                                // getI(RS485, &o.I) +    // Get current by phases
-                                                // getCosF(RS485, &o.C) + // Get power cos(f) by phases
-                                                // getF(RS485, &o.f) +    // Get grid frequency 
-                                                // getA(RS485, &o.A) +    // Get phase angles
-                                                // getP(RS485, &o.P) +    // Get active power consumption by phases
-
-                                                // Only poll for power consumption
-                                                getS(RS485, &o.S) +    // Get reactive power consumption by phases
-
-                                                // // Get power counter from reset, for yesterday and today
-                                                // getW(RS485, &o.PR, PP_RESET, 0, 0) +        // total from reset
-                                                // getW(RS485, &o.PRT[0], PP_RESET, 0, 0+1) +  // day tariff from reset
-                                                // getW(RS485, &o.PRT[1], PP_RESET, 0, 1+1) +  // night tariff from reset
-                                                // getW(RS485, &o.PY, PP_YESTERDAY, 0, 0) + 
-                                                // getW(RS485, &o.PT, PP_TODAY, 0, 0) +
-
-                                                closeConnection(RS485);
-                                        
-                                        // increment semaphore to let other processes go
-                                        sem_post(semptr);
-                                }        
-
-                                if (loopCount >= logFactor)
+                                        for (int i = 0; i < portCount; i++)
+                                                ports[i].reload = 1;
+                                        for (int id = 0; id < SINK_COUNT; id++)
+                                                sinks[id].reload = 1;
+                                }
+                                else
                                 {
-                                        loopCount = 0;                                        
-                                        syslog(LOG_NOTICE, (OK == loopStatus)
-                                                ? "Current power consumption: %8.2fW\n\r"
-                                                : "One or more errors occurred during data collection.\n\r", o.S.sum);
-                                
+                                        if (!channelLost)
+                                                printf("\nTerminating monitor by %s...\n", (SIGINT == si.ssi_signo) ? "Ctrl+C" : "SIGTERM");
+                                        stop = terminateMonitorNow = 1;
                                 }
-                                // run all checks for the obtained power value
-                                handleConsumptionUpdate(o.S.sum, maxPower);
+                                pthread_mutex_unlock(&monitorLock);
 
-                                usleep(pollTime * 1000 * 1000); // 5 sec
+                                for (int i = 0; i < portCount; i++)
+                                        wakeEventLoop(&ports[i].loop);
+                                for (int id = 0; id < SINK_COUNT; id++)
+                                        if (sinks[id].running)
+                                                wakeSink(&sinks[id]);
+                        }
 
-                        } while (!terminateMonitorNow);
-                        
+                        for (int i = 0; i < workers; i++)
+                        {
+                                wakeEventLoop(&ports[i].loop);
+                                pthread_join(ports[i].worker, NULL);
+                        }
+
+                        if (channelLost || exitCode)
+                        {
+                                exitCode = EXIT_FAIL;   // let the service manager restart us
+                                break;
+                        }
                         printf("Monitor terminated successfully.\n\r");
                         exitCode = EXIT_OK;
                         break;
@@ -342,10 +1532,12 @@ int main(int argc, const char** args)
                         break;
 	}
 
-        // Clean up
-        // munmap(outputBlockPtr, sizeof(OutputBlock)); /* unmap the storage */
-        close(RS485);
-        sem_close(semptr);
+        // Clean up, the sinks take the samples queued before the files are closed
+        stopMetrics();
+        stopSinks();
+        for (int i = 0; i < portCount; i++)
+                closePort(&ports[i]);
+        close(sigfd);
  
         closelog();
         exit(exitCode);
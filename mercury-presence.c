@@ -0,0 +1,134 @@
+/*
+ *	Mercury 236 presence detector.
+ */
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mercury-presence.h"
+
+#define PRESENCE_SIZE		(PRESENCE_METERS * sizeof(Presence))
+
+/*
+ * Map the shared presence state of the port, created zeroed (nothing
+ * learned, on).
+ *
+ * Returns:
+ *	presence state by RS485 address, NULL if out of memory.
+ */
+Presence* openPresence(const char* dev)
+{
+	char port[NAME_MAX], name[NAME_MAX];
+	portName(dev, port, sizeof(port));
+	snprintf(name, sizeof(name), "%s.%s", MERCURY_PRESENCE_SHM, port);
+
+	int prevMask = umask(0000);
+	int fd = shm_open(name, O_RDWR | O_CREAT, MERCURY_ACCESS_PERM);
+	umask(prevMask);
+
+	void* ptr = MAP_FAILED;
+	if (fd >= 0)
+	{
+		if (!ftruncate(fd, PRESENCE_SIZE))
+			ptr = mmap(NULL, PRESENCE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+
+	// a process private copy when the shared segment is not available
+	if (MAP_FAILED == ptr)
+		ptr = mmap(NULL, PRESENCE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (MAP_FAILED == ptr) ? NULL : (Presence*)ptr;
+}
+
+void closePresence(Presence* p)
+{
+	if (p)
+		munmap(p, PRESENCE_SIZE);
+}
+
+// -- Probe timeout (us): a few latencies once learned, CH_TIME_OUT before
+long presenceTimeout(const Presence* p)
+{
+	if (p->samples < PRESENCE_LEARN)
+		return CH_TIME_OUT * 1000000L;
+
+	int64_t timeout = p->latency + 4 * p->deviation;
+	if (timeout < PRESENCE_FACTOR * p->latency)
+		timeout = PRESENCE_FACTOR * p->latency;
+	if (timeout < PRESENCE_MIN_TIMEOUT)
+		timeout = PRESENCE_MIN_TIMEOUT;
+	return (timeout < CH_TIME_OUT * 1000000L) ? timeout : CH_TIME_OUT * 1000000L;
+}
+
+// -- Learn the latency of the probe answered
+static void learn(Presence* p, int64_t latency)
+{
+	if (!p->samples)
+	{
+		p->latency = latency;
+		p->deviation = latency / 2;
+	}
+	else
+	{
+		int64_t diff = (latency > p->latency) ? latency - p->latency : p->latency - latency;
+		p->deviation += (diff - p->deviation) / 4;
+		p->latency += (latency - p->latency) / 8;
+	}
+	p->samples++;
+}
+
+// -- The meter is not answering: cache the verdict, back off the next probe
+static void down(Presence* p, int64_t now)
+{
+	if (!p->off)
+	{
+		p->off = 1;
+		p->offSince = now;
+		p->backoff = PRESENCE_BACKOFF_MIN;
+	}
+	else if (p->backoff < PRESENCE_BACKOFF_MAX)
+		p->backoff = (2 * p->backoff < PRESENCE_BACKOFF_MAX) ? 2 * p->backoff : PRESENCE_BACKOFF_MAX;
+	p->nextProbe = now + p->backoff;
+}
+
+/*
+ * Check the meter is there: the cached verdict while it is down and the
+ * next probe is not due yet, otherwise a probe with the learned timeout.
+ *
+ * Returns:
+ *	CHECK_CHANNEL_FAILURE - the meter is down (mains off).
+ *	WRONG_CRC etc. - the meter answered, not as expected.
+ *	OK - means ok.
+ */
+int presenceCheck(Presence* p, MercuryCtx* ctx)
+{
+	int64_t now = txClock();
+	if (p->off && now < p->nextProbe)
+		return CHECK_CHANNEL_FAILURE;
+
+	// the broker queue is not the meter latency
+	int broker = isBrokerChannel(ctx->fd);
+	TxTiming timing;
+	int result = probeChannel(ctx, (broker) ? ctx->timeoutUs : presenceTimeout(p), &timing);
+
+	if (CHECK_CHANNEL_FAILURE == result)
+		down(p, txClock());
+	else
+	{
+		if (OK == result && !broker && timing.firstByte)
+			learn(p, timing.firstByte - timing.written);
+		p->off = 0;
+	}
+	return result;
+}
+
+// -- The meter stopped answering other requests, treat it as down
+void presenceLost(Presence* p)
+{
+	down(p, txClock());
+}
@@ -0,0 +1,51 @@
+/*
+ *	Mercury 236 presence detector: tells fast whether the meter answers.
+ *
+ *	With the mains off the meter is silent and every call waits the full
+ *	CH_TIME_OUT. The detector learns the normal test command latency
+ *	(smoothed mean and deviation, as TCP does for RTT) and gives up on a
+ *	probe after a small multiple of it. Once the meter is down the "off"
+ *	verdict is cached and probes are repeated with exponential backoff,
+ *	the first probe answered turns the meter back on.
+ *
+ *	The state of every RS485 address of the port lives in POSIX shared
+ *	memory (MERCURY_PRESENCE_SHM.PORT, see portName()), so
+ *	short lived CLI calls and the monitor share the latency learned and
+ *	the verdict (a process private copy is used if the segment is not
+ *	available). It is updated by the bus owner (MERCURY_SEMAPHORE held);
+ *	through mercury-broker the latency includes the broker queue and
+ *	probes wait CH_TIME_OUT.
+ */
+#ifndef MERCURY_PRESENCE_H
+#define MERCURY_PRESENCE_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define MERCURY_PRESENCE_SHM	"/MERCURY_RS485_PRESENCE"
+#define PRESENCE_METERS		256		// state by RS485 address
+#define PRESENCE_LEARN		3		// probes answered before the latency is trusted
+#define PRESENCE_FACTOR		4		// timeout is at least this many mean latencies
+#define PRESENCE_MIN_TIMEOUT	50000		// shortest probe timeout (us)
+#define PRESENCE_BACKOFF_MIN	250000		// first reprobe of the meter down (us)
+#define PRESENCE_BACKOFF_MAX	8000000		// longest reprobe interval (us)
+
+typedef struct
+{
+	int64_t		latency;		// smoothed first byte latency (us)
+	int64_t		deviation;		// smoothed mean deviation (us)
+	uint32_t	samples;		// probes answered
+	int		off;			// the meter is down
+	int64_t		offSince;		// txClock() of the verdict
+	int64_t		nextProbe;		// txClock() of the next probe while down
+	int64_t		backoff;		// current reprobe interval (us)
+} Presence;
+
+// Function prototypes:
+Presence* openPresence(const char* dev);
+void closePresence(Presence*);
+long presenceTimeout(const Presence*);
+int presenceCheck(Presence*, MercuryCtx*);
+void presenceLost(Presence*);
+
+#endif
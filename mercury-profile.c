@@ -0,0 +1,262 @@
+/*
+ *	Mercury 236 load profile readout.
+ */
+#define _DEFAULT_SOURCE
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mercury-profile.h"
+#include "mercury-crc.h"
+
+#define BSZ			255
+#define ADDRESS_MASK		0xFFFF		// memory addresses wrap around
+
+// -- Decode BCD byte, -1 if not a BCD number (erased memory)
+static int bcd(byte b)
+{
+	return ((b >> 4) > 9 || (b & 0x0F) > 9) ? -1 : (b >> 4) * 10 + (b & 0x0F);
+}
+
+// -- Meter local time of the BCD time stamp, -1 if not valid
+static time_t stamp(const byte* hms)
+{
+	int hour = bcd(hms[0]), minute = bcd(hms[1]), day = bcd(hms[2]), month = bcd(hms[3]), year = bcd(hms[4]);
+	if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || day < 1 || month < 1 || month > 12 || year < 0)
+		return -1;
+
+	struct tm tm =
+	{
+		.tm_hour = hour, .tm_min = minute, .tm_mday = day,
+		.tm_mon = month - 1, .tm_year = 100 + year, .tm_isdst = -1
+	};
+	return mktime(&tm);
+}
+
+// -- Average power over the period (W, var) of the energy impulses counted
+static float power(const byte* b, int period)
+{
+	int impulses = b[0] | (b[1] << 8);
+	if (PROFILE_NO_DATA == impulses)
+		return NAN;
+	return impulses * 60000.0 / ((double)period * 2 * PROFILE_CONSTANT);
+}
+
+/*
+ * Locate the last profile record.
+ *
+ * Returns:
+ *	COMMUNICATION_ERROR - unable to get responce from tty.
+ * 	WRONG_CRC - data recieved but CRC check failed.
+ *	OK - means ok.
+ */
+int getProfileHead(MercuryCtx* ctx, ProfileHead* head)
+{
+	ReadParamCmd cmd =
+	{
+		.address = ctx->meter.address,
+		.command = 0x08,
+		.paramId = 0x13,
+		.BWRI = 0x00
+	};
+	cmd.CRC = ModRTU_CRC((byte*)&cmd, sizeof(cmd) - sizeof(UInt16));
+
+	Result_ProfileHead res;
+	byte buf[BSZ];
+	int checkResult = exchange(ctx, (byte*)&cmd, sizeof(cmd), buf, sizeof(res));
+	if (OK != checkResult)
+		return checkResult;
+	memcpy(&res, buf, sizeof(res));
+
+	head->address = res.offset[0] << 8 | res.offset[1];
+	head->status = res.status;
+	head->time = stamp(&res.hour);
+	head->period = (res.period) ? res.period : 30;
+	return OK;
+}
+
+/*
+ * Read the records from the memory address given in one memory read.
+ *
+ * Parameters:
+ *	count - records, up to PROFILE_BLOCK, not crossing the end of memory.
+ *	records - receives the valid records in the memory order, the
+ *		erased and broken ones are skipped.
+ *	decoded - receives the number of them.
+ *
+ * Returns:
+ *	COMMUNICATION_ERROR - unable to get responce from tty.
+ * 	WRONG_CRC - data recieved but CRC check failed.
+ *	OK - means ok.
+ */
+int readProfile(MercuryCtx* ctx, int address, int count, ProfileRecord* records, int* decoded)
+{
+	ReadMemCmd cmd =
+	{
+		.address = ctx->meter.address,
+		.command = 0x06,
+		.memory = PROFILE_MEMORY,
+		.offset = { (address >> 8) & 0xFF, address & 0xFF },
+		.length = count * PROFILE_RECORD_SIZE
+	};
+	cmd.CRC = ModRTU_CRC((byte*)&cmd, sizeof(cmd) - sizeof(UInt16));
+
+	byte buf[BSZ];
+	*decoded = 0;
+	int checkResult = exchange(ctx, (byte*)&cmd, sizeof(cmd), buf, 1 + cmd.length + sizeof(UInt16));
+	if (OK != checkResult)
+		return checkResult;
+
+	// status, hour, minute, day, month, year, period, then P+, P-, Q+, Q- impulses
+	for (int i = 0; i < count; i++)
+	{
+		const byte* r = buf + 1 + i * PROFILE_RECORD_SIZE;
+		time_t time = stamp(r + 1);
+		if (time < 0 || !r[6] || 0xFF == r[6])
+			continue;
+
+		ProfileRecord* rec = &records[(*decoded)++];
+		rec->time = time;
+		rec->period = r[6];
+		rec->status = r[0];
+		rec->ap = power(r + 7, rec->period);
+		rec->am = power(r + 9, rec->period);
+		rec->rp = power(r + 11, rec->period);
+		rec->rm = power(r + 13, rec->period);
+	}
+	return OK;
+}
+
+// -- Position the walk at the oldest of the last records (the last one included)
+void profileSeek(ProfileCursor* cursor, const ProfileHead* head, int records)
+{
+	if (records > PROFILE_CAPACITY)
+		records = PROFILE_CAPACITY;
+	if (records < 0)
+		records = 0;
+
+	cursor->address = (head->address - (records - 1) * PROFILE_RECORD_SIZE) & ADDRESS_MASK;
+	cursor->left = records;
+}
+
+/*
+ * Read the next block of the walk, oldest records first, and advance.
+ *
+ * Parameters:
+ *	records - room for PROFILE_BLOCK records.
+ *
+ * Returns:
+ *	as readProfile, the cursor stays in place on errors.
+ */
+int profileNext(MercuryCtx* ctx, ProfileCursor* cursor, ProfileRecord* records, int* decoded)
+{
+	int count = (cursor->left < PROFILE_BLOCK) ? cursor->left : PROFILE_BLOCK;
+	int toEnd = (ADDRESS_MASK + 1 - cursor->address) / PROFILE_RECORD_SIZE;
+	if (count > toEnd)
+		count = toEnd;
+
+	*decoded = 0;
+	if (!count)
+		return OK;
+
+	int result = readProfile(ctx, cursor->address, count, records, decoded);
+	if (OK == result)
+	{
+		cursor->address = (cursor->address + count * PROFILE_RECORD_SIZE) & ADDRESS_MASK;
+		cursor->left -= count;
+	}
+	return result;
+}
+
+/*
+ * Position the walk after the record stored last. The record is read back
+ * first: if a newer one is there, the archive has wrapped since and the
+ * records in between are lost, the walk then covers the whole archive.
+ * Nothing stored yet (mark->address < 0) - the whole archive too.
+ *
+ * Returns:
+ *	as readProfile, wrapped receives non zero if records were lost.
+ */
+int profileResume(MercuryCtx* ctx, ProfileCursor* cursor, const ProfileHead* head, const ProfileMark* mark, int* wrapped)
+{
+	*wrapped = 0;
+	if (mark->address < 0)
+	{
+		profileSeek(cursor, head, PROFILE_CAPACITY);
+		return OK;
+	}
+
+	// no newer record: the head is the same one (the mark may lag behind erased records)
+	if (head->time >= 0 && head->time <= mark->time)
+	{
+		cursor->address = (head->address + PROFILE_RECORD_SIZE) & ADDRESS_MASK;
+		cursor->left = 0;
+		return OK;
+	}
+
+	ProfileRecord last;
+	int decoded;
+	int result = readProfile(ctx, mark->address, 1, &last, &decoded);
+	if (OK != result)
+		return result;
+
+	// a newer record there means a lap of the ring (erased memory does not)
+	if (!decoded || last.time <= mark->time)
+	{
+		int records = ((head->address - mark->address) & ADDRESS_MASK) / PROFILE_RECORD_SIZE;
+		cursor->address = (mark->address + PROFILE_RECORD_SIZE) & ADDRESS_MASK;
+		cursor->left = records;
+	}
+	else
+	{
+		*wrapped = 1;
+		profileSeek(cursor, head, PROFILE_CAPACITY);
+	}
+	return OK;
+}
+
+// -- Load the mark of the last sync, returns -1 (and no mark) if there is none
+int readProfileMark(const char* path, ProfileMark* mark)
+{
+	mark->address = -1;
+	mark->time = 0;
+
+	FILE* f = fopen(path, "r");
+	if (NULL == f)
+		return -1;
+
+	int address;
+	int64_t time;
+	int ok = (2 == fscanf(f, "%d %" SCNd64, &address, &time) && address >= 0 && address <= ADDRESS_MASK);
+	fclose(f);
+	if (!ok)
+		return -1;
+
+	mark->address = address;
+	mark->time = time;
+	return 0;
+}
+
+// -- Store the mark, replaced atomically so that a crash leaves the old or the new one
+int writeProfileMark(const char* path, const ProfileMark* mark)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE* f = fopen(tmp, "w");
+	if (NULL == f)
+		return -1;
+
+	int ok = (fprintf(f, "%d %" PRId64 "\n", mark->address, mark->time) > 0);
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp, path))
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *	Mercury 236 load profile: the archive of the average power by
+ *	integration period (30 minutes by default) kept in the meter memory.
+ *
+ *	The last record is located with the profile head request (08h 13h),
+ *	the archive is then read with memory reads (06h, memory 3) of
+ *	PROFILE_BLOCK records each instead of one request per record. The
+ *	records are 16 bytes apart, a 16-bit address covers PROFILE_CAPACITY
+ *	of them (85 days at 30 minutes) and wraps around.
+ *
+ *	ProfileCursor cursor;
+ *	profileSeek(&cursor, &head, records);
+ *	while (cursor.left && OK == profileNext(ctx, &cursor, block, &count))
+ *		...
+ *
+ *	Incremental sync keeps a ProfileMark (address and time stamp of the
+ *	last record stored) in a file of its own, profileResume() positions
+ *	the walk after it and tells whether the archive has wrapped since.
+ */
+#ifndef MERCURY_PROFILE_H
+#define MERCURY_PROFILE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "mercury236.h"
+
+#define PROFILE_RECORD_SIZE	16		// record stride in the memory
+#define PROFILE_BLOCK		15		// records per memory read, the largest frame
+#define PROFILE_CAPACITY	4096		// records addressed, older ones are overwritten
+#define PROFILE_MEMORY		0x03		// memory number of the profile
+#define PROFILE_CONSTANT	1000		// meter constant (imp/kWh)
+#define PROFILE_NO_DATA		0xFFFF		// value of the period not measured
+#define PROFILE_RETRIES		3		// repeat broken memory reads, long frames break more often
+
+// Profile head: the last record written
+typedef struct
+{
+	int		address;		// memory address of the last record
+	int		status;			// status byte of the record
+	time_t		time;			// its time stamp
+	int		period;			// integration period (minutes)
+} ProfileHead;
+
+// Profile record, the average power over the period
+typedef struct
+{
+	int64_t		time;			// time stamp of the period (seconds since epoch)
+	int32_t		period;			// integration period (minutes)
+	int32_t		status;			// status byte
+	float		ap;			// active + (W)
+	float		am;			// active - (W)
+	float		rp;			// reactive + (var)
+	float		rm;			// reactive - (var)
+} ProfileRecord;
+
+// Position of the archive walk
+typedef struct
+{
+	int		address;		// memory address of the next record to read
+	int		left;			// records to read
+} ProfileCursor;
+
+// Last record stored by an incremental sync
+typedef struct
+{
+	int		address;		// its memory address, -1 nothing stored yet
+	int64_t		time;			// its time stamp
+} ProfileMark;
+
+// Function prototypes:
+int getProfileHead(MercuryCtx*, ProfileHead*);
+int readProfile(MercuryCtx*, int address, int count, ProfileRecord*, int* decoded);
+void profileSeek(ProfileCursor*, const ProfileHead*, int records);
+int profileNext(MercuryCtx*, ProfileCursor*, ProfileRecord*, int* decoded);
+int profileResume(MercuryCtx*, ProfileCursor*, const ProfileHead*, const ProfileMark*, int* wrapped);
+int readProfileMark(const char* path, ProfileMark*);
+int writeProfileMark(const char* path, const ProfileMark*);
+
+#endif
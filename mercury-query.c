@@ -0,0 +1,289 @@
+/*
+ *	Mercury 236 time-series store query: prints the samples stored by
+ *	mercury-mon --store, or the aggregates of mercury-mon --rollup, as CSV.
+ *
+ *	$ ./mercury-query /var/lib/mercury/samples.tsdb --from "2020-09-13 10:00" --fields S
+ *	$ ./mercury-query /var/lib/mercury/rollup.db --rollup day --fields S,PR
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mercury236.h"
+#include "mercury-tsdb.h"
+#include "mercury-rollup.h"
+
+#define OPT_FROM		"--from"
+#define OPT_TO			"--to"
+#define OPT_FIELDS		"--fields"
+#define OPT_HEADER		"--header"
+#define OPT_ROLLUP		"--rollup"
+#define OPT_HELP		"--help"
+
+#define BSZ			255
+
+typedef enum
+{
+	EXIT_OK = 0,
+	EXIT_FAIL = 1
+} ExitCode;
+
+// -- Command line usage help
+void printUsage()
+{
+	printf("Usage: mercury-query FILE [OPTIONS] ...\n\r\n\r");
+	printf("  FILE\t\ttime-series store written by mercury-mon --store (or rollup file of\n\r");
+	printf("\t\tmercury-mon --rollup with %s), required\n\r", OPT_ROLLUP);
+	printf("  %s TIME\tfirst sample time, seconds since epoch or YYYY-MM-DD[ HH:MM[:SS]]\n\r", OPT_FROM);
+	printf("  %s TIME\tlast sample time (default now)\n\r", OPT_TO);
+	printf("  %s LIST\tprint only the fields listed, e.g. P,S,PT\n\r", OPT_FIELDS);
+	printf("\t\t(U,I,CosF,F,A,P,S,PR,PR-day,PR-night,PY,PT)\n\r");
+	printf("  %s\tto print data header\n\r", OPT_HEADER);
+	printf("  %s RES\tprint aggregates by minute, hour or day: min, mean, max and last\n\r", OPT_ROLLUP);
+	printf("\t\tvalues, energy consumed for the counters, share of time mains was ON\n\r");
+	printf("\n\r");
+	printf("  %s\tprints this screen\n\r", OPT_HELP);
+}
+
+/*
+ * Parse time of the command line.
+ *
+ * Returns:
+ *	ms since epoch or -1 if not recognised.
+ */
+int64_t parseTime(const char* str)
+{
+	char* end;
+	long long sec = strtoll(str, &end, 10);
+	if (!*end)
+		return sec * 1000;
+
+	static const char* formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+	for (int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	{
+		struct tm tm;
+		bzero(&tm, sizeof(tm));
+		const char* rest = strptime(str, formats[i], &tm);
+		if (rest && !*rest)
+		{
+			tm.tm_isdst = -1;
+			return (int64_t)mktime(&tm) * 1000;
+		}
+	}
+	return -1;
+}
+
+// -- Value names of the parameter
+const char* valueName(const ParamDesc* p, int i)
+{
+	static const char* phases[] = { "p1", "p2", "p3" };
+	static const char* phasesSum[] = { "sum", "p1", "p2", "p3" };
+	static const char* power[] = { "ap", "am", "rp", "rm" };
+
+	if (0x05 == p->command)
+		return power[i];
+	return (4 == p->count) ? phasesSum[i] : phases[i];
+}
+
+void printHeader(int fields)
+{
+	printf("DT");
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (fields & paramTable[p].field)
+			for (int i = 0; i < paramTable[p].count; i++)
+			{
+				if (1 == paramTable[p].count)
+					printf(",%s", paramTable[p].name);
+				else
+					printf(",%s.%s", paramTable[p].name, valueName(&paramTable[p], i));
+			}
+	printf(",MS\n");
+}
+
+// -- Print date and time of the ms timestamp
+void printTime(int64_t timestamp, int withMs)
+{
+	time_t sec = timestamp / 1000;
+	struct tm *ti = localtime(&sec);
+	printf("%4d-%02d-%02d %02d:%02d:%02d",
+		ti->tm_year+1900, ti->tm_mon+1, ti->tm_mday,
+		ti->tm_hour, ti->tm_min, ti->tm_sec);
+	if (withMs)
+		printf(".%03d", (int)(timestamp % 1000));
+}
+
+// -- Print the sample as CSV line
+int printSample(void* arg, int64_t timestamp, const OutputBlock* o)
+{
+	int fields = *(int*)arg;
+
+	printTime(timestamp, 1);
+
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (fields & paramTable[p].field)
+		{
+			const float* values = (const float*)((const byte*)o + paramTable[p].target);
+			for (int i = 0; i < paramTable[p].count; i++)
+				printf(",%.2f", values[i]);
+		}
+	printf(",%d\n", (MS_ON == o->ms) ? 1 : 0);
+	return 0;
+}
+
+void printRollupHeader(int fields)
+{
+	printf("DT,N");
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (fields & paramTable[p].field)
+			for (int i = 0; i < paramTable[p].count; i++)
+			{
+				char name[BSZ];
+				if (1 == paramTable[p].count)
+					snprintf(name, BSZ, "%s", paramTable[p].name);
+				else
+					snprintf(name, BSZ, "%s.%s", paramTable[p].name, valueName(&paramTable[p], i));
+
+				if (0x05 == paramTable[p].command)
+					printf(",%s.delta", name);
+				else
+					printf(",%s.min,%s.mean,%s.max,%s.last", name, name, name, name);
+			}
+	printf(",MS\n");
+}
+
+// -- Print the bucket as CSV line
+int printBucket(void* arg, const RollupBucket* b)
+{
+	int fields = *(int*)arg;
+
+	printTime(b->start * 1000, 0);
+	printf(",%u", b->count);
+
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (fields & paramTable[p].field)
+			for (int i = 0; i < paramTable[p].count; i++)
+			{
+				int w = paramTable[p].target / sizeof(uint32_t) + i;
+				if (!b->counts[w])
+					printf((0x05 == paramTable[p].command) ? "," : ",,,,");
+				else if (0x05 == paramTable[p].command)
+					printf(",%.3f", b->last[w] - b->first[w]);
+				else
+					printf(",%.2f,%.2f,%.2f,%.2f",
+						b->min[w], b->sum[w] / b->counts[w], b->max[w], b->last[w]);
+			}
+
+	int ms = offsetof(OutputBlock, ms) / sizeof(uint32_t);
+	if (b->counts[ms])
+		printf(",%.3f\n", b->sum[ms] / b->counts[ms]);
+	else
+		printf(",\n");
+	return 0;
+}
+
+int main(int argc, const char** args)
+{
+	// must have the store file (1st required param)
+	if (argc < 2)
+	{
+		printf("Error: no store file specified\n\r\n\r");
+		printUsage();
+		exit(EXIT_FAIL);
+	}
+
+	int64_t from = 0, to = (int64_t)time(NULL) * 1000;
+	int fields = OB_ALL, header = 0, resolution = -1;
+
+	for (int i=2; i<argc; i++)
+	{
+		int hasArg = i + 1 < argc;
+
+		if ((!strcmp(OPT_FROM, args[i]) || !strcmp(OPT_TO, args[i])) && hasArg)
+		{
+			int64_t t = parseTime(args[i + 1]);
+			if (t < 0)
+			{
+				printf("Error: time %s is not recognised\n\r\n\r", args[i + 1]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+			if (!strcmp(OPT_FROM, args[i++]))
+				from = t;
+			else
+				to = t;
+		}
+		else if (!strcmp(OPT_FIELDS, args[i]) && hasArg)
+		{
+			fields = parseFields(args[++i]);
+			if (!fields)
+			{
+				printf("Error: %s list %s is not recognised\n\r\n\r", OPT_FIELDS, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_HEADER, args[i]))
+			header = 1;
+		else if (!strcmp(OPT_ROLLUP, args[i]) && hasArg)
+		{
+			i++;
+			if (!strcmp("minute", args[i]))
+				resolution = RR_MINUTE;
+			else if (!strcmp("hour", args[i]))
+				resolution = RR_HOUR;
+			else if (!strcmp("day", args[i]))
+				resolution = RR_DAY;
+			else
+			{
+				printf("Error: %s %s is not recognised\n\r\n\r", OPT_ROLLUP, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_HELP, args[i]))
+		{
+			printUsage();
+			exit(EXIT_OK);
+		}
+		else
+		{
+			printf("Error: %s option is not recognised\n\r\n\r", args[i]);
+			printUsage();
+			exit(EXIT_FAIL);
+		}
+	}
+
+	if (resolution >= 0)
+	{
+		Rollup* r = rollupOpen(args[1], 0);
+		if (!r)
+		{
+			printf("Cannot open %s rollup file.\n\r", args[1]);
+			exit(EXIT_FAIL);
+		}
+
+		if (header)
+			printRollupHeader(fields);
+		rollupQuery(r, resolution, from / 1000, to / 1000, printBucket, &fields);
+
+		rollupClose(r);
+		exit(EXIT_OK);
+	}
+
+	Tsdb* db = tsdbOpen(args[1], 0);
+	if (!db)
+	{
+		printf("Cannot open %s time-series store.\n\r", args[1]);
+		exit(EXIT_FAIL);
+	}
+
+	if (header)
+		printHeader(fields);
+	tsdbQuery(db, from, to, fields, printSample, &fields);
+
+	tsdbClose(db);
+	exit(EXIT_OK);
+}
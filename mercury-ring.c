@@ -0,0 +1,102 @@
+/*
+ *	Mercury 236 sample ring, see mercury-ring.h.
+ */
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include "mercury-ring.h"
+
+#define RING_MASK	(RING_SLOTS - 1)
+
+void ringInit(SampleRing* r, int policy)
+{
+	memset(r, 0, sizeof(SampleRing));
+	r->policy = policy;
+}
+
+/*
+ * Queue the sample, never waits (producer thread only).
+ *
+ * Returns:
+ *	0 - queued (RP_OVERWRITE_OLDEST: maybe instead of the oldest one),
+ *	-1 - dropped, the ring is full (RP_DROP_NEWEST).
+ */
+int ringPush(SampleRing* r, const Sample* sample)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= RING_SLOTS && RP_DROP_NEWEST == r->policy)
+	{
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	// the consumer copying the old sample out of the slot sees the change
+	RingSlot* s = &r->slots[head & RING_MASK];
+	__atomic_store_n(&s->seq, 2 * head + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&s->sample, sample, sizeof(Sample));
+
+	__atomic_store_n(&s->seq, 2 * head + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&r->pushed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Take the oldest sample queued (consumer thread only). The samples the
+ * producer has overwritten before or while they were taken are skipped
+ * and counted.
+ *
+ * Returns:
+ *	0 - ok, -1 - the ring is empty.
+ */
+int ringPop(SampleRing* r, Sample* sample)
+{
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail == head)
+			return -1;
+
+		// lapped: the slots behind the last RING_SLOTS are reused
+		if (head - tail > RING_SLOTS)
+		{
+			__atomic_add_fetch(&r->overwritten, head - RING_SLOTS - tail, __ATOMIC_RELAXED);
+			tail = head - RING_SLOTS;
+		}
+
+		RingSlot* s = &r->slots[tail & RING_MASK];
+		uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq == 2 * tail + 2)
+		{
+			memcpy(sample, &s->sample, sizeof(Sample));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			{
+				__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+
+		// overwritten by a newer one, go on with the next
+		__atomic_add_fetch(&r->overwritten, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&r->tail, ++tail, __ATOMIC_RELEASE);
+	}
+}
+
+// -- Counters snapshot, from any thread
+void ringStats(const SampleRing* r, RingStats* st)
+{
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	st->pushed = __atomic_load_n(&r->pushed, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	st->overwritten = __atomic_load_n(&r->overwritten, __ATOMIC_RELAXED);
+	st->queued = (head > tail) ? head - tail : 0;
+	if (st->queued > RING_SLOTS)
+		st->queued = RING_SLOTS;
+}
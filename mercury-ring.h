@@ -0,0 +1,88 @@
+/*
+ *	Mercury 236 sample ring: bounded lock-free single producer, single
+ *	consumer queue of the samples between the poller and a slow sink.
+ *
+ *	The producer never waits. When the ring is full the policy of the ring
+ *	decides: RP_DROP_NEWEST drops the sample pushed (the queued ones stay
+ *	in order), RP_OVERWRITE_OLDEST replaces the oldest one (the consumer
+ *	gets the latest ones). Every slot is written under a seqlock, so the
+ *	consumer detects a sample overwritten while it was copying it and
+ *	skips it. The counters are updated atomically and can be read from any
+ *	thread.
+ *
+ *	A ring is zeroed and ringInit()'ed before use and is not copied while
+ *	in use; one thread pushes, one pops.
+ */
+#ifndef MERCURY_RING_H
+#define MERCURY_RING_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define RING_SLOTS		256		// samples queued, a power of 2
+#define RING_CACHE_LINE		64
+
+// Sample kinds
+typedef enum
+{
+	SK_METER = 0,		// poll result of a meter
+	SK_TOTAL = 1		// power of all meters together
+} SampleKind;
+
+// Timestamped sample
+typedef struct
+{
+	int64_t		time;			// ms since epoch
+	int32_t		kind;			// SampleKind
+	int32_t		port;			// index of the port
+	int32_t		meter;			// index of the meter on the port
+	int32_t		status;			// ResultCode of the poll
+	uint32_t	read;			// parameters read (bits of ParamId)
+	uint32_t	valid;			// fields of o published (OutputField mask)
+	uint32_t	fresh;			// fields of o read by this poll
+	float		total;			// SK_TOTAL: all meters (W)
+	OutputBlock	o;
+} Sample;
+
+// Full ring policies
+typedef enum
+{
+	RP_DROP_NEWEST = 0,	// the sample pushed is dropped
+	RP_OVERWRITE_OLDEST = 1	// the oldest sample queued is overwritten
+} RingPolicy;
+
+typedef struct
+{
+	uint64_t	seq;			// 2 * position + 2 once written, odd while writing
+	Sample		sample;
+} RingSlot;
+
+typedef struct
+{
+	uint64_t	head;			// samples pushed, written by the producer
+	char		headPad[RING_CACHE_LINE - sizeof(uint64_t)];
+	uint64_t	tail;			// samples consumed or skipped, written by the consumer
+	char		tailPad[RING_CACHE_LINE - sizeof(uint64_t)];
+	int		policy;			// RingPolicy
+	uint64_t	pushed;			// counters
+	uint64_t	dropped;
+	uint64_t	overwritten;
+	RingSlot	slots[RING_SLOTS];
+} SampleRing;
+
+// Counters snapshot
+typedef struct
+{
+	uint64_t	pushed;			// accepted by the ring
+	uint64_t	dropped;		// RP_DROP_NEWEST: not accepted, the ring was full
+	uint64_t	overwritten;		// RP_OVERWRITE_OLDEST: lost before consumed
+	uint64_t	queued;			// waiting for the consumer
+} RingStats;
+
+// Function prototypes:
+void ringInit(SampleRing*, int policy);
+int ringPush(SampleRing*, const Sample*);
+int ringPop(SampleRing*, Sample*);
+void ringStats(const SampleRing*, RingStats*);
+
+#endif
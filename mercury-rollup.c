@@ -0,0 +1,219 @@
+/*
+ *	Mercury 236 rollups.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mercury-rollup.h"
+
+#define HEADER_SIZE		4096		// rings start at the next page
+
+static const int periods[RR_COUNT] = { 60, 3600, 86400 };
+static const uint32_t sizes[RR_COUNT] = { ROLLUP_MINUTES, ROLLUP_HOURS, ROLLUP_DAYS };
+
+// -- Bucket period of the resolution (sec)
+int rollupPeriod(int resolution)
+{
+	return periods[resolution];
+}
+
+// -- Words of OutputBlock the fields take
+static void fieldWords(uint32_t fields, byte* wanted)
+{
+	bzero(wanted, ROLLUP_WORDS);
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (fields & paramTable[p].field)
+			memset(wanted + paramTable[p].target / sizeof(uint32_t), 1, paramTable[p].count);
+
+	if (fields & OB_MS)
+		wanted[offsetof(OutputBlock, ms) / sizeof(uint32_t)] = 1;
+}
+
+// -- Start of the bucket the time belongs to
+static int64_t bucketStart(const Rollup* r, int resolution, int64_t time)
+{
+	int64_t local = time + r->header->offset;
+	int64_t key = local / periods[resolution] - (local % periods[resolution] < 0);
+	return key * periods[resolution] - r->header->offset;
+}
+
+static RollupBucket* bucketAt(const Rollup* r, int resolution, int64_t start)
+{
+	int64_t key = (start + r->header->offset) / periods[resolution];
+	return &r->ring[resolution][key % r->header->size[resolution]];
+}
+
+/*
+ * Open the rollup file, the writer creates it if there is none.
+ *
+ * Returns:
+ *	rollup handle or NULL if the file is not available or not a rollup.
+ */
+Rollup* rollupOpen(const char* path, int writable)
+{
+	Rollup* r = calloc(1, sizeof(Rollup));
+	if (!r)
+		return NULL;
+
+	size_t size = HEADER_SIZE;
+	for (int i = 0; i < RR_COUNT; i++)
+		size += sizes[i] * sizeof(RollupBucket);
+
+	struct stat st;
+	r->fd = open(path, (writable) ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (r->fd < 0 || fstat(r->fd, &st) ||
+		(0 == st.st_size && (!writable || ftruncate(r->fd, size))) ||
+		(0 != st.st_size && st.st_size != size))
+	{
+		rollupClose(r);
+		return NULL;
+	}
+
+	void* map = mmap(NULL, size, (writable) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, r->fd, 0);
+	if (MAP_FAILED == map)
+	{
+		rollupClose(r);
+		return NULL;
+	}
+	r->mapSize = size;
+	r->header = map;
+
+	if (0 == st.st_size)
+	{
+		// new file: days from the local midnight
+		time_t now = time(NULL);
+		struct tm tm;
+		localtime_r(&now, &tm);
+
+		memcpy(r->header->magic, ROLLUP_MAGIC, sizeof(r->header->magic));
+		r->header->version = ROLLUP_VERSION;
+		r->header->offset = tm.tm_gmtoff;
+		memcpy(r->header->size, sizes, sizeof(sizes));
+	}
+
+	if (memcmp(r->header->magic, ROLLUP_MAGIC, sizeof(r->header->magic)) ||
+		ROLLUP_VERSION != r->header->version ||
+		memcmp(r->header->size, sizes, sizeof(sizes)))
+	{
+		rollupClose(r);
+		return NULL;
+	}
+
+	byte* ring = (byte*)map + HEADER_SIZE;
+	for (int i = 0; i < RR_COUNT; i++)
+	{
+		r->ring[i] = (RollupBucket*)ring;
+		ring += sizes[i] * sizeof(RollupBucket);
+	}
+	return r;
+}
+
+void rollupClose(Rollup* r)
+{
+	if (!r)
+		return;
+
+	if (r->header)
+		munmap(r->header, r->mapSize);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+}
+
+/*
+ * Add the sample (time in sec since epoch) to the buckets of every
+ * resolution, only the fields given are aggregated.
+ *
+ * Returns:
+ *	0 - ok, -1 - the sample is older than the last one added.
+ */
+int rollupAdd(Rollup* r, int64_t time, const OutputBlock* o, uint32_t valid)
+{
+	RollupHeader* h = r->header;
+	if (time < h->lastTime)
+		return -1;
+
+	byte wanted[ROLLUP_WORDS];
+	fieldWords(valid, wanted);
+	float values[ROLLUP_WORDS];
+	memcpy(values, o, sizeof(values));
+
+	for (int res = 0; res < RR_COUNT; res++)
+	{
+		int64_t start = bucketStart(r, res, time);
+		RollupBucket* b = bucketAt(r, res, start);
+		if (b->start != start)
+		{
+			// the slot still holds the bucket of the previous round
+			bzero(b, sizeof(RollupBucket));
+			b->start = start;
+		}
+
+		b->count++;
+		b->valid |= valid;
+		for (int w = 0; w < ROLLUP_WORDS; w++)
+		{
+			if (!wanted[w])
+				continue;
+
+			float v = values[w];
+			if (!b->counts[w])
+			{
+				b->first[w] = (h->seen[w]) ? h->lastValue[w] : v;
+				b->min[w] = b->max[w] = v;
+			}
+			else if (v < b->min[w])
+				b->min[w] = v;
+			else if (v > b->max[w])
+				b->max[w] = v;
+
+			b->counts[w]++;
+			b->sum[w] += v;
+			b->last[w] = v;
+		}
+	}
+
+	for (int w = 0; w < ROLLUP_WORDS; w++)
+		if (wanted[w])
+		{
+			h->lastValue[w] = values[w];
+			h->seen[w] = 1;
+		}
+	h->lastTime = time;
+	return 0;
+}
+
+/*
+ * Visit buckets of the resolution within the time range [from, to]
+ * (sec since epoch), empty ones are skipped.
+ *
+ * Returns:
+ *	number of buckets visited.
+ */
+int rollupQuery(Rollup* r, int resolution, int64_t from, int64_t to, RollupVisitor visit, void* arg)
+{
+	int visited = 0;
+
+	// older than the ring holds is gone anyway
+	int64_t oldest = bucketStart(r, resolution, r->header->lastTime)
+		- (int64_t)(r->header->size[resolution] - 1) * periods[resolution];
+	int64_t start = bucketStart(r, resolution, (from > oldest) ? from : oldest);
+
+	for (; start <= to && start <= r->header->lastTime; start += periods[resolution])
+	{
+		const RollupBucket* b = bucketAt(r, resolution, start);
+		if (b->start != start || !b->count)
+			continue;
+
+		visited++;
+		if (visit(arg, b))
+			break;
+	}
+	return visited;
+}
@@ -0,0 +1,82 @@
+/*
+ *	Mercury 236 rollups: minute, hour and day aggregates of the samples,
+ *	kept in a memory-mapped file of bucket rings.
+ *
+ *	Every sample updates one bucket per resolution in O(1): count, min,
+ *	max, sum (for the mean) and last value of every OutputBlock word, the
+ *	first value too, so energy consumed within a bucket is last - first
+ *	of the PWV counters. The first value of a bucket is the last value of
+ *	the previous sample, so no energy is lost between buckets.
+ *
+ *	Buckets are aligned to the local time zone offset of the moment the
+ *	file was created (days run from local midnight). The file is updated
+ *	in place and survives restarts, aggregation continues where it stopped.
+ */
+#ifndef MERCURY_ROLLUP_H
+#define MERCURY_ROLLUP_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define ROLLUP_MAGIC		"MERCROLL"
+#define ROLLUP_VERSION		1
+#define ROLLUP_WORDS		(sizeof(OutputBlock) / sizeof(uint32_t))
+
+// Resolutions
+typedef enum
+{
+	RR_MINUTE = 0,
+	RR_HOUR = 1,
+	RR_DAY = 2,
+	RR_COUNT
+} RollupResolution;
+
+#define ROLLUP_MINUTES		2880		// 2 days of minute buckets
+#define ROLLUP_HOURS		2232		// 93 days of hour buckets
+#define ROLLUP_DAYS		3660		// 10 years of day buckets
+
+// Aggregates of one time interval
+typedef struct
+{
+	int64_t		start;			// sec since epoch, 0 if empty
+	uint32_t	count;			// samples
+	uint32_t	valid;			// fields seen (OutputField mask)
+	uint32_t	counts[ROLLUP_WORDS];	// samples by word
+	float		first[ROLLUP_WORDS];	// value before the bucket (counters) or the first one
+	float		last[ROLLUP_WORDS];
+	float		min[ROLLUP_WORDS];
+	float		max[ROLLUP_WORDS];
+	double		sum[ROLLUP_WORDS];
+} RollupBucket;
+
+// File header, bucket rings follow
+typedef struct
+{
+	char		magic[8];
+	uint32_t	version;
+	int32_t		offset;			// alignment, sec east of UTC
+	uint32_t	size[RR_COUNT];		// ring sizes
+	int64_t		lastTime;		// the last sample added, 0 if none
+	float		lastValue[ROLLUP_WORDS];	// the last value of every word
+	byte		seen[ROLLUP_WORDS];		// lastValue is there
+} RollupHeader;
+
+typedef struct
+{
+	int		fd;
+	size_t		mapSize;
+	RollupHeader*	header;
+	RollupBucket*	ring[RR_COUNT];
+} Rollup;
+
+// Query callback, return non zero to stop
+typedef int (*RollupVisitor)(void* arg, const RollupBucket*);
+
+// Function prototypes:
+Rollup* rollupOpen(const char* path, int writable);
+void rollupClose(Rollup*);
+int rollupAdd(Rollup*, int64_t time, const OutputBlock*, uint32_t valid);
+int rollupQuery(Rollup*, int resolution, int64_t from, int64_t to, RollupVisitor, void* arg);
+int rollupPeriod(int resolution);
+
+#endif
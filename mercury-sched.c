@@ -0,0 +1,111 @@
+/*
+ *	Mercury 236 poll scheduler.
+ */
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "mercury-sched.h"
+
+// -- Monotonic clock, milliseconds
+int64_t schedClock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// -- Set up base periods (ms by ParamIndex, 0 - not polled), everything is due now
+void schedInit(Schedule* s, const int* periods)
+{
+	bzero(s, sizeof(Schedule));
+	for (int p = 0; p < PARAM_COUNT; p++)
+	{
+		s->e[p].period = (periods[p] > 0 && periods[p] < SCHED_MIN_PERIOD) ? SCHED_MIN_PERIOD : periods[p];
+		s->e[p].current = s->e[p].period;
+	}
+}
+
+// -- Parameters due at the time given (bit per ParamIndex)
+int schedDue(const Schedule* s, int64_t now)
+{
+	int due = 0;
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (s->e[p].period && s->e[p].due <= now)
+			due |= 1 << p;
+	return due;
+}
+
+// -- Time of the earliest poll due
+int64_t schedNext(const Schedule* s)
+{
+	int64_t next = INT64_MAX;
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (s->e[p].period && s->e[p].due < next)
+			next = s->e[p].due;
+	return next;
+}
+
+// -- Largest relative change of the parameter values since the last poll
+static float change(const SchedEntry* e, const float* values, int count)
+{
+	float max = 0;
+	for (int i = 0; i < count; i++)
+	{
+		float base = fabsf(e->last[i]);
+		float d = fabsf(values[i] - e->last[i]) / ((base > 1) ? base : 1);
+		if (d > max)
+			max = d;
+	}
+	return max;
+}
+
+// -- The parameter is read: adapt its period to the rate of change, schedule the next poll
+void schedDone(Schedule* s, int param, int64_t now, const OutputBlock* o)
+{
+	const ParamDesc* desc = &paramTable[param];
+	SchedEntry* e = &s->e[param];
+	const float* values = (const float*)((const byte*)o + desc->target);
+
+	// energy counters only grow, nothing to adapt to
+	if (0x08 == desc->command && e->seen)
+	{
+		int fastest = e->period / SCHED_SPEEDUP;
+		if (fastest < SCHED_MIN_PERIOD)
+			fastest = SCHED_MIN_PERIOD;
+
+		if (change(e, values, desc->count) > SCHED_FAST_CHANGE)
+			e->current = (e->current / 2 > fastest) ? e->current / 2 : fastest;
+		else
+			e->current = (e->current + e->current / 2 < e->period) ? e->current + e->current / 2 : e->period;
+	}
+
+	memcpy(e->last, values, desc->count * sizeof(float));
+	e->seen = 1;
+
+	// keep the cadence unless the poll was late for the whole period
+	e->due += e->current;
+	if (e->due <= now)
+		e->due = now + e->current;
+}
+
+// -- The parameter could not be read, try again with the next cycle of the fastest one
+void schedRetry(Schedule* s, int param, int64_t now)
+{
+	int64_t next = INT64_MAX;
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (s->e[p].period && s->e[p].current < next)
+			next = s->e[p].current;
+	s->e[param].due = now + next;
+}
+
+// -- OutputField mask of the parameters (bit per ParamIndex)
+int schedFields(int params)
+{
+	int fields = 0;
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (params & 1 << p)
+			fields |= paramTable[p].field;
+	return fields;
+}
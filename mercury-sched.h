@@ -0,0 +1,44 @@
+/*
+ *	Mercury 236 poll scheduler: every parameter has its own poll period,
+ *	a cycle reads whatever is due within one session.
+ *
+ *	The period of a parameter halves (down to a quarter of the base
+ *	period) while its value changes fast and grows back by half to the
+ *	base period once it settles, so fresh power readings come when the
+ *	load changes without polling everything all the time.
+ */
+#ifndef MERCURY_SCHED_H
+#define MERCURY_SCHED_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define SCHED_MIN_PERIOD	250		// shortest poll period (ms)
+#define SCHED_SPEEDUP		4		// period may shorten down to base / SCHED_SPEEDUP
+#define SCHED_FAST_CHANGE	0.05		// relative change per poll counted as fast
+
+// Poll schedule of a parameter
+typedef struct
+{
+	int		period;			// base period (ms), 0 - not polled
+	int		current;		// current period (ms)
+	int64_t		due;			// next poll (ms, monotonic)
+	int		seen;			// last values are there
+	float		last[4];		// values of the last poll
+} SchedEntry;
+
+typedef struct
+{
+	SchedEntry	e[PARAM_COUNT];
+} Schedule;
+
+// Function prototypes:
+int64_t schedClock();
+void schedInit(Schedule*, const int* periods);
+int schedDue(const Schedule*, int64_t now);
+int64_t schedNext(const Schedule*);
+void schedDone(Schedule*, int param, int64_t now, const OutputBlock*);
+void schedRetry(Schedule*, int param, int64_t now);
+int schedFields(int params);
+
+#endif
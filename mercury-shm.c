@@ -0,0 +1,115 @@
+/*
+ *	Mercury 236 output block published through POSIX shared memory.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "mercury-shm.h"
+
+// -- Shared memory segment name of the meter on the port
+void snapshotName(const char* dev, int address, char* name, int size)
+{
+	char port[NAME_MAX];
+	portName(dev, port, sizeof(port));
+
+	if (PM_ADDRESS == address)
+		snprintf(name, size, "%s.%s", MERCURY_SHM, port);
+	else
+		snprintf(name, size, "%s.%s.%d", MERCURY_SHM, port, address);
+}
+
+/*
+ * Map the snapshot segment of the meter. The writer creates it, readers only attach.
+ *
+ * Returns:
+ *	snapshot pointer or NULL if the segment is not available.
+ */
+MercurySnapshot* openSnapshot(const char* dev, int address, int writable)
+{
+	char name[NAME_MAX];
+	snapshotName(dev, address, name, sizeof(name));
+
+	int prevMask = umask(0000);
+	int fd = shm_open(name, (writable) ? O_RDWR | O_CREAT : O_RDONLY, MERCURY_ACCESS_PERM);
+	umask(prevMask);
+	if (fd < 0)
+		return NULL;
+
+	if (writable && ftruncate(fd, sizeof(MercurySnapshot)) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void* ptr = mmap(NULL, sizeof(MercurySnapshot),
+		(writable) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == ptr)
+		return NULL;
+
+	// a writer killed while publishing left seq odd, the readers would retry forever
+	MercurySnapshot* snapshot = ptr;
+	if (writable)
+	{
+		uint32_t seq = __atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED);
+		__atomic_store_n(&snapshot->seq, seq + (seq & 1), __ATOMIC_RELEASE);
+	}
+	return snapshot;
+}
+
+// -- Unmap the snapshot segment
+void closeSnapshot(MercurySnapshot* snapshot)
+{
+	if (snapshot)
+		munmap(snapshot, sizeof(MercurySnapshot));
+}
+
+// -- Publish fresh output block (single writer)
+void publishSnapshot(MercurySnapshot* snapshot, const OutputBlock* o, uint32_t valid)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	uint32_t seq = __atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&snapshot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&snapshot->o, o, sizeof(OutputBlock));
+	snapshot->valid = valid;
+	snapshot->timestamp = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	__atomic_store_n(&snapshot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy out consistent output block, lock free.
+ *
+ * Returns:
+ *	0 - ok.
+ *	-1 - nothing published yet or the writer is stuck.
+ */
+int readSnapshot(const MercurySnapshot* snapshot, OutputBlock* o, uint32_t* valid, int64_t* timestamp)
+{
+	for (int i = 0; i < SHM_READ_RETRIES; i++)
+	{
+		uint32_t seq = __atomic_load_n(&snapshot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(o, &snapshot->o, sizeof(OutputBlock));
+		*valid = snapshot->valid;
+		*timestamp = snapshot->timestamp;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED) == seq)
+			return (seq) ? 0 : -1;
+	}
+	return -1;
+}
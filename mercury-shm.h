@@ -0,0 +1,34 @@
+/*
+ *	Mercury 236 output block published through POSIX shared memory.
+ *
+ *	The monitor (single writer) publishes every fresh OutputBlock under a
+ *	seqlock, readers copy it out without locking and retry if a write
+ *	happened in between. Every meter has its own segment named after the
+ *	port (see portName()), MERCURY_SHM.PORT for PM_ADDRESS and
+ *	MERCURY_SHM.PORT.ADDR for the others.
+ */
+#ifndef MERCURY_SHM_H
+#define MERCURY_SHM_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define MERCURY_SHM		"/MERCURY_RS485_OUTPUT"
+#define SHM_READ_RETRIES	1000	// give up if the writer is stuck mid-update
+
+typedef struct
+{
+	uint32_t	seq;		// seqlock sequence, odd while being written
+	uint32_t	valid;		// fields updated by the last poll (OutputField mask)
+	int64_t		timestamp;	// time of the last poll (ms since epoch)
+	OutputBlock	o;		// the last values received
+} MercurySnapshot;
+
+// Function prototypes:
+void snapshotName(const char* dev, int address, char* name, int size);
+MercurySnapshot* openSnapshot(const char* dev, int address, int writable);
+void closeSnapshot(MercurySnapshot*);
+void publishSnapshot(MercurySnapshot*, const OutputBlock*, uint32_t valid);
+int readSnapshot(const MercurySnapshot*, OutputBlock*, uint32_t* valid, int64_t* timestamp);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *	Mercury 236 bus transaction statistics.
+ */
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <time.h>
+#include "mercury236.h"
+#include "mercury-stats.h"
+
+// -- Monotonic clock, microseconds
+int64_t txClock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// -- Histogram bucket of the duration: floor(log2(us))
+static int bucket(int64_t us)
+{
+	int b = 0;
+	while (us > 1 && b < TX_HIST_BUCKETS - 1)
+	{
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+// -- Outcome of the library result code
+static int outcome(int result)
+{
+	switch (result)
+	{
+		case OK: return TX_OK;
+		case WRONG_CRC: return TX_WRONG_CRC;
+		case WRONG_RESULT_SIZE: return TX_WRONG_RESULT_SIZE;
+		case COMMUNICATION_ERROR:
+		case CHECK_CHANNEL_FAILURE: return TX_COMMUNICATION_ERROR;
+		default: return TX_METER_ERROR;
+	}
+}
+
+// -- Account the transaction of the command frame given
+void recordTx(TxStatsTable* table, const unsigned char* cmd, int cmdLen, const TxTiming* t, int result, int retries)
+{
+	// memory reads (06h) by the memory number, not the address
+	unsigned char paramId = (cmdLen > 4) ? cmd[2] : 0;
+	unsigned char BWRI = (cmdLen > 4 && 0x06 != cmd[1]) ? cmd[3] : 0;
+
+	TxStats* s = NULL;
+	for (int i = 0; i < table->keys && !s; i++)
+		if (table->entries[i].command == cmd[1] && table->entries[i].paramId == paramId && table->entries[i].BWRI == BWRI)
+			s = &table->entries[i];
+
+	if (!s)
+	{
+		if (table->keys == TX_KEYS)
+			s = &table->other;		// full, not under the label of another request
+		else
+		{
+			s = &table->entries[table->keys++];
+			s->command = cmd[1];
+			s->paramId = paramId;
+			s->BWRI = BWRI;
+		}
+	}
+
+	s->count++;
+	s->retries += retries;
+	s->outcomes[outcome(result)]++;
+	s->writeUs += t->written - t->start;
+
+	if (t->firstByte)
+	{
+		int64_t firstByte = t->firstByte - t->start;
+		int64_t lastByte = t->lastByte - t->start;
+
+		s->firstByteUs += firstByte;
+		s->lastByteUs += lastByte;
+		if (lastByte > s->maxLastByteUs)
+			s->maxLastByteUs = lastByte;
+		s->firstByteHist[bucket(firstByte)]++;
+		s->lastByteHist[bucket(lastByte)]++;
+	}
+}
+
+// -- Copy up to max statistics entries out, returns number of entries
+int getTxStats(const TxStatsTable* table, TxStats* stats, int max)
+{
+	int n = (table->keys < max) ? table->keys : max;
+	memcpy(stats, table->entries, n * sizeof(TxStats));
+	return n;
+}
+
+// -- Forget all statistics
+void resetTxStats(TxStatsTable* table)
+{
+	memset(table, 0, sizeof(TxStatsTable));
+}
+
+// -- Print the statistics row of the request, key is the cmd, param and BWRI columns
+static void printTxRow(FILE* f, const char* key, const TxStats* s)
+{
+	unsigned long replies = s->count - s->outcomes[TX_COMMUNICATION_ERROR];
+	double n = (s->count) ? s->count : 1;
+	double r = (replies) ? replies : 1;
+
+	fprintf(f, "%-14s %8lu %7lu %4lu %4lu %4lu %4lu %5lu %10.3f %9.3f %8.3f %7.3f\n",
+		key, s->count, s->retries,
+		s->outcomes[TX_OK], s->outcomes[TX_WRONG_CRC], s->outcomes[TX_WRONG_RESULT_SIZE],
+		s->outcomes[TX_COMMUNICATION_ERROR], s->outcomes[TX_METER_ERROR],
+		s->writeUs / n / 1000, s->firstByteUs / r / 1000, s->lastByteUs / r / 1000,
+		s->maxLastByteUs / 1000.0);
+}
+
+// -- Print statistics table
+void printTxStats(const TxStatsTable* table, FILE* f)
+{
+	fprintf(f, "cmd param BWRI    count retries   ok  crc size comm meter  write(ms) first(ms) last(ms) max(ms)\n");
+	for (int i = 0; i < table->keys; i++)
+	{
+		const TxStats* s = &table->entries[i];
+		char key[16];
+		snprintf(key, sizeof(key), " %02X    %02X   %02X", s->command, s->paramId, s->BWRI);
+		printTxRow(f, key, s);
+	}
+	if (table->other.count)
+		printTxRow(f, " other", &table->other);
+}
@@ -0,0 +1,72 @@
+/*
+ *	Mercury 236 bus transaction statistics.
+ *
+ *	Every command sent is accounted by its command, paramId and BWRI:
+ *	number of transactions and retries, outcomes, write time, time to the
+ *	first and to the last byte of the responce with log2 histograms.
+ *	Cheap enough (a few clock reads per transaction) to stay always on.
+ *	Every channel (MercuryCtx) keeps its own table, not shared between
+ *	threads.
+ */
+#ifndef MERCURY_STATS_H
+#define MERCURY_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TX_KEYS			64	// distinct requests accounted (the energy history uses 51), the rest go to other
+#define TX_HIST_BUCKETS		24	// bucket i counts [2^i, 2^(i+1)) us, the last one the rest
+
+// Transaction outcomes
+typedef enum
+{
+	TX_OK = 0,
+	TX_WRONG_CRC,
+	TX_WRONG_RESULT_SIZE,
+	TX_COMMUNICATION_ERROR,
+	TX_METER_ERROR,			// status code other than OK from the meter
+	TX_OUTCOMES
+} TxOutcome;
+
+// Timestamps of one transaction (us, monotonic clock)
+typedef struct
+{
+	int64_t	start;			// command write started
+	int64_t	written;		// command written
+	int64_t	firstByte;		// first responce byte received, 0 if none
+	int64_t	lastByte;		// last responce byte received, 0 if none
+} TxTiming;
+
+// Statistics of one kind of request
+typedef struct
+{
+	unsigned char	command;
+	unsigned char	paramId;
+	unsigned char	BWRI;
+	unsigned long	count;			// transactions
+	unsigned long	retries;		// commands repeated after broken responces
+	unsigned long	outcomes[TX_OUTCOMES];
+	uint64_t	writeUs;		// totals, divide by count for the mean
+	uint64_t	firstByteUs;
+	uint64_t	lastByteUs;
+	uint64_t	maxLastByteUs;
+	unsigned long	firstByteHist[TX_HIST_BUCKETS];
+	unsigned long	lastByteHist[TX_HIST_BUCKETS];
+} TxStats;
+
+// Statistics of a channel
+typedef struct
+{
+	TxStats		entries[TX_KEYS];
+	int		keys;			// entries used
+	TxStats		other;			// requests beyond TX_KEYS distinct ones, no key
+} TxStatsTable;
+
+// Function prototypes:
+int64_t txClock();
+void recordTx(TxStatsTable*, const unsigned char* cmd, int cmdLen, const TxTiming*, int result, int retries);
+int getTxStats(const TxStatsTable*, TxStats*, int max);
+void resetTxStats(TxStatsTable*);
+void printTxStats(const TxStatsTable*, FILE*);
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ *	Mercury 236 time-series store.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mercury-tsdb.h"
+
+#define PAYLOAD			(TSDB_BLOCK - sizeof(TsdbBlock))
+#define MAX_SAMPLES		(PAYLOAD * 8 / TSDB_WORDS + 1)	// every value takes a bit at least
+#define CHUNK_SIZE		((TSDB_CHUNK_BLOCKS + 1) * TSDB_BLOCK)
+
+// -- Append n (<= 64) bits of the value, most significant first
+static void putBits(byte* buf, uint32_t* pos, uint64_t value, int n)
+{
+	for (int i = n - 1; i >= 0; i--, (*pos)++)
+		if (value >> i & 1)
+			buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+		else
+			buf[*pos >> 3] &= ~(0x80 >> (*pos & 7));
+}
+
+// -- Read n (<= 64) bits
+static uint64_t getBits(const byte* buf, uint32_t* pos, int n)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < n; i++, (*pos)++)
+		value = value << 1 | (buf[*pos >> 3] >> (7 - (*pos & 7)) & 1);
+	return value;
+}
+
+static int leadingZeros(uint32_t x)
+{
+	return __builtin_clz(x);
+}
+
+static int trailingZeros(uint32_t x)
+{
+	return __builtin_ctz(x);
+}
+
+// -- Sign extension of n bits value
+static int64_t signExtend(uint64_t value, int n)
+{
+	return (int64_t)(value << (64 - n)) >> (64 - n);
+}
+
+// -- Encode timestamp delta-of-delta
+static void putTimestamp(byte* buf, uint32_t* pos, int64_t dod)
+{
+	if (0 == dod)
+		putBits(buf, pos, 0, 1);
+	else if (dod >= -64 && dod <= 63)
+	{
+		putBits(buf, pos, 0x2, 2);
+		putBits(buf, pos, dod, 7);
+	}
+	else if (dod >= -256 && dod <= 255)
+	{
+		putBits(buf, pos, 0x6, 3);
+		putBits(buf, pos, dod, 9);
+	}
+	else if (dod >= -2048 && dod <= 2047)
+	{
+		putBits(buf, pos, 0xE, 4);
+		putBits(buf, pos, dod, 12);
+	}
+	else
+	{
+		putBits(buf, pos, 0xF, 4);
+		putBits(buf, pos, dod, 64);
+	}
+}
+
+static int64_t getTimestamp(const byte* buf, uint32_t* pos)
+{
+	if (!getBits(buf, pos, 1))
+		return 0;
+	if (!getBits(buf, pos, 1))
+		return signExtend(getBits(buf, pos, 7), 7);
+	if (!getBits(buf, pos, 1))
+		return signExtend(getBits(buf, pos, 9), 9);
+	if (!getBits(buf, pos, 1))
+		return signExtend(getBits(buf, pos, 12), 12);
+	return (int64_t)getBits(buf, pos, 64);
+}
+
+// -- Encode value XOR-ed with the previous one of the column
+static void putValue(byte* buf, TsdbColumn* c, uint32_t value)
+{
+	uint32_t x = value ^ c->prev;
+	c->prev = value;
+
+	if (0 == x)
+	{
+		putBits(buf, &c->bits, 0, 1);
+		return;
+	}
+	putBits(buf, &c->bits, 1, 1);
+
+	int leading = leadingZeros(x), trailing = trailingZeros(x);
+	if (c->leading >= 0 && leading >= c->leading && trailing >= c->trailing)
+	{
+		// fits the previous window
+		putBits(buf, &c->bits, 0, 1);
+		putBits(buf, &c->bits, x >> c->trailing, 32 - c->leading - c->trailing);
+		return;
+	}
+
+	int length = 32 - leading - trailing;
+	putBits(buf, &c->bits, 1, 1);
+	putBits(buf, &c->bits, leading, 5);
+	putBits(buf, &c->bits, length - 1, 5);
+	putBits(buf, &c->bits, x >> trailing, length);
+	c->leading = leading;
+	c->trailing = trailing;
+}
+
+static uint32_t getValue(const byte* buf, TsdbColumn* c)
+{
+	if (getBits(buf, &c->bits, 1))
+	{
+		if (getBits(buf, &c->bits, 1))
+		{
+			c->leading = getBits(buf, &c->bits, 5);
+			c->trailing = 32 - c->leading - (getBits(buf, &c->bits, 5) + 1);
+		}
+		int length = 32 - c->leading - c->trailing;
+		c->prev ^= getBits(buf, &c->bits, length) << c->trailing;
+	}
+	return c->prev;
+}
+
+// -- Bytes of the open block
+static uint32_t blockBytes(const Tsdb* db)
+{
+	uint32_t bytes = 0;
+	for (int i = 0; i < TSDB_COLUMNS; i++)
+		bytes += (db->col[i].bits + 7) / 8;
+	return bytes;
+}
+
+static byte* chunkIndex(const Tsdb* db, uint32_t chunk)
+{
+	return db->map + TSDB_BLOCK + (size_t)chunk * CHUNK_SIZE;
+}
+
+static TsdbIndexEntry* indexEntry(const Tsdb* db, uint32_t block)
+{
+	return (TsdbIndexEntry*)chunkIndex(db, block / TSDB_CHUNK_BLOCKS) + block % TSDB_CHUNK_BLOCKS;
+}
+
+static TsdbBlock* blockAt(const Tsdb* db, uint32_t block)
+{
+	return (TsdbBlock*)(chunkIndex(db, block / TSDB_CHUNK_BLOCKS) + (1 + block % TSDB_CHUNK_BLOCKS) * TSDB_BLOCK);
+}
+
+// -- Blocks available in the mapping
+static uint32_t blocksMapped(const Tsdb* db)
+{
+	uint32_t chunks = (db->mapSize - TSDB_BLOCK) / CHUNK_SIZE;
+	uint32_t blocks = __atomic_load_n(&db->header->blocks, __ATOMIC_ACQUIRE);
+	return (blocks < chunks * TSDB_CHUNK_BLOCKS) ? blocks : chunks * TSDB_CHUNK_BLOCKS;
+}
+
+// -- (Re)map the file of the size given, returns 0 if ok
+static int mapFile(Tsdb* db, size_t size)
+{
+	if (db->map)
+		munmap(db->map, db->mapSize);
+
+	db->mapSize = size;
+	db->map = mmap(NULL, size, (db->writable) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, db->fd, 0);
+	if (MAP_FAILED == db->map)
+	{
+		db->map = NULL;
+		return -1;
+	}
+	db->header = (TsdbHeader*)db->map;
+	return 0;
+}
+
+// -- Start the open block
+static void resetBlock(Tsdb* db)
+{
+	db->count = 0;
+	db->prevDelta = 0;
+	bzero(db->col, sizeof(db->col));
+	for (int i = 0; i < TSDB_COLUMNS; i++)
+		db->col[i].leading = -1;
+}
+
+/*
+ * Open the store, the writer creates the file if there is none.
+ *
+ * Returns:
+ *	store handle or NULL if the file is not available or not a store.
+ */
+Tsdb* tsdbOpen(const char* path, int writable)
+{
+	Tsdb* db = calloc(1, sizeof(Tsdb));
+	if (!db)
+		return NULL;
+
+	db->writable = writable;
+	db->fd = open(path, (writable) ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+	struct stat st;
+	if (db->fd < 0 || fstat(db->fd, &st))
+	{
+		tsdbClose(db);
+		return NULL;
+	}
+
+	if (0 == st.st_size && writable)
+	{
+		// new store with the first chunk
+		st.st_size = TSDB_BLOCK + CHUNK_SIZE;
+		if (ftruncate(db->fd, st.st_size) || mapFile(db, st.st_size))
+		{
+			tsdbClose(db);
+			return NULL;
+		}
+		memcpy(db->header->magic, TSDB_MAGIC, sizeof(db->header->magic));
+		db->header->version = TSDB_VERSION;
+		db->header->blockSize = TSDB_BLOCK;
+		db->header->columns = TSDB_COLUMNS;
+		db->header->chunks = 1;
+	}
+	else if (st.st_size < TSDB_BLOCK + CHUNK_SIZE || mapFile(db, st.st_size))
+	{
+		tsdbClose(db);
+		return NULL;
+	}
+
+	if (memcmp(db->header->magic, TSDB_MAGIC, sizeof(db->header->magic)) ||
+		TSDB_VERSION != db->header->version ||
+		TSDB_BLOCK != db->header->blockSize ||
+		TSDB_COLUMNS != db->header->columns)
+	{
+		tsdbClose(db);
+		return NULL;
+	}
+
+	if (writable)
+	{
+		for (int i = 0; i < TSDB_COLUMNS; i++)
+			if (!(db->stream[i] = malloc(PAYLOAD + 16)))	// room for the sample rolled back
+			{
+				tsdbClose(db);
+				return NULL;
+			}
+		resetBlock(db);
+
+		// appends continue after the last sample stored
+		uint32_t blocks = blocksMapped(db);
+		db->lastTs = (blocks) ? indexEntry(db, blocks - 1)->lastTs : INT64_MIN;
+	}
+	return db;
+}
+
+/*
+ * Write the open block out to the file.
+ *
+ * Returns:
+ *	0 - ok, -1 - file could not grow.
+ */
+int tsdbFlush(Tsdb* db)
+{
+	if (!db->count)
+		return 0;
+
+	uint32_t b = db->header->blocks;
+	if (b / TSDB_CHUNK_BLOCKS >= db->header->chunks)
+	{
+		size_t size = TSDB_BLOCK + (size_t)(db->header->chunks + 1) * CHUNK_SIZE;
+		if (ftruncate(db->fd, size) || mapFile(db, size))
+			return -1;
+		db->header->chunks++;
+	}
+
+	TsdbBlock* block = blockAt(db, b);
+	block->count = db->count;
+	block->columns = TSDB_COLUMNS;
+	block->firstTs = db->firstTs;
+	block->lastTs = db->lastTs;
+
+	byte* out = (byte*)block + sizeof(TsdbBlock);
+	for (int i = 0; i < TSDB_COLUMNS; i++)
+	{
+		uint32_t bytes = (db->col[i].bits + 7) / 8;
+		memcpy(out, db->stream[i], bytes);
+		out += bytes;
+		block->end[i] = out - (byte*)block;
+	}
+
+	TsdbIndexEntry* entry = indexEntry(db, b);
+	entry->firstTs = db->firstTs;
+	entry->lastTs = db->lastTs;
+
+	// readers see the block once it is complete
+	__atomic_store_n(&db->header->blocks, b + 1, __ATOMIC_RELEASE);
+
+	resetBlock(db);
+	return 0;
+}
+
+/*
+ * Append the sample, timestamps must increase.
+ *
+ * Returns:
+ *	0 - ok, -1 - out of order sample or write failure.
+ */
+int tsdbAppend(Tsdb* db, int64_t timestamp, const OutputBlock* o)
+{
+	if (!db->writable || timestamp <= db->lastTs)
+		return -1;
+
+	uint32_t words[TSDB_WORDS];
+	memcpy(words, o, sizeof(words));
+
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (!db->count)
+		{
+			// the first sample of the block goes raw
+			db->firstTs = db->lastTs = timestamp;
+			for (int i = 1; i < TSDB_COLUMNS; i++)
+			{
+				putBits(db->stream[i], &db->col[i].bits, words[i - 1], 32);
+				db->col[i].prev = words[i - 1];
+			}
+			db->count = 1;
+			return 0;
+		}
+
+		TsdbColumn saved[TSDB_COLUMNS];
+		memcpy(saved, db->col, sizeof(saved));
+
+		int64_t delta = timestamp - db->lastTs;
+		putTimestamp(db->stream[0], &db->col[0].bits, delta - db->prevDelta);
+		for (int i = 1; i < TSDB_COLUMNS; i++)
+			putValue(db->stream[i], &db->col[i], words[i - 1]);
+
+		if (blockBytes(db) <= PAYLOAD && db->count < MAX_SAMPLES)
+		{
+			db->prevDelta = delta;
+			db->lastTs = timestamp;
+			db->count++;
+			return 0;
+		}
+
+		// block is full: roll the sample back, write the block and start a new one
+		memcpy(db->col, saved, sizeof(saved));
+		if (tsdbFlush(db))
+			return -1;
+	}
+	return -1;
+}
+
+// -- Close the store, the open block is written out
+void tsdbClose(Tsdb* db)
+{
+	if (!db)
+		return;
+
+	if (db->writable && db->map)
+	{
+		tsdbFlush(db);
+		msync(db->map, db->mapSize, MS_SYNC);
+	}
+	if (db->map)
+		munmap(db->map, db->mapSize);
+	if (db->fd >= 0)
+		close(db->fd);
+	for (int i = 0; i < TSDB_COLUMNS; i++)
+		free(db->stream[i]);
+	free(db);
+}
+
+// -- Columns (words of OutputBlock) of the fields
+static void fieldColumns(int fields, int* wanted)
+{
+	bzero(wanted, TSDB_COLUMNS * sizeof(int));
+	wanted[0] = 1;
+
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (fields & paramTable[p].field)
+			for (int i = 0; i < paramTable[p].count; i++)
+				wanted[1 + paramTable[p].target / sizeof(uint32_t) + i] = 1;
+
+	if (fields & OB_MS)
+		wanted[1 + offsetof(OutputBlock, ms) / sizeof(uint32_t)] = 1;
+}
+
+/*
+ * Visit samples of the time range [from, to] (ms since epoch), only the
+ * columns of the fields given are decoded, the rest is zero.
+ *
+ * Returns:
+ *	number of samples visited.
+ */
+int tsdbQuery(Tsdb* db, int64_t from, int64_t to, int fields, TsdbVisitor visit, void* arg)
+{
+	int wanted[TSDB_COLUMNS];
+	fieldColumns(fields, wanted);
+
+	// the first block that ends within the range
+	uint32_t lo = 0, hi = blocksMapped(db);
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (indexEntry(db, mid)->lastTs < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	int64_t* ts = malloc(MAX_SAMPLES * sizeof(int64_t));
+	uint32_t (*words)[TSDB_WORDS] = calloc(MAX_SAMPLES, sizeof(*words));
+	int visited = 0, stop = 0;
+
+	for (uint32_t b = lo; ts && words && !stop && b < blocksMapped(db) && indexEntry(db, b)->firstTs <= to; b++)
+	{
+		const TsdbBlock* block = blockAt(db, b);
+		const byte* base = (const byte*)block;
+
+		for (int c = 0; c < TSDB_COLUMNS; c++)
+		{
+			if (!wanted[c])
+				continue;
+
+			const byte* stream = base + ((c) ? block->end[c - 1] : sizeof(TsdbBlock));
+			TsdbColumn col = { .bits = 0, .leading = -1 };
+
+			if (0 == c)
+			{
+				int64_t delta = 0;
+				ts[0] = block->firstTs;
+				for (int i = 1; i < block->count; i++)
+				{
+					delta += getTimestamp(stream, &col.bits);
+					ts[i] = ts[i - 1] + delta;
+				}
+			}
+			else
+			{
+				col.prev = words[0][c - 1] = getBits(stream, &col.bits, 32);
+				for (int i = 1; i < block->count; i++)
+					words[i][c - 1] = getValue(stream, &col);
+			}
+		}
+
+		for (int i = 0; i < block->count && !stop; i++)
+			if (ts[i] >= from && ts[i] <= to)
+			{
+				OutputBlock o;
+				memcpy(&o, words[i], sizeof(o));
+				stop = visit(arg, ts[i], &o);
+				visited++;
+			}
+	}
+
+	free(ts);
+	free(words);
+	return visited;
+}
@@ -0,0 +1,101 @@
+/*
+ *	Mercury 236 time-series store: append-only, memory-mapped file of
+ *	OutputBlock samples.
+ *
+ *	Every 32-bit word of OutputBlock is a column. Samples are packed into
+ *	fixed size blocks; within a block each column is a separate bit stream,
+ *	timestamps are delta-of-delta encoded, values are XOR encoded against
+ *	the previous value of the column (Gorilla style), so unchanged values
+ *	cost a bit and a query decodes only the columns it needs.
+ *
+ *	File layout:
+ *
+ *	[header][index|blocks x TSDB_CHUNK_BLOCKS][index|blocks ...] ...
+ *
+ *	The file grows by chunks. The index page in front of each chunk holds
+ *	the first and last timestamp of its blocks, so range reads binary
+ *	search the small index pages and seek straight to the blocks.
+ *
+ *	The writer keeps the open block in memory and writes it out once full
+ *	(or on flush), so the storage sees one block write per few minutes at
+ *	1 second poll.
+ */
+#ifndef MERCURY_TSDB_H
+#define MERCURY_TSDB_H
+
+#include <stdint.h>
+#include "mercury236.h"
+
+#define TSDB_MAGIC		"MERCTSDB"
+#define TSDB_VERSION		1
+#define TSDB_BLOCK		4096				// block (and page) size
+#define TSDB_CHUNK_BLOCKS	255				// data blocks per chunk
+#define TSDB_WORDS		(sizeof(OutputBlock) / sizeof(uint32_t))
+#define TSDB_COLUMNS		(TSDB_WORDS + 1)		// timestamp first
+
+// File header, first page of the file
+typedef struct
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	blockSize;
+	uint32_t	columns;
+	uint32_t	chunks;			// chunks allocated
+	uint32_t	blocks;			// blocks written
+} TsdbHeader;
+
+// Index entry of a block
+typedef struct
+{
+	int64_t		firstTs;
+	int64_t		lastTs;
+} TsdbIndexEntry;
+
+// Block header, column streams follow
+typedef struct
+{
+	uint16_t	count;			// samples in the block
+	uint16_t	columns;
+	uint32_t	reserved;
+	int64_t		firstTs;		// ms since epoch
+	int64_t		lastTs;
+	uint16_t	end[TSDB_COLUMNS];	// column stream ends (bytes from the block start)
+} TsdbBlock;
+
+// Column encoder / decoder state
+typedef struct
+{
+	uint32_t	bits;			// stream length
+	uint32_t	prev;			// previous value
+	int		leading;		// XOR window of the previous value, -1 if none
+	int		trailing;
+} TsdbColumn;
+
+typedef struct
+{
+	int		fd;
+	int		writable;
+	byte*		map;
+	size_t		mapSize;
+	TsdbHeader*	header;
+
+	// open block (writer only)
+	int		count;
+	int64_t		firstTs;
+	int64_t		lastTs;
+	int64_t		prevDelta;
+	TsdbColumn	col[TSDB_COLUMNS];
+	byte*		stream[TSDB_COLUMNS];
+} Tsdb;
+
+// Query callback, return non zero to stop
+typedef int (*TsdbVisitor)(void* arg, int64_t timestamp, const OutputBlock*);
+
+// Function prototypes:
+Tsdb* tsdbOpen(const char* path, int writable);
+int tsdbAppend(Tsdb*, int64_t timestamp, const OutputBlock*);
+int tsdbFlush(Tsdb*);
+void tsdbClose(Tsdb*);
+int tsdbQuery(Tsdb*, int64_t from, int64_t to, int fields, TsdbVisitor, void* arg);
+
+#endif
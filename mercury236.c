@@ -13,15 +13,20 @@
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include "mercury236.h"
+#include "mercury-crc.h"
 
 #define BSZ			255
 
-// **** Debug output globals
-int debugPrint;
-
 // **** Enums
 typedef enum
 {
@@ -29,55 +34,170 @@ typedef enum
 	IN = 1
 } Direction;
 
-// Compute the MODBUS RTU CRC
-// Source: http://www.ccontrolsys.com/w/How_to_Compute_the_Modbus_RTU_Message_CRC
-UInt16 ModRTU_CRC(byte* buf, int len)
+// **** Parameters registry: request, responce layout and scale, in polling order
+#define P3_OFFSETS		{ 1, 4, 7 }		// 3 bytes x 3 phases
+#define P4_OFFSETS		{ 1, 4, 7, 10 }		// sum + 3 bytes x 3 phases
+#define W_OFFSETS		{ 1, 5, 9, 13 }		// 4 bytes x active/reactive +/-
+
+const ParamDesc paramTable[PARAM_COUNT] =
+{
+	[PARAM_U] = { "U", 0x08, 0x16, 0x11, sizeof(Result_3x3b), 3, 3, P3_OFFSETS, 100.0, OB_U, offsetof(OutputBlock, U) },
+	[PARAM_I] = { "I", 0x08, 0x16, 0x21, sizeof(Result_3x3b), 3, 3, P3_OFFSETS, 1000.0, OB_I, offsetof(OutputBlock, I) },
+	[PARAM_C] = { "CosF", 0x08, 0x16, 0x30, sizeof(Result_4x3b), 3, 4, P4_OFFSETS, 1000.0, OB_C, offsetof(OutputBlock, C) },
+	[PARAM_F] = { "F", 0x08, 0x16, 0x40, sizeof(Result_3b), 3, 1, { 1 }, 100.0, OB_F, offsetof(OutputBlock, f) },
+	[PARAM_A] = { "A", 0x08, 0x16, 0x51, sizeof(Result_3x3b), 3, 3, P3_OFFSETS, 100.0, OB_A, offsetof(OutputBlock, A) },
+	[PARAM_P] = { "P", 0x08, 0x16, 0x00, sizeof(Result_4x3b), 3, 4, P4_OFFSETS, 100.0, OB_P, offsetof(OutputBlock, P) },
+	[PARAM_S] = { "S", 0x08, 0x16, 0x08, sizeof(Result_4x3b), 3, 4, P4_OFFSETS, 100.0, OB_S, offsetof(OutputBlock, S) },
+	[PARAM_PR] = { "PR", 0x05, PP_RESET << 4, 0, sizeof(Result_4x4b), 4, 4, W_OFFSETS, 1000.0, OB_PR, offsetof(OutputBlock, PR) },
+	[PARAM_PRT0] = { "PR-day", 0x05, PP_RESET << 4, 1, sizeof(Result_4x4b), 4, 4, W_OFFSETS, 1000.0, OB_PRT0, offsetof(OutputBlock, PRT[0]) },
+	[PARAM_PRT1] = { "PR-night", 0x05, PP_RESET << 4, 2, sizeof(Result_4x4b), 4, 4, W_OFFSETS, 1000.0, OB_PRT1, offsetof(OutputBlock, PRT[1]) },
+	[PARAM_PY] = { "PY", 0x05, PP_YESTERDAY << 4, 0, sizeof(Result_4x4b), 4, 4, W_OFFSETS, 1000.0, OB_PY, offsetof(OutputBlock, PY) },
+	[PARAM_PT] = { "PT", 0x05, PP_TODAY << 4, 0, sizeof(Result_4x4b), 4, 4, W_OFFSETS, 1000.0, OB_PT, offsetof(OutputBlock, PT) }
+};
+
+/*
+ * Parse comma separated list of parameter names (e.g. P,S,PT).
+ *
+ * Returns:
+ *	OutputField mask (OB_MS always included) or 0 if the list contains
+ *	unknown name.
+ */
+int parseFields(const char* list)
+{
+	int fields = OB_MS;	// mains status is always there
+	char names[BSZ], *save;
+	strncpy(names, list, BSZ - 1);
+	names[BSZ - 1] = 0;
+
+	for (char* name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save))
+	{
+		int found = 0;
+		for (int i = 0; i < PARAM_COUNT; i++)
+			if (!strcmp(paramTable[i].name, name))
+			{
+				fields |= paramTable[i].field;
+				found = 1;
+			}
+		if (!found)
+			return 0;
+	}
+	return fields;
+}
+
+// **** Batched reads: the instantaneous values in one array read (08h 14h), mercury-sim layout
+#define BATCH_INSTANT		(1 << PARAM_U | 1 << PARAM_I | 1 << PARAM_C | 1 << PARAM_F | 1 << PARAM_P | 1 << PARAM_S)
+
+const BatchDesc batchTable[BATCH_COUNT] =
+{
+	{ 0x08, 0x14, 0x00, 3 + 9 + 9 + 12 + 3 + 12 + 12, BATCH_INSTANT }
+};
+
+// -- Context of the channel opened: the only meter on the line, default timeouts, no trace
+void initCtx(MercuryCtx* ctx, int fd)
 {
-  UInt16 crc = 0xFFFF;
+	MeterConfig def = METER_DEFAULT;
+
+	bzero(ctx, sizeof(MercuryCtx));
+	ctx->fd = fd;
+	ctx->meter = def;
+	ctx->timeoutUs = CH_TIME_OUT * 1000000L;
+	ctx->frameGapUs = FRAME_TIME_OUT * 1000L;
+	ctx->retries = RETRIES;
+}
 
-  for (int pos = 0; pos < len; pos++) {
-    crc ^= (UInt16)buf[pos];          // XOR byte into least sig. byte of crc
+/*
+ * Parse meter specification ADDR[:PASSWORD[:LEVEL]], e.g. 17:222222:2,
+ * the password and access level default to 111111 and 1 (user).
+ *
+ * Returns:
+ *	0 - ok, -1 - not recognised.
+ */
+int parseMeter(const char* spec, MeterConfig* m)
+{
+	MeterConfig def = METER_DEFAULT;
+	*m = def;
+
+	char* end;
+	long address = strtol(spec, &end, 0);
+	if (end == spec || address < 0 || address > 253)
+		return -1;
+	m->address = address;
+
+	if (':' == *end)
+	{
+		const char* password = end + 1;
+		for (int d = 0; d < sizeof(m->password); d++)
+		{
+			if (password[d] < '0' || password[d] > '9')
+				return -1;
+			m->password[d] = password[d] - '0';
+		}
+		end = (char*)password + sizeof(m->password);
+
+		if (':' == *end)
+		{
+			long level = strtol(end + 1, &end, 10);
+			if (level < 1 || level > 2)
+				return -1;
+			m->accessLevel = level;
+		}
+	}
+	return (*end) ? -1 : 0;
+}
+
+/*
+ * Port name of the device for the names of the per port objects
+ * (semaphore, shared memory): the real path without /dev/, slashes
+ * replaced, e.g. ttyUSB0 or pts_3.
+ */
+void portName(const char* dev, char* name, int size)
+{
+	char path[PATH_MAX];
+	const char* port = (realpath(dev, path)) ? path : dev;
+	if (!strncmp(port, "/dev/", 5))
+		port += 5;
+
+	snprintf(name, size, "%s", port);
+	for (char* c = name; *c; c++)
+		if ('/' == *c)
+			*c = '_';
+}
 
-    for (int i = 8; i != 0; i--) {    // Loop over each bit
-      if ((crc & 0x0001) != 0) {      // If the LSB is set
-        crc >>= 1;                    // Shift right and XOR 0xA001
-        crc ^= 0xA001;
-      }
-      else                            // Else LSB is not set
-        crc >>= 1;                    // Just shift right
-    }
-  }
-  // Note, this number has low and high bytes swapped, so use it accordingly (or swap bytes)
-  return crc;
+// -- Name of the semaphore serialising access to the port
+void semaphoreName(const char* dev, char* name, int size)
+{
+	char port[NAME_MAX];
+	portName(dev, port, sizeof(port));
+	snprintf(name, size, "%s.%s", MERCURY_SEMAPHORE, port);
 }
 
 // -- Print out data buffer in hex
-void printPackage(byte *data, int size, int isin)
+void printPackage(MercuryCtx* ctx, byte *data, int size, int isin)
 {
-	if (debugPrint)
+	if (ctx->debug)
 	{
-		printf("%s bytes: %d\n\r\t", (isin) ? "Received" : "Sent", size);
+		fprintf(ctx->debug, "%s bytes: %d\n\r\t", (isin) ? "Received" : "Sent", size);
 		for (int i=0; i<size; i++)
-			printf("%02X ", (byte)data[i]);
-		printf("\n\r");
+			fprintf(ctx->debug, "%02X ", (byte)data[i]);
+		fprintf(ctx->debug, "\n\r");
 	}
 }
 
 // -- Print out error code
-void printError(int code)
+void printError(MercuryCtx* ctx, int code)
 {
-	if (debugPrint)
-		printf("Error received: %d\n\r", code);
+	if (ctx->debug)
+		fprintf(ctx->debug, "Error received: %d\n\r", code);
 }
 
-/* -- Non-blocking file read with timeout
+/* -- Wait until the descriptor becomes readable
  *
- *    Returns: 
+ *    Returns:
  *	0 if timed out.
  *	< 0 if select error
- *	number of bytes read if success
+ *	> 0 if data available
  */
-int nb_read(int fd, byte* buf, int sz)
+int nb_wait(int fd, long timeoutUs)
 {
 	fd_set set;
 	struct timeval timeout;
@@ -87,473 +207,553 @@ int nb_read(int fd, byte* buf, int sz)
 	FD_SET(fd, &set);
 
 	// Set timeout
-	timeout.tv_sec = CH_TIME_OUT;
-	timeout.tv_usec = 0;
+	timeout.tv_sec = timeoutUs / 1000000;
+	timeout.tv_usec = timeoutUs % 1000000;
 
-	int r = select(fd + 1, &set, NULL, NULL, &timeout);
-	if (r > 0)
-		return read(fd, buf, sz);
-	else 
-		return r;
+	return select(fd + 1, &set, NULL, NULL, &timeout);
 }
 
-// -- Check 1 byte responce
-int checkResult_1b(byte* buf, int len)
+// -- The bytes are a complete status frame (4 bytes, CRC matches), e.g. an error instead of data
+int isStatusFrame(const byte* buf, int len)
 {
-	if (len != sizeof(Result_1b))
-		return WRONG_RESULT_SIZE;
-
-	Result_1b *res = (Result_1b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
-
-	return OK; // res->result & 0x0F;
+	return sizeof(Result_1b) == len && ModRTU_CRC((byte*)buf, len - sizeof(UInt16)) == ((Result_1b*)buf)->CRC;
 }
 
-// -- Check 3 byte responce
-int checkResult_3b(byte* buf, int len)
+/* -- Non-blocking frame read with timeout
+ *
+ *    Waits up to timeoutUs for the first byte, then keeps collecting
+ *    until the expected frame size is received. USB dongles deliver a
+ *    long frame in bursts (the FTDI latency timer is 16 ms), so a pause
+ *    ends the frame early only after a status frame (short error frames
+ *    end this way, after gapUs), the rest is waited for up to timeoutUs.
+ *    Arrival of the first and the last byte is stored in timing (if not
+ *    NULL).
+ *
+ *    Returns: 
+ *	0 if timed out.
+ *	< 0 if select error
+ *	number of bytes read if success
+ */
+int nb_read(int fd, byte* buf, int expected, int sz, long timeoutUs, long gapUs, TxTiming* timing)
 {
-	if (len != sizeof(Result_3b))
-		return WRONG_RESULT_SIZE;
+	int len = 0;
 
-	Result_3b *res = (Result_3b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
+	if (expected > sz)
+		expected = sz;
 
-	return OK;
-}
-
-// -- Check 3 bytes x 3 phase responce
-int checkResult_3x3b(byte* buf, int len)
-{
-	if (len != sizeof(Result_3x3b))
-		return WRONG_RESULT_SIZE;
+	while (len < expected)
+	{
+		int r = nb_wait(fd, (isStatusFrame(buf, len)) ? gapUs : timeoutUs);
+		if (r <= 0)
+			return (len) ? len : r;
 
-	Result_3x3b *res = (Result_3x3b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
+		r = read(fd, buf + len, sz - len);
+		if (r <= 0)
+			return (len) ? len : r;
 
-	return OK;
+		if (timing)
+		{
+			timing->lastByte = txClock();
+			if (!len)
+				timing->firstByte = timing->lastByte;
+		}
+		len += r;
+	}
+	return len;
 }
 
-// -- Check 3 bytes x 3 phase and sum responce
-int checkResult_4x3b(byte* buf, int len)
+/*
+ * Short (status) frame received instead of the data expected,
+ * e.g. when the channel is not open.
+ *
+ * Returns status code reported by the meter or WRONG_RESULT_SIZE.
+ */
+int checkStatusFrame(byte* buf, int len)
 {
-	if (len != sizeof(Result_4x3b))
+	if (len != sizeof(Result_1b))
 		return WRONG_RESULT_SIZE;
 
-	Result_4x3b *res = (Result_4x3b*)buf;
+	Result_1b *res = (Result_1b*)buf;
 	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
 	if (crc != res->CRC)
 		return WRONG_CRC;
 
-	return OK;
+	int status = res->result & 0x0F;
+	return (OK != status) ? status : WRONG_RESULT_SIZE;
 }
 
-// -- Check 4 bytes x 3 phase and sum responce
-int checkResult_4x4b(byte* buf, int len)
+// -- Check responce of the expected size (the CRC is the last 2 bytes)
+int checkResponce(byte* buf, int len, int size)
 {
-	if (len != sizeof(Result_4x4b))
-		return WRONG_RESULT_SIZE;
+	if (len != size)
+		return checkStatusFrame(buf, len);
 
-	Result_4x4b *res = (Result_4x4b*)buf;
 	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
+	if (crc != *(UInt16*)(buf + len - sizeof(UInt16)))
 		return WRONG_CRC;
 
-	return OK;
+	return OK; // 1 byte responce: res->result & 0x0F;
 }
 
 /* 
- * Sends command and receives responce, one attempt.
+ * Sends command and receives responce of the expected size, one attempt,
+ * waiting up to timeoutUs for the first byte. Transaction timestamps are
+ * stored in timing (if not NULL).
  *
  * Returns:
  * 	> 0 - nuber of bytes received
  * 	<= 0 - error occured
  */
-int sendReceive(int ttyd, byte* commandBuff, int commandLen,
-	byte* responceBuff, int responceBuffSize)
+int sendReceive(MercuryCtx* ctx, byte* commandBuff, int commandLen,
+	byte* responceBuff, int responceLen, int responceBuffSize, long timeoutUs, TxTiming* timing)
 {
-	printPackage(commandBuff, commandLen, OUT);
+	int ttyd = ctx->fd;
+	printPackage(ctx, commandBuff, commandLen, OUT);
+
+	// Drop leftovers of earlier (late or broken) responces
+	byte junk[BSZ];
+	while (nb_wait(ttyd, 0) > 0 && read(ttyd, junk, BSZ) > 0);
 
 	// Send command
+	if (timing)
+	{
+		bzero(timing, sizeof(TxTiming));
+		timing->start = txClock();
+	}
 	write(ttyd, commandBuff, commandLen);
-	usleep(TIME_OUT);
+	if (timing)
+		timing->written = txClock();
 
 	// Get responce
-	int len = nb_read(ttyd, responceBuff, responceBuffSize);
-	if (len)
-		printPackage(responceBuff, len, IN);
+	int len = nb_read(ttyd, responceBuff, responceLen, responceBuffSize, timeoutUs, ctx->frameGapUs, timing);
+	if (len > 0)
+		printPackage(ctx, responceBuff, len, IN);
 	else
-		printError(len);
+		printError(ctx, len);
 	return len;
 }
 
 /*
- * Check the communication channel.
- * 
+ * Sends command, receives and checks responce of the expected size.
+ * Broken responces are retried up to ctx->retries times, the transaction
+ * is accounted in the statistics of the context.
+ *
  * Returns:
- * 	CHECK_CHANNEL_FAILURE - channel doesnt respond as expected.
+ *	COMMUNICATION_ERROR - unable to get responce from tty.
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int checkChannel(int ttyd)
+int exchange(MercuryCtx* ctx, byte* commandBuff, int commandLen, byte* responceBuff, int responceLen)
 {
-	// Command initialisation
-	TestCmd testCmd = { .address = PM_ADDRESS, .command = 0x00 };
-	testCmd.CRC = ModRTU_CRC((byte*)&testCmd, sizeof(testCmd) - sizeof(UInt16));
+	int result;
+	TxTiming timing;
 
-	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&testCmd, sizeof(testCmd), buf, BSZ);
-	if (len)
-		return checkResult_1b(buf, len);
+	for (int retries = 0; ; retries++)
+	{
+		int len = sendReceive(ctx, commandBuff, commandLen, responceBuff, responceLen, BSZ,
+			ctx->timeoutUs, &timing);
+		result = (len > 0) ? checkResponce(responceBuff, len, responceLen) : COMMUNICATION_ERROR;
 
-	return CHECK_CHANNEL_FAILURE;
+		if ((WRONG_CRC != result && WRONG_RESULT_SIZE != result) || retries >= ctx->retries)
+		{
+			recordTx(&ctx->stats, commandBuff, commandLen, &timing, result, retries);
+			return result;
+		}
+
+		// the rest of a long frame cut by a gap is still coming, let the line go quiet
+		byte junk[BSZ];
+		while (nb_wait(ctx->fd, ctx->frameGapUs) > 0 && read(ctx->fd, junk, BSZ) > 0);
+	}
 }
 
 /*
- * Initialise connection with power meter.
- * 
+ * Open communication channel to the power meter: either RS485 dongle
+ * (e.g. /dev/ttyUSB0) or Unix socket of mercury-broker.
+ *
  * Returns:
- *	COMMUNICATION_ERROR - unable to get responce from tty.
- * 	WRONG_CRC - data recieved but CRC check failed.
- * 	OK - means ok.
+ *	descriptor or < 0 if the channel cannot be opened.
  */
-int initConnection(int ttyd)
+int openChannel(const char* dev)
 {
-	InitCmd initCmd = {
-		.address = PM_ADDRESS,
-		.command = 0x01,
-		.accessLevel = 0x01,
-		.password = { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 },
-	};
-	initCmd.CRC = ModRTU_CRC((byte*)&initCmd, sizeof(initCmd) - sizeof(UInt16));
+	struct stat st;
+	if (!stat(dev, &st) && S_ISSOCK(st.st_mode))
+	{
+		struct sockaddr_un addr;
+		bzero(&addr, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, dev, sizeof(addr.sun_path) - 1);
 
-	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&initCmd, sizeof(initCmd), buf, BSZ);
-	if (len)
-		return checkResult_1b(buf, len);
-	
-	return COMMUNICATION_ERROR;
+		int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sd >= 0 && connect(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		{
+			close(sd);
+			sd = -1;
+		}
+		return sd;
+	}
+
+	// O_RDWR Read/Write access to serial port
+	// O_NOCTTY - No terminal will control the process  
+	// O_NDELAY - Non blocking open
+	int fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
+	if (fd < 0)
+		return fd;
+
+	fcntl(fd, F_SETFL, 0);
+
+	struct termios serialPortSettings;
+	bzero(&serialPortSettings, sizeof(serialPortSettings));
+
+	cfsetispeed(&serialPortSettings, BAUDRATE);
+	cfsetospeed(&serialPortSettings, BAUDRATE);
+
+	serialPortSettings.c_cflag &= PARENB;				/* Disables the Parity Enable bit(PARENB),So No Parity   */
+	serialPortSettings.c_cflag &= ~CSTOPB;				/* CSTOPB = 2 Stop bits,here it is cleared so 1 Stop bit */
+	serialPortSettings.c_cflag &= ~CSIZE;				/* Clears the mask for setting the data size             */
+	serialPortSettings.c_cflag |=  CS8;				/* Set the data bits = 8                                 */
+
+	serialPortSettings.c_cflag |= CREAD | CLOCAL;			/* Enable receiver,Ignore Modem Control lines       */ 
+
+	serialPortSettings.c_iflag &= ~(IXON | IXOFF | IXANY);		/* Disable XON/XOFF flow control both i/p and o/p */
+	serialPortSettings.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);	/* Non Cannonical mode                            */
+
+	serialPortSettings.c_oflag &= ~OPOST;				/* No Output Processing */
+
+	tcflush(fd, TCIOFLUSH);
+	tcsetattr(fd, TCSANOW, &serialPortSettings);
+
+	return fd;
+}
+
+// -- Channel is connected to mercury-broker (which serialises bus access itself)
+int isBrokerChannel(int fd)
+{
+	struct stat st;
+	return !fstat(fd, &st) && S_ISSOCK(st.st_mode);
 }
 
 /*
- * Finalise connection to power meter.
- * 
+ * Size of the command frame at the start of the buffer.
+ *
  * Returns:
- *	COMMUNICATION_ERROR - unable to get responce from tty.
- * 	WRONG_CRC - data recieved but CRC check failed.
- * 	OK - means ok.
+ *	frame size, 0 if more bytes needed to tell, < 0 if command unknown.
  */
-int closeConnection(int ttyd)
+int commandSize(byte* buf, int len)
 {
-	ByeCmd byeCmd = { .address = PM_ADDRESS, .command = 0x02 };
-	byeCmd.CRC = ModRTU_CRC((byte*)&byeCmd, sizeof(byeCmd) - sizeof(UInt16));
-
-	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&byeCmd, sizeof(byeCmd), buf, BSZ);
-	if (len)
-		return checkResult_1b(buf, len);
+	if (len < 2)
+		return 0;
 
-	return COMMUNICATION_ERROR;
+	switch (buf[1])
+	{
+		case 0x00: return sizeof(TestCmd);
+		case 0x01: return sizeof(InitCmd);
+		case 0x02: return sizeof(ByeCmd);
+		case 0x05:
+		case 0x08: return sizeof(ReadParamCmd);
+		case 0x06: return sizeof(ReadMemCmd);
+		default: return -1;
+	}
 }
 
-// Decode float from 3 bytes
-float B3F(byte b[3], float factor)
+// -- Size of the responce expected for the command frame
+int replySize(byte* cmd)
 {
-	int val = ((b[0] & 0x3F) << 16) | (b[2] << 8) | b[1];
-	return val/factor;
-}
+	if (0x06 == cmd[1])
+		return 1 + ((ReadMemCmd*)cmd)->length + sizeof(UInt16);
+	if (0x08 == cmd[1] && 0x13 == cmd[2])
+		return sizeof(Result_ProfileHead);
+	for (int i = 0; i < BATCH_COUNT; i++)
+		if (batchTable[i].command == cmd[1] && batchTable[i].paramId == cmd[2] && batchTable[i].BWRI == cmd[3])
+			return batchTable[i].replySize;
+
+	for (int i = 0; i < PARAM_COUNT; i++)
+	{
+		const ParamDesc* desc = &paramTable[i];
+		if (desc->command == cmd[1] &&
+			(0x05 == cmd[1] ||	// energy counters, any period and tariff
+			// parameters, phase number in the 2 low BWRI bits
+			(desc->paramId == cmd[2] && (desc->BWRI & 0xFC) == (cmd[3] & 0xFC))))
+			return desc->replySize;
+	}
 
-// Decode float from 4 bytes
-float B4F(byte b[4], float factor)
-{
-	int val = ((b[1] & 0x3F) << 24) | (b[0] << 16) | (b[3] << 8) | b[2];
-	return val/factor;
+	return sizeof(Result_1b);
 }
 
-/* 
- * Get voltage (U) by phases.
- *
+/*
+ * Check the communication channel.
+ * 
  * Returns:
- *	COMMUNICATION_ERROR - unable to get responce from tty.
+ * 	CHECK_CHANNEL_FAILURE - channel doesnt respond as expected.
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int getU(int ttyd, P3V* U)
+int checkChannel(MercuryCtx* ctx)
 {
-	ReadParamCmd getUCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x11
-	};
-	getUCmd.CRC = ModRTU_CRC((byte*)&getUCmd, sizeof(getUCmd) - sizeof(UInt16));
+	// Command initialisation
+	TestCmd testCmd = { .address = ctx->meter.address, .command = 0x00 };
+	testCmd.CRC = ModRTU_CRC((byte*)&testCmd, sizeof(testCmd) - sizeof(UInt16));
 
 	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getUCmd, sizeof(getUCmd), buf, BSZ);
-
-	if (len)
-	{
-		// Check and decode result
-		int checkResult = checkResult_3x3b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_3x3b* res = (Result_3x3b*)buf;
-			U->p1 = B3F(res->p1, 100.0);
-			U->p2 = B3F(res->p2, 100.0);
-			U->p3 = B3F(res->p3, 100.0);
-		}
-
-		return checkResult;
-	}
-
-	return COMMUNICATION_ERROR;
+	int result = exchange(ctx, (byte*)&testCmd, sizeof(testCmd), buf, sizeof(Result_1b));
+	return (COMMUNICATION_ERROR == result) ? CHECK_CHANNEL_FAILURE : result;
 }
 
 /*
- * Get current (I) by phases.
+ * Check the communication channel waiting up to timeoutUs for the responce,
+ * one attempt (no retries). Transaction timestamps are stored in timing.
  *
  * Returns:
- *	COMMUNICATION_ERROR - unable to get responce from tty.
+ * 	CHECK_CHANNEL_FAILURE - channel doesnt respond in time.
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int getI(int ttyd, P3V* I)
+int probeChannel(MercuryCtx* ctx, long timeoutUs, TxTiming* timing)
 {
-	ReadParamCmd getICmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x21
-	};
-	getICmd.CRC = ModRTU_CRC((byte*)&getICmd, sizeof(getICmd) - sizeof(UInt16));
+	TestCmd testCmd = { .address = ctx->meter.address, .command = 0x00 };
+	testCmd.CRC = ModRTU_CRC((byte*)&testCmd, sizeof(testCmd) - sizeof(UInt16));
 
 	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getICmd, sizeof(getICmd), buf, BSZ);
-
-	if (len)
-	{	
-		// Check and decode result
-		int checkResult = checkResult_3x3b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_3x3b* res = (Result_3x3b*)buf;
-			I->p1 = B3F(res->p1, 1000.0);
-			I->p2 = B3F(res->p2, 1000.0);
-			I->p3 = B3F(res->p3, 1000.0);
-		}
-
-		return checkResult;
-	}
+	int len = sendReceive(ctx, (byte*)&testCmd, sizeof(testCmd), buf, sizeof(Result_1b), BSZ, timeoutUs, timing);
+	int result = (len > 0) ? checkResponce(buf, len, sizeof(Result_1b)) : COMMUNICATION_ERROR;
 
-	return COMMUNICATION_ERROR;
+	recordTx(&ctx->stats, (byte*)&testCmd, sizeof(testCmd), timing, result, 0);
+	return (COMMUNICATION_ERROR == result) ? CHECK_CHANNEL_FAILURE : result;
 }
 
 /*
- * Get power consumption factor cos(f) by phases.
+ * Initialise connection with power meter.
  * 
  * Returns:
  *	COMMUNICATION_ERROR - unable to get responce from tty.
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int getCosF(int ttyd, P3VS* C)
+int initConnection(MercuryCtx* ctx)
 {
-	ReadParamCmd getCosCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x30
+	InitCmd initCmd = {
+		.address = ctx->meter.address,
+		.command = 0x01,
+		.accessLevel = ctx->meter.accessLevel,
 	};
-	getCosCmd.CRC = ModRTU_CRC((byte*)&getCosCmd, sizeof(getCosCmd) - sizeof(UInt16));
+	memcpy(initCmd.password, ctx->meter.password, sizeof(initCmd.password));
+	initCmd.CRC = ModRTU_CRC((byte*)&initCmd, sizeof(initCmd) - sizeof(UInt16));
 
 	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getCosCmd, sizeof(getCosCmd), buf, BSZ);
-
-	if (len)
-	{
-		// Check and decode result
-		int checkResult = checkResult_4x3b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_4x3b* res = (Result_4x3b*)buf;
-			C->p1 = B3F(res->p1, 1000.0);
-			C->p2 = B3F(res->p2, 1000.0);
-			C->p3 = B3F(res->p3, 1000.0);
-			C->sum = B3F(res->sum, 1000.0);
-		}
-
-		return checkResult;
-	}
-
-	return COMMUNICATION_ERROR;
+	return exchange(ctx, (byte*)&initCmd, sizeof(initCmd), buf, sizeof(Result_1b));
 }
 
 /*
- * Get grid frequency (Hz).
+ * Finalise connection to power meter.
  * 
  * Returns:
  *	COMMUNICATION_ERROR - unable to get responce from tty.
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int getF(int ttyd, float *f)
+int closeConnection(MercuryCtx* ctx)
 {
-	ReadParamCmd getFCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x40
-	};
-	getFCmd.CRC = ModRTU_CRC((byte*)&getFCmd, sizeof(getFCmd) - sizeof(UInt16));
+	ByeCmd byeCmd = { .address = ctx->meter.address, .command = 0x02 };
+	byeCmd.CRC = ModRTU_CRC((byte*)&byeCmd, sizeof(byeCmd) - sizeof(UInt16));
 
 	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getFCmd, sizeof(getFCmd), buf, BSZ);
+	return exchange(ctx, (byte*)&byeCmd, sizeof(byeCmd), buf, sizeof(Result_1b));
+}
 
-	if (len)
-	{
-		// Check and decode result
-		int checkResult = checkResult_3b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_3b* res = (Result_3b*)buf;
-			*f = B3F(res->res, 100.0);
-		}
+// Decode float from 3 bytes
+float B3F(const byte* b, float factor)
+{
+	int val = ((b[0] & 0x3F) << 16) | (b[2] << 8) | b[1];
+	return val/factor;
+}
 
-		return checkResult;
-	}
+// Decode float from 4 bytes
+float B4F(const byte* b, float factor)
+{
+	int val = ((b[1] & 0x3F) << 24) | (b[0] << 16) | (b[3] << 8) | b[2];
+	return val/factor;
+}
 
-	return COMMUNICATION_ERROR;
+// -- Decode values of the parameter responce (in the order of the P3V, P3VS, PWV fields)
+void decodeParam(const ParamDesc* desc, const byte* buf, float* values)
+{
+	for (int i = 0; i < desc->count; i++)
+		values[i] = (4 == desc->valueSize)
+			? B4F(buf + desc->offsets[i], desc->divisor)
+			: B3F(buf + desc->offsets[i], desc->divisor);
 }
 
 /*
- * Get phases angle.
- * 
+ * Request the parameter described and decode its values.
+ *
+ * Parameters:
+ *	values - receives desc->count values, in the order of the
+ *		P3V, P3VS, PWV structure fields.
+ *
  * Returns:
  *	COMMUNICATION_ERROR - unable to get responce from tty.
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int getA(int ttyd, P3V* A)
+int readParam(MercuryCtx* ctx, const ParamDesc* desc, float* values)
 {
-	ReadParamCmd getACmd =
+	ReadParamCmd cmd =
 	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x51
+		.address = ctx->meter.address,
+		.command = desc->command,
+		.paramId = desc->paramId,
+		.BWRI = desc->BWRI
 	};
-	getACmd.CRC = ModRTU_CRC((byte*)&getACmd, sizeof(getACmd) - sizeof(UInt16));
+	cmd.CRC = ModRTU_CRC((byte*)&cmd, sizeof(cmd) - sizeof(UInt16));
 
 	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getACmd, sizeof(getACmd), buf, BSZ);
+	int checkResult = exchange(ctx, (byte*)&cmd, sizeof(cmd), buf, desc->replySize);
 
-	if (len)
-	{
-		// Check and decode result
-		int checkResult = checkResult_3x3b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_3x3b* res = (Result_3x3b*)buf;
-			A->p1 = B3F(res->p1, 100.0);
-			A->p2 = B3F(res->p2, 100.0);
-			A->p3 = B3F(res->p3, 100.0);
-		}
+	if (OK == checkResult)
+		decodeParam(desc, buf, values);
 
-		return checkResult;
-	}
+	return checkResult;
+}
 
-	return COMMUNICATION_ERROR;
+// -- Read the parameter (PARAM_U, PARAM_I etc.) into its place in the output block
+int getParam(MercuryCtx* ctx, int param, OutputBlock* o)
+{
+	const ParamDesc* desc = &paramTable[param];
+	return readParam(ctx, desc, (float*)((byte*)o + desc->target));
 }
 
 /*
- * Get active power (W) consumption by phases with total.
- * 
+ * Request the batch and decode the values of all its parameters into
+ * their places in the output block.
+ *
  * Returns:
- *	COMMUNICATION_ERROR - unable to get responce from tty.
- * 	WRONG_CRC - data recieved but CRC check failed.
+ *	ILLEGAL_CMD - the meter does not support the batch.
+ *	COMMUNICATION_ERROR, WRONG_CRC etc. - as readParam.
  * 	OK - means ok.
  */
-int getP(int ttyd, P3VS* P)
+int readBatch(MercuryCtx* ctx, const BatchDesc* batch, OutputBlock* o)
 {
-	ReadParamCmd getPCmd =
+	ReadParamCmd cmd =
 	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x00
+		.address = ctx->meter.address,
+		.command = batch->command,
+		.paramId = batch->paramId,
+		.BWRI = batch->BWRI
 	};
-	getPCmd.CRC = ModRTU_CRC((byte*)&getPCmd, sizeof(getPCmd) - sizeof(UInt16));
+	cmd.CRC = ModRTU_CRC((byte*)&cmd, sizeof(cmd) - sizeof(UInt16));
 
 	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getPCmd, sizeof(getPCmd), buf, BSZ);
+	int checkResult = exchange(ctx, (byte*)&cmd, sizeof(cmd), buf, batch->replySize);
+	if (OK != checkResult)
+		return checkResult;
 
-	if (len)
-	{
-		// Check and decode result
-		int checkResult = checkResult_4x3b(buf, len);
-		if (OK == checkResult)
+	// the value offsets of the parameter count from the address byte
+	const byte* values = buf;
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if (batch->params & 1 << p)
 		{
-			Result_4x3b* res = (Result_4x3b*)buf;
-			P->p1 = B3F(res->p1, 100.0);
-			P->p2 = B3F(res->p2, 100.0);
-			P->p3 = B3F(res->p3, 100.0);
-			P->sum = B3F(res->sum, 100.0);
+			const ParamDesc* desc = &paramTable[p];
+			decodeParam(desc, values, (float*)((byte*)o + desc->target));
+			values += desc->replySize - sizeof(byte) - sizeof(UInt16);
 		}
 
-		return checkResult;
-	}
-
-	return COMMUNICATION_ERROR;
+	return OK;
 }
 
 /*
- * Get reactive power (VA) consumption by phases with total.
- * 
+ * Read the parameters of the mask (1 << PARAM_U etc.), with ctx->batch
+ * those of a batch in one request if most of them are asked for. A meter
+ * that rejects the batch is read parameter by parameter, the context
+ * remembers it.
+ *
+ * Parameters:
+ *	read - receives the mask of the parameters read, a batch may bring
+ *		more than asked for.
+ *
  * Returns:
- *	COMMUNICATION_ERROR - unable to get responce from tty.
- * 	WRONG_CRC - data recieved but CRC check failed.
- * 	OK - means ok.
+ *	OK or the first error; stops at COMMUNICATION_ERROR (meter is gone)
+ *	and CHANNEL_ISNT_OPEN (open it and read the rest), goes on with the
+ *	other parameters otherwise.
  */
-int getS(int ttyd, P3VS* S)
+int getParams(MercuryCtx* ctx, int params, OutputBlock* o, int* read)
 {
-	ReadParamCmd getSCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x08
-	};
-	getSCmd.CRC = ModRTU_CRC((byte*)&getSCmd, sizeof(getSCmd) - sizeof(UInt16));
+	uint32_t* noBatch = &ctx->noBatch[ctx->meter.address >> 5];
+	uint32_t meterBit = 1u << (ctx->meter.address & 31);
+	int result = OK;
+	*read = 0;
 
-	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getSCmd, sizeof(getSCmd), buf, BSZ);
-
-	if (len)
+	for (int b = 0; ctx->batch && b < BATCH_COUNT && !(*noBatch & meterBit); b++)
 	{
-		// Check and decode result
-		int checkResult = checkResult_4x3b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_4x3b* res = (Result_4x3b*)buf;
-			S->p1 = B3F(res->p1, 100.0);
-			S->p2 = B3F(res->p2, 100.0);
-			S->p3 = B3F(res->p3, 100.0);
-			S->sum = B3F(res->sum, 100.0);
-		}
+		// a few parameters are not worth reading all of the batch
+		int wanted = params & batchTable[b].params;
+		if (2 * __builtin_popcount(wanted) <= __builtin_popcount(batchTable[b].params))
+			continue;
+
+		int res = readBatch(ctx, &batchTable[b], o);
+		if (OK == res)
+			*read |= batchTable[b].params;
+		else if (ILLEGAL_CMD == res || WRONG_RESULT_SIZE == res)
+			*noBatch |= meterBit;
+		else if (COMMUNICATION_ERROR == res || CHANNEL_ISNT_OPEN == res)
+			return res;
+	}
 
-		return checkResult;
+	for (int p = 0; p < PARAM_COUNT; p++)
+	{
+		if (!(params & ~*read & 1 << p))
+			continue;
+
+		int res = getParam(ctx, p, o);
+		if (OK == res)
+			*read |= 1 << p;
+		else if (COMMUNICATION_ERROR == res || CHANNEL_ISNT_OPEN == res)
+			return res;
+		else if (OK == result)
+			result = res;
 	}
 
-	return COMMUNICATION_ERROR;
+	return result;
+}
+
+// -- Get voltage (U) by phases
+int getU(MercuryCtx* ctx, P3V* U)
+{
+	return readParam(ctx, &paramTable[PARAM_U], (float*)U);
+}
+
+// -- Get current (I) by phases
+int getI(MercuryCtx* ctx, P3V* I)
+{
+	return readParam(ctx, &paramTable[PARAM_I], (float*)I);
+}
+
+// -- Get power consumption factor cos(f) by phases
+int getCosF(MercuryCtx* ctx, P3VS* C)
+{
+	return readParam(ctx, &paramTable[PARAM_C], (float*)C);
+}
+
+// -- Get grid frequency (Hz)
+int getF(MercuryCtx* ctx, float *f)
+{
+	return readParam(ctx, &paramTable[PARAM_F], f);
+}
+
+// -- Get phases angle
+int getA(MercuryCtx* ctx, P3V* A)
+{
+	return readParam(ctx, &paramTable[PARAM_A], (float*)A);
+}
+
+// -- Get active power (W) consumption by phases with total
+int getP(MercuryCtx* ctx, P3VS* P)
+{
+	return readParam(ctx, &paramTable[PARAM_P], (float*)P);
+}
+
+// -- Get reactive power (VA) consumption by phases with total
+int getS(MercuryCtx* ctx, P3VS* S)
+{
+	return readParam(ctx, &paramTable[PARAM_S], (float*)S);
 }
 
 /*
@@ -569,35 +769,11 @@ int getS(int ttyd, P3VS* S)
  * 	WRONG_CRC - data recieved but CRC check failed.
  * 	OK - means ok.
  */
-int getW(int ttyd, PWV* W, int periodId, int month, int tariffNo)
+int getW(MercuryCtx* ctx, PWV* W, int periodId, int month, int tariffNo)
 {
-	ReadParamCmd getWCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x05,
-		.paramId = (periodId << 4) | (month & 0xF),
-		.BWRI = tariffNo
-	};
-	getWCmd.CRC = ModRTU_CRC((byte*)&getWCmd, sizeof(getWCmd) - sizeof(UInt16));
-
-	byte buf[BSZ];
-	int len = sendReceive(ttyd, (byte*)&getWCmd, sizeof(getWCmd), buf, BSZ);
-
-	if (len)
-	{
-		// Check and decode result
-		int checkResult = checkResult_4x4b(buf, len);
-		if (OK == checkResult)
-		{
-			Result_4x4b* res = (Result_4x4b*)buf;
-			W->ap = B4F(res->ap, 1000.0);
-			W->am = B4F(res->am, 1000.0);
-			W->rp = B4F(res->rp, 1000.0);
-			W->rm = B4F(res->rm, 1000.0);
-		}
-
-		return checkResult;
-	}
+	ParamDesc desc = paramTable[PARAM_PR];
+	desc.paramId = (periodId << 4) | (month & 0xF);
+	desc.BWRI = tariffNo;
 
-	return COMMUNICATION_ERROR;
+	return readParam(ctx, &desc, (float*)W);
 }
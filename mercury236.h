@@ -1,21 +1,30 @@
+#ifndef MERCURY236_H
+#define MERCURY236_H
+
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
+#include "mercury-stats.h"
 
 #pragma pack(push, 1)
 
 #define BAUDRATE 		B57600
-#define TIME_OUT		2 * 1000	// Mercury inter-command delay (ms)
-#define CH_TIME_OUT		1		// Channel timeout (sec)
-#define PM_ADDRESS		0		// RS485 addess of the power meter
+#define CH_TIME_OUT		1		// Channel timeout, wait for the first byte (sec)
+#define FRAME_TIME_OUT		5		// Quiet line after a status frame shorter than expected (ms)
+#define SESSION_TIME_OUT	240		// Meter closes idle session after (sec)
+#define RETRIES			1		// Repeat command on broken responce
+#define PM_ADDRESS		0		// RS485 addess of the power meter (broadcast, the only one on the line)
 
 #define UInt16			uint16_t
 #define byte			unsigned char
 #define TARRIF_NUM		2		// 2 tariffs supported
 
-#define MERCURY_SEMAPHORE	"MERCURY_RS485"
+#define MERCURY_SEMAPHORE	"MERCURY_RS485"		// bus semaphore, .PORT is appended (see semaphoreName)
 #define MERCURY_ACCESS_PERM	0666
+#define MERCURY_BROKER		"/tmp/mercury-broker.sock"	// Broker socket default
 
 // ***** Commands
 // Test connection
@@ -54,6 +63,17 @@ typedef struct
 	UInt16 	CRC;
 } ReadParamCmd;
 
+// Memory read command
+typedef struct
+{
+	byte	address;
+	byte	command;	// 6h
+	byte	memory;		// memory number
+	byte	offset[2];	// memory address, high byte first
+	byte	length;		// bytes to read
+	UInt16	CRC;
+} ReadMemCmd;
+
 // ***** Results
 // 1-byte responce (usually with status code)
 typedef struct
@@ -63,6 +83,21 @@ typedef struct
 	UInt16	CRC;
 } Result_1b;
 
+// Load profile head (08h 13h): the last record written
+typedef struct
+{
+	byte	address;
+	byte	offset[2];	// memory address of the record, high byte first
+	byte	status;
+	byte	hour;		// time stamp of the record, BCD
+	byte	minute;
+	byte	day;
+	byte	month;
+	byte	year;
+	byte	period;		// integration period (minutes)
+	UInt16	CRC;
+} Result_ProfileHead;
+
 // 3-byte responce
 typedef struct
 {
@@ -154,6 +189,25 @@ typedef struct
 	MS	ms;			// mains status
 } OutputBlock;
 
+// OutputBlock fields (bit mask)
+typedef enum
+{
+	OB_U = 0x0001,		// voltage
+	OB_I = 0x0002,		// current
+	OB_A = 0x0004,		// phase angles
+	OB_C = 0x0008,		// cos(f)
+	OB_P = 0x0010,		// active power
+	OB_S = 0x0020,		// reactive power
+	OB_PR = 0x0040,		// power counters from reset (all tariffs)
+	OB_PRT0 = 0x0080,	// power counters from reset (day tariff)
+	OB_PRT1 = 0x0100,	// power counters from reset (night tariff)
+	OB_PY = 0x0200,		// power counters for yesterday
+	OB_PT = 0x0400,		// power counters for today
+	OB_F = 0x0800,		// grid frequency
+	OB_MS = 0x1000,		// mains status
+	OB_ALL = 0x1FFF
+} OutputField;
+
 typedef enum 			// How much energy consumed:
 {
 	PP_RESET = 0,		// from reset
@@ -178,17 +232,129 @@ typedef enum
 	COMMUNICATION_ERROR = 259
 } ResultCode;
 
+// Power meter on the bus: address and credentials of its session
+typedef struct
+{
+	byte	address;		// RS485 address, PM_ADDRESS if the only one on the line
+	byte	accessLevel;		// 1 - user, 2 - admin
+	byte	password[6];		// digits 0..9, one per byte
+} MeterConfig;
+
+#define METER_DEFAULT		{ PM_ADDRESS, 0x01, { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 } }
+
+// Parameters that can be read
+typedef enum
+{
+	PARAM_U = 0,		// voltage
+	PARAM_I,		// current
+	PARAM_C,		// cos(f)
+	PARAM_F,		// grid frequency
+	PARAM_A,		// phase angles
+	PARAM_P,		// active power
+	PARAM_S,		// reactive power
+	PARAM_PR,		// power counters from reset (all tariffs)
+	PARAM_PRT0,		// power counters from reset (day tariff)
+	PARAM_PRT1,		// power counters from reset (night tariff)
+	PARAM_PY,		// power counters for yesterday
+	PARAM_PT,		// power counters for today
+	PARAM_COUNT
+} ParamIndex;
+
+// Parameter descriptor: request, responce layout and scale
+typedef struct
+{
+	const char*	name;
+	byte	command;		// 05h - energy counters, 08h - parameters
+	byte	paramId;
+	byte	BWRI;
+	byte	replySize;		// responce frame size
+	byte	valueSize;		// bytes per value (3 or 4)
+	byte	count;			// values in the responce
+	byte	offsets[4];		// value offsets in the responce
+	float	divisor;		// scale factor
+	int	field;			// OutputField bit
+	size_t	target;			// values offset in OutputBlock
+} ParamDesc;
+
+extern const ParamDesc paramTable[PARAM_COUNT];
+
+/*
+ * Batched read: one request for several parameters, the responce carries
+ * the values of each one as its own responce would (without the address
+ * and CRC), one after another in ParamIndex order.
+ *
+ * This layout is the one test/mercury-sim answers, not one the protocol
+ * defines: there the array read selects a single quantity by BWRI. So
+ * batches are only sent when MercuryCtx.batch is set (mercury236 --batch
+ * against the simulator), real meters are read parameter by parameter.
+ * A meter that rejects the batch is not asked again (MercuryCtx.noBatch).
+ */
+typedef struct
+{
+	byte	command;
+	byte	paramId;
+	byte	BWRI;
+	byte	replySize;		// responce frame size
+	int	params;			// ParamIndex bit mask
+} BatchDesc;
+
+#define BATCH_COUNT		1
+
+extern const BatchDesc batchTable[BATCH_COUNT];
+
+#pragma pack(pop)
+
+/*
+ * Library context: the channel and everything the calls on it need, no
+ * state is shared between contexts, so every channel can be driven by
+ * its own thread. Bus access (the semaphore of the port) stays with the
+ * caller.
+ */
+typedef struct
+{
+	int		fd;			// RS485 dongle or mercury-broker socket
+	MeterConfig	meter;			// the meter commands go to
+	long		timeoutUs;		// wait for the first responce byte
+	long		frameGapUs;		// quiet line ending a status frame, data frames wait for all bytes
+	int		retries;		// repeat command on broken responce
+	FILE*		debug;			// packet trace, NULL - none
+	TxStatsTable	stats;			// transactions of the channel
+	int		batch;			// try the batched reads (mercury-sim only), off by default
+	uint32_t	noBatch[8];		// meters (address bits) that rejected batched reads
+} MercuryCtx;
+
 // Function prototypes:
-int checkChannel(int);
-int initConnection(int);
-int closeConnection(int);
-int getU(int, P3V*);
-int getI(int, P3V*);
-int getCosF(int, P3VS*);
-int getF(int, float*);
-int getA(int, P3V*);
-int getP(int, P3VS*);
-int getS(int, P3VS*);
-int getW(int, PWV*, int, int, int);
-
-#pragma pack(pop)
\ No newline at end of file
+void initCtx(MercuryCtx*, int fd);
+int isStatusFrame(const byte*, int);
+void printPackage(MercuryCtx*, byte*, int, int);
+void printError(MercuryCtx*, int);
+int parseMeter(const char*, MeterConfig*);
+int parseFields(const char*);
+void portName(const char* dev, char* name, int size);
+void semaphoreName(const char* dev, char* name, int size);
+int openChannel(const char*);
+int isBrokerChannel(int);
+int commandSize(byte*, int);
+int replySize(byte*);
+int sendReceive(MercuryCtx*, byte*, int, byte*, int, int, long, TxTiming*);
+int checkResponce(byte*, int, int);
+int exchange(MercuryCtx*, byte*, int, byte*, int);
+int checkChannel(MercuryCtx*);
+int probeChannel(MercuryCtx*, long, TxTiming*);
+int initConnection(MercuryCtx*);
+int closeConnection(MercuryCtx*);
+void decodeParam(const ParamDesc*, const byte*, float*);
+int readParam(MercuryCtx*, const ParamDesc*, float*);
+int getParam(MercuryCtx*, int, OutputBlock*);
+int readBatch(MercuryCtx*, const BatchDesc*, OutputBlock*);
+int getParams(MercuryCtx*, int, OutputBlock*, int*);
+int getU(MercuryCtx*, P3V*);
+int getI(MercuryCtx*, P3V*);
+int getCosF(MercuryCtx*, P3VS*);
+int getF(MercuryCtx*, float*);
+int getA(MercuryCtx*, P3V*);
+int getP(MercuryCtx*, P3VS*);
+int getS(MercuryCtx*, P3VS*);
+int getW(MercuryCtx*, PWV*, int, int, int);
+
+#endif
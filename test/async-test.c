@@ -0,0 +1,217 @@
+/*
+ *	Non-blocking API: two channels driven from one poll() loop against
+ *	in-process meters, one on a socket pair (as through the broker), one
+ *	on a pty (as on a serial port), with a broken responce to retry, a
+ *	silent meter to time out and a cancelled request.
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../mercury-async.h"
+#include "../mercury-crc.h"
+
+#define METERS			2
+
+// In-process meter at the other end of the channel
+typedef struct
+{
+	int	fd;
+	byte	cmd[ASYNC_BSZ];
+	int	len;
+	int	corrupt;		// responces to break
+	int	silent;			// commands to ignore
+	int	commands;		// received
+} Meter;
+
+typedef struct
+{
+	int	done;
+	int	result;
+	float	values[4];
+	int64_t	at;			// completed, txClock()
+} Completion;
+
+int failures = 0;
+
+// -- Put the value into 3 bytes, as B3F decodes it
+void putB3(byte* b, int val)
+{
+	b[0] = (val >> 16) & 0x3F;
+	b[1] = val & 0xFF;
+	b[2] = (val >> 8) & 0xFF;
+}
+
+// -- Answer the complete command received: voltage (phase + 230 V) or OK status
+void serveMeter(Meter* m)
+{
+	int r = read(m->fd, m->cmd + m->len, ASYNC_BSZ - m->len);
+	if (r <= 0)
+		return;
+	m->len += r;
+
+	int size = commandSize(m->cmd, m->len);
+	if (size <= 0 || m->len < size)
+		return;
+	m->len = 0;
+	m->commands++;
+
+	if (m->silent)
+	{
+		m->silent--;
+		return;
+	}
+
+	byte out[ASYNC_BSZ];
+	int outLen = sizeof(Result_1b);
+	bzero(out, sizeof(out));
+	out[0] = m->cmd[0];
+	if (0x08 == m->cmd[1])
+	{
+		outLen = sizeof(Result_3x3b);
+		for (int i = 0; i < 3; i++)
+			putB3(out + 1 + 3 * i, (231 + i) * 100);
+	}
+	*(UInt16*)(out + outLen - sizeof(UInt16)) = ModRTU_CRC(out, outLen - sizeof(UInt16));
+
+	if (m->corrupt)
+	{
+		m->corrupt--;
+		out[outLen - 1] ^= 0xFF;
+	}
+	write(m->fd, out, outLen);
+}
+
+void complete(MercuryRequest* req, int result, const float* values, void* arg)
+{
+	Completion* c = arg;
+	c->done++;
+	c->at = txClock();
+	c->result = result;
+	if (values)
+		memcpy(c->values, values, req->desc.count * sizeof(float));
+}
+
+// -- Run the loop until both channels are idle
+void run(MercuryAsync* a, Meter* m)
+{
+	for (;;)
+	{
+		struct pollfd p[2 * METERS];
+		int timeout = -1;
+		for (int i = 0; i < METERS; i++)
+		{
+			p[i].fd = asyncFd(&a[i]);
+			p[i].events = asyncEvents(&a[i]);
+			p[METERS + i].fd = m[i].fd;
+			p[METERS + i].events = POLLIN;
+
+			int t = asyncTimeout(&a[i]);
+			if (t >= 0 && (timeout < 0 || t < timeout))
+				timeout = t;
+		}
+		if (timeout < 0)
+			return;
+
+		poll(p, 2 * METERS, timeout);
+		for (int i = 0; i < METERS; i++)
+		{
+			if (p[METERS + i].revents)
+				serveMeter(&m[i]);
+			asyncHandle(&a[i], p[i].revents);
+		}
+	}
+}
+
+void expect(const char* what, const Completion* c, int result)
+{
+	if (1 != c->done || result != c->result)
+	{
+		printf("FAIL: %s: %d completions, result %d, expected %d\n", what, c->done, c->result, result);
+		failures++;
+	}
+}
+
+int main()
+{
+	MercuryCtx ctx[METERS];
+	MercuryAsync a[METERS];
+	Meter m[METERS];
+	bzero(m, sizeof(m));
+
+	// the 1st meter through a socket pair, the 2nd on a pty set up as a serial port
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return EXIT_FAILURE;
+	initCtx(&ctx[0], sv[0]);
+	m[0].fd = sv[1];
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master))
+		return EXIT_FAILURE;
+	initCtx(&ctx[1], openChannel(ptsname(master)));
+	m[1].fd = master;
+
+	for (int i = 0; i < METERS; i++)
+		if (ctx[i].fd < 0 || asyncInit(&a[i], &ctx[i]))
+			return EXIT_FAILURE;
+
+	// queued on both channels at once, the 2nd meter breaks the first responce
+	Completion check[METERS], u[METERS], cancelled;
+	bzero(check, sizeof(check));
+	bzero(u, sizeof(u));
+	bzero(&cancelled, sizeof(cancelled));
+	m[1].corrupt = 1;
+	for (int i = 0; i < METERS; i++)
+	{
+		asyncCheckChannel(&a[i], complete, &check[i]);
+		asyncGetParam(&a[i], PARAM_U, complete, &u[i]);
+	}
+	asyncCancel(&a[0], asyncInitConnection(&a[0], complete, &cancelled));
+	run(a, m);
+
+	for (int i = 0; i < METERS; i++)
+	{
+		expect("check channel", &check[i], OK);
+		expect("voltage", &u[i], OK);
+		if (u[i].values[0] != 231 || u[i].values[1] != 232 || u[i].values[2] != 233)
+		{
+			printf("FAIL: voltage %.2f %.2f %.2f\n", u[i].values[0], u[i].values[1], u[i].values[2]);
+			failures++;
+		}
+	}
+	if (cancelled.done || m[0].commands != 2 || m[1].commands != 3)
+	{
+		printf("FAIL: %d, %d commands sent, cancelled request completed %d times\n",
+			m[0].commands, m[1].commands, cancelled.done);
+		failures++;
+	}
+
+	// the silent meter times out, the other one is not held up
+	Completion silent, other;
+	bzero(&silent, sizeof(silent));
+	bzero(&other, sizeof(other));
+	m[0].silent = 1;
+	int64_t started = txClock();
+	asyncCheckChannel(&a[0], complete, &silent);
+	asyncGetParam(&a[1], PARAM_U, complete, &other);
+	run(a, m);
+
+	expect("silent meter", &silent, CHECK_CHANNEL_FAILURE);
+	expect("other meter", &other, OK);
+	if (silent.at - started < CH_TIME_OUT * 1000000L || other.at - started > CH_TIME_OUT * 500000L)
+	{
+		printf("FAIL: silent meter timed out after %lld us, the other one completed after %lld us\n",
+			(long long)(silent.at - started), (long long)(other.at - started));
+		failures++;
+	}
+
+	printf("async-test: %s\n", (failures) ? "FAILED" : "passed");
+	return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+/*
+ *	CRC throughput microbenchmark: bit by bit loop against the table
+ *	driven variants on frame sized and multi-kilobyte buffers.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../mercury-crc.h"
+
+#define BENCH_BYTES		(64L * 1024 * 1024)	// bytes hashed per measurement
+
+typedef uint16_t (*CrcFunc)(const unsigned char*, int);
+
+typedef struct
+{
+	const char*	name;
+	CrcFunc		func;
+} Variant;
+
+const Variant variants[] =
+{
+	{ "bitwise", crc16Bitwise },
+	{ "table", crc16Table },
+	{ "slice4", crc16Slice4 },
+	{ "slice8", crc16Slice8 }
+};
+
+const int sizes[] = { 4, 6, 11, 19, 64, 256, 4096, 65536 };
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+	static unsigned char buf[65536];
+	for (int i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	volatile uint16_t sink = 0;
+
+	printf("%8s", "bytes");
+	for (int v = 0; v < sizeof(variants) / sizeof(Variant); v++)
+		printf(" %10s", variants[v].name);
+	printf("   (MB/s, ns/call in brackets for frames)\n");
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(int); s++)
+	{
+		int len = sizes[s];
+		long calls = BENCH_BYTES / len;
+		printf("%8d", len);
+
+		for (int v = 0; v < sizeof(variants) / sizeof(Variant); v++)
+		{
+			long n = (0 == v) ? calls / 8 : calls;	// bitwise is slow, scale down
+			double start = now();
+			for (long i = 0; i < n; i++)
+				sink ^= variants[v].func(buf + (i & 7), len);
+			double elapsed = now() - start;
+
+			if (len < 64)
+				printf(" %10.1f", elapsed * 1e9 / n);
+			else
+				printf(" %10.1f", n * (double)len / elapsed / 1e6);
+		}
+		printf("%s\n", (len < 64) ? " ns" : " MB/s");
+	}
+	return sink & 0;
+}
@@ -0,0 +1,58 @@
+/*
+ *	Cross-check of the CRC variants: all must agree with the bit by bit
+ *	reference on every buffer size and alignment.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mercury-crc.h"
+
+#define MAX_LEN			4100
+#define ROUNDS			20
+
+int main()
+{
+	unsigned char buf[MAX_LEN + 8];
+	int failures = 0;
+
+	// CRC-16/MODBUS check value
+	unsigned char check[] = "123456789";
+	if (0x4B37 != crc16Bitwise(check, 9))
+	{
+		printf("FAIL: reference CRC of \"123456789\" is %04X, 4B37 expected\n", crc16Bitwise(check, 9));
+		failures++;
+	}
+
+	// Mercury test command to address 0 (00 00 01 B0 on the wire)
+	unsigned char testCmd[] = { 0x00, 0x00 };
+	if (0xB001 != ModRTU_CRC(testCmd, 2))
+	{
+		printf("FAIL: test command CRC is %04X, B001 expected\n", ModRTU_CRC(testCmd, 2));
+		failures++;
+	}
+
+	srand(236);
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		for (int i = 0; i < sizeof(buf); i++)
+			buf[i] = rand();
+
+		for (int len = 0; len <= MAX_LEN; len += (len < 64) ? 1 : 61)
+			for (int offset = 0; offset < 8; offset++)
+			{
+				unsigned char* p = buf + offset;
+				uint16_t ref = crc16Bitwise(p, len);
+				if (crc16Table(p, len) != ref ||
+					crc16Slice4(p, len) != ref ||
+					crc16Slice8(p, len) != ref ||
+					ModRTU_CRC(p, len) != ref)
+				{
+					printf("FAIL: len %d, offset %d: bitwise %04X, table %04X, slice4 %04X, slice8 %04X\n",
+						len, offset, ref, crc16Table(p, len), crc16Slice4(p, len), crc16Slice8(p, len));
+					failures++;
+				}
+			}
+	}
+
+	printf("crc-test (CRC_SLICING=%d): %s\n", CRC_SLICING, (failures) ? "FAILED" : "passed");
+	return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+/*
+ *	End-to-end poll cycle benchmark: drives the library against the
+ *	simulator (test/mercury-sim) with 57600 baud line timing and reports
+ *	latency per command and per full mercury236 acquisition cycle.
+ *
+ *	$ ./test/cycle-bench --cycles 100 --out bench_output.txt
+ *
+ *	Results are also written as JSON so that the runs on different
+ *	commits can be compared.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../mercury236.h"
+
+#define OPT_CYCLES		"--cycles"
+#define OPT_OUT			"--out"
+#define OPT_SIM			"--sim"
+#define OPT_DELAY		"--delay"
+#define OPT_BYTE_DELAY		"--byte-delay"
+#define OPT_HELP		"--help"
+
+#define BSZ			255
+#define MAX_CYCLES		10000
+
+typedef enum
+{
+	EXIT_OK = 0,
+	EXIT_FAIL = 1
+} ExitCode;
+
+// Steps of the acquisition cycle (as mercury236 does it)
+typedef enum
+{
+	STEP_CHECK = 0,
+	STEP_INIT = 1,
+	STEP_PARAM = 2,			// PARAM_COUNT steps
+	STEP_CLOSE = STEP_PARAM + PARAM_COUNT,
+	STEP_CYCLE,			// the whole cycle
+	STEP_COUNT
+} Step;
+
+// Latency samples per step (microseconds)
+double samples[STEP_COUNT][MAX_CYCLES];
+long errors[STEP_COUNT];
+
+// -- Command line usage help
+void printUsage()
+{
+	printf("Usage: cycle-bench [OPTIONS] ...\n\r\n\r");
+	printf("  %s N\tacquisition cycles to run (default 50)\n\r", OPT_CYCLES);
+	printf("  %s FILE\twrite JSON results to FILE\n\r", OPT_OUT);
+	printf("  %s PATH\tsimulator binary (default ./test/mercury-sim)\n\r", OPT_SIM);
+	printf("  %s MS\tsimulated meter responce delay (default 2)\n\r", OPT_DELAY);
+	printf("  %s US\tsimulated per byte latency (default 174)\n\r", OPT_BYTE_DELAY);
+	printf("\n\r");
+	printf("  %s\tprints this screen\n\r", OPT_HELP);
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+const char* stepName(int step)
+{
+	switch (step)
+	{
+		case STEP_CHECK: return "checkChannel";
+		case STEP_INIT: return "initConnection";
+		case STEP_CLOSE: return "closeConnection";
+		case STEP_CYCLE: return "cycle";
+		default: return paramTable[step - STEP_PARAM].name;
+	}
+}
+
+int compareDouble(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// -- Percentile of sorted samples
+double percentile(double* sorted, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+/*
+ * Start the simulator, read the slave device name it prints.
+ *
+ * Returns:
+ *	simulator pid or < 0 if failed.
+ */
+pid_t startSimulator(const char* sim, const char* delay, const char* byteDelay, char* dev)
+{
+	int out[2];
+	if (pipe(out))
+		return -1;
+
+	pid_t pid = fork();
+	if (0 == pid)
+	{
+		dup2(out[1], STDOUT_FILENO);
+		close(out[0]);
+		execl(sim, sim, "--delay", delay, "--byte-delay", byteDelay, (char*)NULL);
+		_exit(EXIT_FAIL);
+	}
+	close(out[1]);
+
+	FILE* f = fdopen(out[0], "r");
+	if (pid < 0 || !f || !fgets(dev, BSZ, f))
+		return -1;
+	dev[strcspn(dev, "\n")] = 0;
+	return pid;
+}
+
+// -- Run one step, record its latency
+int timed(int step, int cycle, int res, double start)
+{
+	samples[step][cycle] = now() - start;
+	if (OK != res)
+		errors[step]++;
+	return res;
+}
+
+int main(int argc, const char** args)
+{
+	int cycles = 50;
+	const char* out = NULL;
+	const char* sim = "./test/mercury-sim";
+	const char* delay = "2";
+	const char* byteDelay = "174";
+
+	for (int i=1; i<argc; i++)
+	{
+		int hasArg = i + 1 < argc;
+
+		if (!strcmp(OPT_CYCLES, args[i]) && hasArg)
+			cycles = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_OUT, args[i]) && hasArg)
+			out = args[++i];
+		else if (!strcmp(OPT_SIM, args[i]) && hasArg)
+			sim = args[++i];
+		else if (!strcmp(OPT_DELAY, args[i]) && hasArg)
+			delay = args[++i];
+		else if (!strcmp(OPT_BYTE_DELAY, args[i]) && hasArg)
+			byteDelay = args[++i];
+		else if (!strcmp(OPT_HELP, args[i]))
+		{
+			printUsage();
+			exit(EXIT_OK);
+		}
+		else
+		{
+			printf("Error: %s option is not recognised\n\r\n\r", args[i]);
+			printUsage();
+			exit(EXIT_FAIL);
+		}
+	}
+
+	if (cycles < 1 || cycles > MAX_CYCLES)
+	{
+		printf("Error: cycles (%d) is out of the range (1..%d).\n\r", cycles, MAX_CYCLES);
+		exit(EXIT_FAIL);
+	}
+
+	char dev[BSZ];
+	pid_t simPid = startSimulator(sim, delay, byteDelay, dev);
+	if (simPid < 0)
+	{
+		printf("Cannot start simulator %s.\n\r", sim);
+		exit(EXIT_FAIL);
+	}
+
+	int fd = openChannel(dev);
+	if (fd < 0)
+	{
+		printf("Cannot open %s terminal channel.\n\r", dev);
+		kill(simPid, SIGTERM);
+		exit(EXIT_FAIL);
+	}
+	MercuryCtx ctx;
+	initCtx(&ctx, fd);
+
+	// full acquisition, as a single mercury236 run does it
+	double benchStart = now();
+	for (int c = 0; c < cycles; c++)
+	{
+		OutputBlock o;
+		double cycleStart = now(), t;
+
+		t = now(); timed(STEP_CHECK, c, checkChannel(&ctx), t);
+		t = now(); timed(STEP_INIT, c, initConnection(&ctx), t);
+		for (int p = 0; p < PARAM_COUNT; p++)
+		{
+			t = now();
+			timed(STEP_PARAM + p, c, getParam(&ctx, p, &o), t);
+		}
+		t = now(); timed(STEP_CLOSE, c, closeConnection(&ctx), t);
+
+		timed(STEP_CYCLE, c, OK, cycleStart);
+	}
+	double elapsed = (now() - benchStart) / 1e6;
+
+	close(fd);
+	kill(simPid, SIGTERM);
+	waitpid(simPid, NULL, 0);
+
+	FILE* json = (out) ? fopen(out, "w") : NULL;
+	if (json)
+		fprintf(json, "{\"cycles\":%d,\"delayMs\":%s,\"byteDelayUs\":%s,\"cyclesPerSec\":%.3f,\"steps\":{",
+			cycles, delay, byteDelay, cycles / elapsed);
+
+	printf("%-16s %10s %10s %10s %8s   (ms)\n", "step", "p50", "p99", "max", "errors");
+	for (int s = 0; s < STEP_COUNT; s++)
+	{
+		qsort(samples[s], cycles, sizeof(double), compareDouble);
+		double p50 = percentile(samples[s], cycles, 0.50) / 1000;
+		double p99 = percentile(samples[s], cycles, 0.99) / 1000;
+		double max = samples[s][cycles - 1] / 1000;
+
+		printf("%-16s %10.3f %10.3f %10.3f %8ld\n", stepName(s), p50, p99, max, errors[s]);
+		if (json)
+			fprintf(json, "%s\"%s\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f,\"errors\":%ld}",
+				(s) ? "," : "", stepName(s), p50, p99, max, errors[s]);
+	}
+	printf("cycles per second: %.3f\n\n", cycles / elapsed);
+	printTxStats(&ctx.stats, stdout);
+
+	if (json)
+	{
+		fprintf(json, "}}\n");
+		fclose(json);
+	}
+	else if (out)
+		printf("Cannot write %s.\n\r", out);
+
+	exit(EXIT_OK);
+}
@@ -0,0 +1,670 @@
+/*
+ *	Mercury 236 power meter simulator for hardware-free testing.
+ *
+ *	Opens a pseudo-terminal pair and answers Mercury protocol requests on
+ *	the slave side, so mercury236 and mercury-mon run unmodified against
+ *	the slave device printed on start (or the --link path):
+ *
+ *	$ ./test/mercury-sim --link /tmp/ttyMERCURY &
+ *	$ ./mercury236 /tmp/ttyMERCURY --json
+ *
+ *	Supported: test (00h), open (01h), close (02h) channel, parameters
+ *	read (08h 16h), energy counters read (05h) of every period and tariff,
+ *	the load profile head (08h 13h) and memory read (06h) of the profile.
+ *	Line timing and faults (per byte latency, responce delay, dropped
+ *	bytes, CRC errors) are configurable.
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "../mercury236.h"
+#include "../mercury-crc.h"
+#include "../mercury-profile.h"
+
+#define OPT_LINK		"--link"
+#define OPT_ADDRESS		"--address"
+#define OPT_METERS		"--meters"
+#define OPT_PASSWORD		"--password"
+#define OPT_BYTE_DELAY		"--byte-delay"
+#define OPT_DELAY		"--delay"
+#define OPT_DROP		"--drop"
+#define OPT_CORRUPT		"--corrupt"
+#define OPT_OFF			"--off"
+#define OPT_SESSION		"--session-timeout"
+#define OPT_VALUE		"--value"
+#define OPT_SEED		"--seed"
+#define OPT_LOAD_STEP		"--load-step"
+#define OPT_NO_BATCH		"--no-batch"
+#define OPT_PROFILE_DAYS	"--profile-days"
+#define OPT_DEBUG		"--debug"
+#define OPT_HELP		"--help"
+
+#define BSZ			255
+#define BYTE_DELAY		174	// 10 bits at 57600 baud (us)
+#define MAX_METERS		16
+#define PROFILE_PERIOD		30	// load profile integration period (minutes)
+
+int debugPrint = 0;
+
+typedef enum
+{
+	EXIT_OK = 0,
+	EXIT_FAIL = 1
+} ExitCode;
+
+// Simulator settings
+typedef struct
+{
+	int	address;		// own RS485 address, 0 (broadcast) always accepted
+	int	meters;			// meters on the bus, at address, address + 1 ...
+	byte	password[6];		// level 1 password
+	long	byteDelay;		// per byte latency (us)
+	long	delay;			// delay before the responce (ms)
+	double	drop;			// probability to lose a responce byte
+	double	corrupt;		// probability to break the responce CRC
+	int	off;			// mains off: no responces at all
+	int	sessionTimeout;		// idle channel closes after (sec)
+	long	loadStep;		// power (P, S) triples every other period (ms), 0 - steady
+	int	noBatch;		// batched reads rejected, as real meters do
+	int	profileDays;		// load profile recorded, the older memory is erased
+} SimSettings;
+
+// Simulator statistics
+typedef struct
+{
+	long	requests;
+	long	responces;
+	long	dropped;		// bytes lost
+	long	corrupted;		// responces with broken CRC
+	long	rejected;		// status frames other than OK
+} SimStats;
+
+SimSettings settings =
+{
+	.address = 0,
+	.meters = 1,
+	.password = { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 },
+	.byteDelay = BYTE_DELAY,
+	.delay = 2,
+	.drop = 0,
+	.corrupt = 0,
+	.off = 0,
+	.sessionTimeout = SESSION_TIME_OUT,
+	.loadStep = 0,
+	.noBatch = 0,
+	.profileDays = PROFILE_CAPACITY * PROFILE_PERIOD / (24 * 60)
+};
+
+SimStats stats;
+OutputBlock meter;			// values reported
+int terminateSimNow = 0;
+
+// -- Command line usage help
+void printUsage()
+{
+	printf("Usage: mercury-sim [OPTIONS] ...\n\r\n\r");
+	printf("  %s PATH\tsymlink to the slave device\n\r", OPT_LINK);
+	printf("  %s N\tmeter RS485 address (default 0)\n\r", OPT_ADDRESS);
+	printf("  %s N\tmeters on the bus at the consecutive addresses from %s (non zero),\n\r", OPT_METERS, OPT_ADDRESS);
+	printf("\t\tthe current and power of the Nth one are N times the values\n\r");
+	printf("  %s DDDDDD\tlevel 1 password digits (default 111111)\n\r", OPT_PASSWORD);
+	printf("  %s US\tper byte latency, microseconds (default %d, 57600 baud)\n\r", OPT_BYTE_DELAY, BYTE_DELAY);
+	printf("  %s MS\tdelay before the responce, milliseconds (default 2)\n\r", OPT_DELAY);
+	printf("  %s P\tprobability to drop a responce byte (0..1)\n\r", OPT_DROP);
+	printf("  %s P\tprobability to corrupt a responce CRC (0..1)\n\r", OPT_CORRUPT);
+	printf("  %s\t\tmains off, the meter is silent\n\r", OPT_OFF);
+	printf("  %s S\tidle channel closes after, seconds (default %d)\n\r", OPT_SESSION, SESSION_TIME_OUT);
+	printf("  %s NAME=V1,V2..\tvalues reported, NAME is U, I, CosF, F, A, P, S, PR, PR-day,\n\r", OPT_VALUE);
+	printf("\t\tPR-night, PY or PT; values in the structure order (sum first)\n\r");
+	printf("  %s N\trandom seed for the faults\n\r", OPT_SEED);
+	printf("  %s MS\tpower (P, S) triples every other MS milliseconds (load switching)\n\r", OPT_LOAD_STEP);
+	printf("  %s\tbatched reads (mercury236 --batch) rejected with ILLEGAL_CMD, as real meters do\n\r", OPT_NO_BATCH);
+	printf("  %s N\tdays of the load profile recorded (default %d, the whole memory)\n\r", OPT_PROFILE_DAYS, settings.profileDays);
+	printf("  %s\tto print extra debug info\n\r", OPT_DEBUG);
+	printf("\n\r");
+	printf("  %s\tprints this screen\n\r", OPT_HELP);
+}
+
+// -- Signal Handler for SIGINT, SIGTERM
+void sigterm_handler(int sig_num)
+{
+	terminateSimNow = 1;
+}
+
+// -- Encode float into 3 bytes (inverse of B3F)
+void F3B(byte* b, float value, float factor)
+{
+	int val = (int)lroundf(fabsf(value) * factor);
+	b[0] = (val >> 16) & 0x3F;
+	b[1] = val & 0xFF;
+	b[2] = (val >> 8) & 0xFF;
+}
+
+// -- Encode float into 4 bytes (inverse of B4F)
+void F4B(byte* b, float value, float factor)
+{
+	int val = (int)lroundf(fabsf(value) * factor);
+	b[1] = (val >> 24) & 0x3F;
+	b[0] = (val >> 16) & 0xFF;
+	b[3] = (val >> 8) & 0xFF;
+	b[2] = val & 0xFF;
+}
+
+// -- Values of the parameter in the meter output block
+float* paramValues(const ParamDesc* desc)
+{
+	return (float*)((byte*)&meter + desc->target);
+}
+
+// -- Default readings of a healthy 3 phase installation
+void initMeter()
+{
+	float U[] = { 229.81, 231.05, 227.43 };
+	float I[] = { 1.254, 0.387, 4.911 };
+	float C[] = { 0.912, 0.954, 0.877, 0.931 };
+	float A[] = { 0.00, 119.87, 240.31 };
+	float P[] = { 1512.34, 263.05, 84.12, 1165.17 };
+	float S[] = { 1624.50, 288.32, 88.17, 1328.01 };
+	float PR[] = { 12345.678, 0, 2345.125, 0 };
+	float PRT0[] = { 8123.456, 0, 1543.321, 0 };
+	float PRT1[] = { 4222.222, 0, 801.804, 0 };
+	float PY[] = { 31.415, 0, 5.432, 0 };
+	float PT[] = { 12.345, 0, 2.101, 0 };
+
+	memcpy(&meter.U, U, sizeof(U));
+	memcpy(&meter.I, I, sizeof(I));
+	memcpy(&meter.C, C, sizeof(C));
+	memcpy(&meter.A, A, sizeof(A));
+	memcpy(&meter.P, P, sizeof(P));
+	memcpy(&meter.S, S, sizeof(S));
+	memcpy(&meter.PR, PR, sizeof(PR));
+	memcpy(&meter.PRT[0], PRT0, sizeof(PRT0));
+	memcpy(&meter.PRT[1], PRT1, sizeof(PRT1));
+	memcpy(&meter.PY, PY, sizeof(PY));
+	memcpy(&meter.PT, PT, sizeof(PT));
+	meter.f = 50.01;
+	meter.ms = MS_ON;
+}
+
+// -- Parse NAME=V1,V2,.. value setting, returns 0 if ok
+int setValue(const char* spec)
+{
+	char buf[BSZ];
+	strncpy(buf, spec, BSZ - 1);
+	buf[BSZ - 1] = 0;
+
+	char* values = strchr(buf, '=');
+	if (!values)
+		return -1;
+	*values++ = 0;
+
+	for (int i = 0; i < PARAM_COUNT; i++)
+		if (!strcmp(paramTable[i].name, buf))
+		{
+			float* v = paramValues(&paramTable[i]);
+			int n = 0;
+			for (char* val = strtok(values, ","); val && n < paramTable[i].count; val = strtok(NULL, ","))
+				v[n++] = strtof(val, NULL);
+			return 0;
+		}
+
+	return -1;
+}
+
+// -- Parameter descriptor for the request, NULL if not supported
+const ParamDesc* findParam(byte* cmd)
+{
+	for (int i = 0; i < PARAM_COUNT; i++)
+	{
+		const ParamDesc* desc = &paramTable[i];
+		if (desc->command == cmd[1] && desc->paramId == cmd[2] &&
+			(0x05 == cmd[1] ? desc->BWRI == cmd[3] : (desc->BWRI & 0xFC) == (cmd[3] & 0xFC)))
+			return desc;
+	}
+
+	return NULL;
+}
+
+// -- Batch descriptor for the request, NULL if not supported
+const BatchDesc* findBatch(byte* cmd)
+{
+	for (int i = 0; i < BATCH_COUNT && !settings.noBatch; i++)
+		if (batchTable[i].command == cmd[1] && batchTable[i].paramId == cmd[2] && batchTable[i].BWRI == cmd[3])
+			return &batchTable[i];
+	return NULL;
+}
+
+// -- Put the values of the meter (index on the bus) into the responce at the parameter offsets
+void encodeParam(int m, const ParamDesc* desc, byte* reply)
+{
+	float v[4];
+	memcpy(v, paramValues(desc), desc->count * sizeof(float));
+	if (settings.loadStep && (desc == &paramTable[PARAM_P] || desc == &paramTable[PARAM_S]))
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		long ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		if (ms / settings.loadStep % 2)
+			for (int i = 0; i < desc->count; i++)
+				v[i] *= 3;
+	}
+	if (desc == &paramTable[PARAM_I] || desc == &paramTable[PARAM_P] || desc == &paramTable[PARAM_S])
+		for (int i = 0; i < desc->count; i++)
+			v[i] *= m + 1;
+
+	for (int i = 0; i < desc->count; i++)
+		if (4 == desc->valueSize)
+			F4B(reply + desc->offsets[i], v[i], desc->divisor);
+		else
+			F3B(reply + desc->offsets[i], v[i], desc->divisor);
+}
+
+// -- BCD byte of the number
+byte BCD(int value)
+{
+	return (value / 10) << 4 | value % 10;
+}
+
+// -- The last load profile period completed (periods since the epoch)
+long profileHead()
+{
+	return time(NULL) / (PROFILE_PERIOD * 60) - 1;
+}
+
+/*
+ * Load profile record of the meter (index on the bus) at the memory
+ * address: the latest period stored there, a daily load curve of the
+ * P and S values. Erased (0xFF) beyond settings.profileDays.
+ */
+void profileRecord(int m, int address, byte* r)
+{
+	long head = profileHead();
+	long slots = PROFILE_CAPACITY;
+	long k = head - ((head - address / PROFILE_RECORD_SIZE) % slots + slots) % slots;
+
+	memset(r, 0xFF, PROFILE_RECORD_SIZE);
+	if (head - k >= (long)settings.profileDays * 24 * 60 / PROFILE_PERIOD)
+		return;
+
+	time_t start = k * PROFILE_PERIOD * 60;
+	struct tm* tm = localtime(&start);
+	r[0] = 0x00;
+	r[1] = BCD(tm->tm_hour);
+	r[2] = BCD(tm->tm_min);
+	r[3] = BCD(tm->tm_mday);
+	r[4] = BCD(tm->tm_mon + 1);
+	r[5] = BCD(tm->tm_year % 100);
+	r[6] = PROFILE_PERIOD;
+
+	// average power (W, var) as impulses counted over the period
+	double curve = 1 + 0.5 * sin(2 * M_PI * (k % 48) / 48.0);
+	double power[4] = { meter.P.sum * curve, 0, meter.S.sum * curve, 0 };
+	for (int i = 0; i < 4; i++)
+	{
+		long impulses = lround(fabs(power[i]) * (m + 1) * PROFILE_PERIOD * 2 * PROFILE_CONSTANT / 60000.0);
+		if (impulses >= PROFILE_NO_DATA)
+			impulses = PROFILE_NO_DATA - 1;
+		r[7 + 2 * i] = impulses & 0xFF;
+		r[8 + 2 * i] = impulses >> 8;
+	}
+}
+
+// -- Build status (1 byte) responce, returns its size without CRC
+int statusFrame(byte* reply, int address, int code)
+{
+	Result_1b* res = (Result_1b*)reply;
+	res->address = address;
+	res->result = code;
+	if (OK != code)
+		stats.rejected++;
+	return sizeof(Result_1b) - sizeof(UInt16);
+}
+
+/*
+ * Energy counters (05h) of the periods and tariffs not in the parameter
+ * table: this and last year, months, today and yesterday by tariff, as
+ * shares of the counters from reset (day tariff 2/3, night 1/3).
+ *
+ * Returns:
+ *	responce size without CRC.
+ */
+int energyCounters(int m, byte* cmd, byte* reply)
+{
+	static const float periodShare[] = { 1.0, 0.30, 0.35, 0, 0.0008, 0.0011 };
+	int period = cmd[2] >> 4, month = cmd[2] & 0x0F, tariff = cmd[3];
+	if (period > PP_YESTERDAY || (PP_MONTH == period && (month < 1 || month > 12)) ||
+		(PP_MONTH != period && month) || tariff > TARRIF_NUM)
+		return statusFrame(reply, settings.address + m, ILLEGAL_CMD);
+
+	float share = (PP_MONTH == period) ? 0.025 * (1 + 0.1 * (month % 4)) : periodShare[period];
+	if (tariff)
+		share *= (1 == tariff) ? 2.0 / 3 : 1.0 / 3;
+
+	const ParamDesc* desc = &paramTable[PARAM_PR];
+	float* v = paramValues(desc);
+	for (int i = 0; i < desc->count; i++)
+		F4B(reply + desc->offsets[i], v[i] * share, desc->divisor);
+	return desc->replySize - sizeof(UInt16);
+}
+
+/*
+ * Meter logic: build responce of the meter (index on the bus) to the
+ * request frame.
+ *
+ * Returns:
+ *	responce size without CRC, 0 if the meter does not respond.
+ */
+int handleRequest(int m, byte* cmd, int len, byte* reply)
+{
+	static int channelOpen[MAX_METERS];
+	static time_t lastRequest[MAX_METERS];
+
+	time_t now = time(NULL);
+	if (channelOpen[m] && now - lastRequest[m] > settings.sessionTimeout)
+		channelOpen[m] = 0;
+	lastRequest[m] = now;
+
+	int address = settings.address + m;
+
+	switch (cmd[1])
+	{
+		case 0x00:	// test channel
+			return statusFrame(reply, address, OK);
+
+		case 0x01:	// open channel
+		{
+			InitCmd* init = (InitCmd*)cmd;
+			if (memcmp(init->password, settings.password, sizeof(settings.password)))
+				return statusFrame(reply, address, PERMISSION_DENIED);
+			channelOpen[m] = 1;
+			return statusFrame(reply, address, OK);
+		}
+
+		case 0x02:	// close channel
+			channelOpen[m] = 0;
+			return statusFrame(reply, address, OK);
+
+		case 0x05:	// energy counters
+		case 0x08:	// parameters
+		{
+			if (!channelOpen[m])
+				return statusFrame(reply, address, CHANNEL_ISNT_OPEN);
+
+			reply[0] = address;
+			if (0x08 == cmd[1] && 0x13 == cmd[2])
+			{
+				// profile head: the last record written
+				Result_ProfileHead* head = (Result_ProfileHead*)reply;
+				int last = (profileHead() % PROFILE_CAPACITY) * PROFILE_RECORD_SIZE;
+				byte r[PROFILE_RECORD_SIZE];
+				profileRecord(m, last, r);
+				head->offset[0] = last >> 8;
+				head->offset[1] = last & 0xFF;
+				memcpy(&head->status, r, 6);
+				head->period = PROFILE_PERIOD;
+				return sizeof(Result_ProfileHead) - sizeof(UInt16);
+			}
+
+			const BatchDesc* batch = findBatch(cmd);
+			if (batch)
+			{
+				// the parameters one after another, as their own responces without address and CRC
+				byte* values = reply;
+				for (int p = 0; p < PARAM_COUNT; p++)
+					if (batch->params & 1 << p)
+					{
+						encodeParam(m, &paramTable[p], values);
+						values += paramTable[p].replySize - sizeof(byte) - sizeof(UInt16);
+					}
+				return batch->replySize - sizeof(UInt16);
+			}
+
+			const ParamDesc* desc = findParam(cmd);
+			if (NULL == desc && 0x05 == cmd[1])
+				return energyCounters(m, cmd, reply);
+			if (NULL == desc)
+				return statusFrame(reply, address, ILLEGAL_CMD);
+
+			encodeParam(m, desc, reply);
+			return desc->replySize - sizeof(UInt16);
+		}
+
+		case 0x06:	// memory read, the load profile only
+		{
+			if (!channelOpen[m])
+				return statusFrame(reply, address, CHANNEL_ISNT_OPEN);
+
+			ReadMemCmd* read = (ReadMemCmd*)cmd;
+			int offset = read->offset[0] << 8 | read->offset[1];
+			if (PROFILE_MEMORY != read->memory || !read->length || 1 + read->length + sizeof(UInt16) > BSZ)
+				return statusFrame(reply, address, ILLEGAL_CMD);
+
+			reply[0] = address;
+			for (int i = 0; i < read->length; i++)
+			{
+				int at = (offset + i) & 0xFFFF;
+				byte r[PROFILE_RECORD_SIZE];
+				profileRecord(m, at - at % PROFILE_RECORD_SIZE, r);
+				reply[1 + i] = r[at % PROFILE_RECORD_SIZE];
+			}
+			return 1 + read->length;
+		}
+
+		default:
+			return statusFrame(reply, address, ILLEGAL_CMD);
+	}
+}
+
+// -- Random event with the probability given
+int chance(double probability)
+{
+	return probability > 0 && rand() < probability * ((double)RAND_MAX + 1);
+}
+
+// -- Send responce byte by byte at the line speed, with faults injected
+void sendReply(int master, byte* reply, int len)
+{
+	UInt16 crc = ModRTU_CRC(reply, len);
+	if (chance(settings.corrupt))
+	{
+		crc ^= 1 << (rand() % 16);
+		stats.corrupted++;
+	}
+	memcpy(reply + len, &crc, sizeof(crc));
+	len += sizeof(crc);
+
+	usleep(settings.delay * 1000);
+
+	if (debugPrint)
+	{
+		printf("Sent bytes: %d\n\r\t", len);
+		for (int i = 0; i < len; i++)
+			printf("%02X ", reply[i]);
+		printf("\n\r");
+	}
+
+	if (!settings.byteDelay && !settings.drop)
+	{
+		write(master, reply, len);
+		return;
+	}
+
+	for (int i = 0; i < len; i++)
+	{
+		if (settings.byteDelay)
+			usleep(settings.byteDelay);
+		if (chance(settings.drop))
+			stats.dropped++;
+		else
+			write(master, reply + i, 1);
+	}
+}
+
+int main(int argc, const char** args)
+{
+	const char* link = NULL;
+	unsigned int seed = time(NULL);
+
+	initMeter();
+
+	for (int i=1; i<argc; i++)
+	{
+		int hasArg = i + 1 < argc;
+
+		if (!strcmp(OPT_DEBUG, args[i]))
+			debugPrint = 1;
+		else if (!strcmp(OPT_NO_BATCH, args[i]))
+			settings.noBatch = 1;
+		else if (!strcmp(OPT_OFF, args[i]))
+			settings.off = 1;
+		else if (!strcmp(OPT_LINK, args[i]) && hasArg)
+			link = args[++i];
+		else if (!strcmp(OPT_ADDRESS, args[i]) && hasArg)
+			settings.address = strtol(args[++i], NULL, 0);
+		else if (!strcmp(OPT_METERS, args[i]) && hasArg)
+			settings.meters = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_PASSWORD, args[i]) && hasArg && 6 == strlen(args[i + 1]))
+		{
+			i++;
+			for (int d = 0; d < 6; d++)
+				settings.password[d] = args[i][d] - '0';
+		}
+		else if (!strcmp(OPT_BYTE_DELAY, args[i]) && hasArg)
+			settings.byteDelay = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_DELAY, args[i]) && hasArg)
+			settings.delay = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_DROP, args[i]) && hasArg)
+			settings.drop = strtod(args[++i], NULL);
+		else if (!strcmp(OPT_CORRUPT, args[i]) && hasArg)
+			settings.corrupt = strtod(args[++i], NULL);
+		else if (!strcmp(OPT_SESSION, args[i]) && hasArg)
+			settings.sessionTimeout = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_PROFILE_DAYS, args[i]) && hasArg)
+			settings.profileDays = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_LOAD_STEP, args[i]) && hasArg)
+			settings.loadStep = strtol(args[++i], NULL, 10);
+		else if (!strcmp(OPT_SEED, args[i]) && hasArg)
+			seed = strtoul(args[++i], NULL, 10);
+		else if (!strcmp(OPT_VALUE, args[i]) && hasArg && !setValue(args[i + 1]))
+			i++;
+		else if (!strcmp(OPT_HELP, args[i]))
+		{
+			printUsage();
+			exit(EXIT_OK);
+		}
+		else
+		{
+			printf("Error: %s option is not recognised\n\r\n\r", args[i]);
+			printUsage();
+			exit(EXIT_FAIL);
+		}
+	}
+	srand(seed);
+
+	if (settings.meters < 1 || settings.meters > MAX_METERS ||
+		(settings.meters > 1 && !settings.address) || settings.address + settings.meters > 254)
+	{
+		printf("Error: %d meters from address %d are not possible\n\r\n\r", settings.meters, settings.address);
+		exit(EXIT_FAIL);
+	}
+
+	// Pseudo-terminal pair: we are the master, the meter clients open the slave
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master))
+	{
+		printf("Cannot open pseudo-terminal.\n\r");
+		exit(EXIT_FAIL);
+	}
+	const char* slaveName = ptsname(master);
+
+	// keep the slave open so that the master does not see hangups between clients
+	int slave = open(slaveName, O_RDWR | O_NOCTTY);
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (link)
+	{
+		unlink(link);
+		if (symlink(slaveName, link))
+		{
+			printf("Cannot create %s link.\n\r", link);
+			exit(EXIT_FAIL);
+		}
+	}
+
+	printf("%s\n", slaveName);
+	fflush(stdout);
+
+	signal(SIGINT, sigterm_handler);
+	signal(SIGTERM, sigterm_handler);
+
+	byte buf[BSZ];
+	int len = 0;
+
+	while (!terminateSimNow)
+	{
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(master, &set);
+		if (select(master + 1, &set, NULL, NULL, NULL) <= 0)
+			continue;
+
+		int r = read(master, buf + len, BSZ - len);
+		if (r <= 0)
+			continue;
+		len += r;
+
+		// serve all complete frames received
+		for (;;)
+		{
+			int size = commandSize(buf, len);
+			if (size < 0)
+				size = len;		// garbage, answer and drop it
+			if (!size || len < size)
+				break;
+
+			stats.requests++;
+			byte reply[BSZ];
+			int replyLen = 0;
+
+			// frames with broken CRC and foreign addresses are ignored, as the meter does
+			int m = (0 == buf[0]) ? 0 : buf[0] - settings.address;
+			if (ModRTU_CRC(buf, size) == 0 &&
+				m >= 0 && m < settings.meters &&
+				!settings.off)
+				replyLen = handleRequest(m, buf, size, reply);
+
+			if (replyLen)
+			{
+				sendReply(master, reply, replyLen);
+				stats.responces++;
+			}
+
+			len -= size;
+			memmove(buf, buf + size, len);
+		}
+	}
+
+	if (link)
+		unlink(link);
+	close(slave);
+	close(master);
+
+	fprintf(stderr, "requests: %ld, responces: %ld, rejected: %ld, bytes dropped: %ld, CRC corrupted: %ld\n",
+		stats.requests, stats.responces, stats.rejected, stats.dropped, stats.corrupted);
+	exit(EXIT_OK);
+}
@@ -0,0 +1,125 @@
+/*
+ *	Sample ring: a producer thread pushes numbered samples as fast as it
+ *	can to a consumer that keeps falling behind, with both full ring
+ *	policies. The consumer must get the samples in order and intact, and
+ *	the counters must account for every sample.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../mercury-ring.h"
+
+#define SAMPLES			1000000
+#define PRODUCER_PAUSE		64		// producer yields after that many samples,
+#define PRODUCER_BURST		0x10000		// but not in every other run of that many
+#define CONSUMER_PAUSE		4096		// consumer yields after that many samples
+
+typedef struct
+{
+	SampleRing	ring;
+	int		done;			// the producer has finished
+} Pipe;
+
+// -- Producer: sample i carries i in every field checked
+void* produce(void* arg)
+{
+	Pipe* p = arg;
+	Sample s;
+	memset(&s, 0, sizeof(s));
+
+	for (int i = 1; i <= SAMPLES; i++)
+	{
+		s.time = i;
+		s.o.U.p1 = s.o.S.sum = s.o.PT.rm = (float)(i & 0xFFFF);
+		s.o.f = (float)(i & 0xFFFF);
+		ringPush(&p->ring, &s);
+		if (!(i & PRODUCER_BURST) && 0 == i % PRODUCER_PAUSE)
+			sched_yield();
+	}
+	__atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// -- Run the producer against the consumer with the policy, returns the failures
+int runPolicy(int policy, const char* name)
+{
+	static Pipe p;
+	ringInit(&p.ring, policy);
+	p.done = 0;
+
+	pthread_t producer;
+	if (pthread_create(&producer, NULL, produce, &p))
+	{
+		printf("FAIL: cannot start the producer\n");
+		return 1;
+	}
+
+	int failures = 0;
+	uint64_t consumed = 0;
+	int64_t last = 0;
+	Sample s;
+	for (;;)
+	{
+		int done = __atomic_load_n(&p.done, __ATOMIC_ACQUIRE);
+		if (ringPop(&p.ring, &s))
+		{
+			if (done)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		float v = (float)(s.time & 0xFFFF);
+		if (s.time <= last || s.o.U.p1 != v || s.o.S.sum != v || s.o.PT.rm != v || s.o.f != v)
+		{
+			if (failures++ < 5)
+				printf("FAIL: %s: sample %lld after %lld is out of order or torn\n",
+					name, (long long)s.time, (long long)last);
+		}
+		last = s.time;
+
+		// fall behind now and then
+		if (0 == ++consumed % CONSUMER_PAUSE)
+			sched_yield();
+	}
+	pthread_join(producer, NULL);
+
+	RingStats st;
+	ringStats(&p.ring, &st);
+	if (st.pushed + st.dropped != SAMPLES || consumed + st.overwritten != st.pushed || st.queued)
+	{
+		printf("FAIL: %s: pushed %llu, dropped %llu, overwritten %llu, consumed %llu\n",
+			name, (unsigned long long)st.pushed, (unsigned long long)st.dropped,
+			(unsigned long long)st.overwritten, (unsigned long long)consumed);
+		failures++;
+	}
+	if (RP_DROP_NEWEST == policy && st.overwritten)
+	{
+		printf("FAIL: %s: samples overwritten\n", name);
+		failures++;
+	}
+	if (RP_OVERWRITE_OLDEST == policy && (st.dropped || SAMPLES != last))
+	{
+		printf("FAIL: %s: samples dropped or the newest one lost\n", name);
+		failures++;
+	}
+
+	printf("ring-test: %s: %llu consumed, %llu dropped, %llu overwritten\n", name,
+		(unsigned long long)consumed, (unsigned long long)st.dropped,
+		(unsigned long long)st.overwritten);
+	return failures;
+}
+
+int main()
+{
+	int failures = 0;
+	failures += runPolicy(RP_DROP_NEWEST, "drop newest");
+	failures += runPolicy(RP_OVERWRITE_OLDEST, "overwrite oldest");
+
+	printf("ring-test: %s\n", (failures) ? "FAILED" : "passed");
+	return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
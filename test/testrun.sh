@@ -1,5 +1,3 @@
 #!/bin/bash
-for i in {1..50}
-do
-	./mercury236 /dev/ttyUSB0 --json --debug
-done
+# 50 samples in one process and meter session
+./mercury236 /dev/ttyUSB0 --json --debug --count 50
@@ -0,0 +1,137 @@
+/*
+ *	Time-series store round trip: samples read back must be bit exact,
+ *	range reads must return exactly the samples of the range.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../mercury-tsdb.h"
+
+#define SAMPLES			20000
+#define START			1600000000000LL		// ms since epoch
+
+OutputBlock samples[SAMPLES];
+int64_t times[SAMPLES];
+
+// poll time delta-of-deltas at the edges of the timestamp encodings, from sample DOD_FIRST
+#define DOD_FIRST		100
+const int64_t dods[] = { 64, -64, 256, -256, 2048, -2048, 63, -65, 255, -257, 2047, -2049 };
+#define DOD_COUNT		(int)(sizeof(dods) / sizeof(dods[0]))
+
+typedef struct
+{
+	int	next;			// index of the sample expected
+	int	fields;
+	int	failures;
+} Check;
+
+// -- Sample i: slowly changing readings, noisy power, jittery poll time
+void makeSample(int i, OutputBlock* o)
+{
+	bzero(o, sizeof(OutputBlock));
+	o->U.p1 = 230 + (rand() % 100) / 100.0;
+	o->U.p2 = 229 + (rand() % 100) / 100.0;
+	o->U.p3 = 231 + (rand() % 100) / 100.0;
+	o->S.p1 = (rand() % 300000) / 100.0;
+	o->S.p3 = (rand() % 1000) / 100.0;
+	o->S.sum = o->S.p1 + o->S.p2 + o->S.p3;
+	o->PR.ap = 120.5 + i / 1000.0;
+	((uint32_t*)o)[rand() % TSDB_WORDS] = rand();	// a random word, any bits
+	o->f = 50.0;
+	o->ms = (i % 1000 < 990) ? MS_ON : MS_OFF;
+	times[i] = (i) ? times[i - 1] + 1000 + rand() % 40 - 20 : START;
+	if (i >= DOD_FIRST && i < DOD_FIRST + DOD_COUNT)
+		times[i] = 2 * times[i - 1] - times[i - 2] + dods[i - DOD_FIRST];
+	if (i % 5000 == 4999)
+		times[i] += 3600000;		// gap
+}
+
+int compareFields(int fields, const OutputBlock* a, const OutputBlock* b)
+{
+	for (int p = 0; p < PARAM_COUNT; p++)
+		if ((fields & paramTable[p].field) &&
+			memcmp((const byte*)a + paramTable[p].target, (const byte*)b + paramTable[p].target,
+				paramTable[p].count * sizeof(float)))
+			return 1;
+	return (fields & OB_MS) && a->ms != b->ms;
+}
+
+int visitSample(void* arg, int64_t timestamp, const OutputBlock* o)
+{
+	Check* c = arg;
+	if (c->next >= SAMPLES || times[c->next] != timestamp || compareFields(c->fields, o, &samples[c->next]))
+	{
+		if (c->failures++ < 5)
+			printf("FAIL: sample %d (%lld) does not match\n", c->next, (long long)timestamp);
+	}
+	c->next++;
+	return 0;
+}
+
+// -- Query the range [from, to] of sample indices, check what comes back
+int checkRange(Tsdb* db, int from, int to, int fields)
+{
+	Check c = { .next = from, .fields = fields, .failures = 0 };
+	int n = tsdbQuery(db, times[from], times[to], fields, visitSample, &c);
+	if (n != to - from + 1)
+	{
+		printf("FAIL: range %d..%d returned %d samples\n", from, to, n);
+		c.failures++;
+	}
+	return c.failures;
+}
+
+int main()
+{
+	char path[] = "/tmp/tsdb-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	close(fd);
+	unlink(path);
+
+	srand(236);
+	for (int i = 0; i < SAMPLES; i++)
+		makeSample(i, &samples[i]);
+
+	int failures = 0;
+
+	// write in two sessions, the second one appends to the file
+	Tsdb* db = tsdbOpen(path, 1);
+	for (int i = 0; db && i < SAMPLES / 2; i++)
+		failures += tsdbAppend(db, times[i], &samples[i]) != 0;
+	tsdbClose(db);
+
+	db = tsdbOpen(path, 1);
+	if (!db || 0 == tsdbAppend(db, times[0], &samples[0]))
+	{
+		printf("FAIL: out of order sample accepted\n");
+		failures++;
+	}
+	for (int i = SAMPLES / 2; db && i < SAMPLES; i++)
+		failures += tsdbAppend(db, times[i], &samples[i]) != 0;
+	tsdbClose(db);
+
+	db = tsdbOpen(path, 0);
+	if (!db)
+	{
+		printf("FAIL: cannot open %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	failures += checkRange(db, 0, SAMPLES - 1, OB_ALL);
+	failures += checkRange(db, 4321, 12345, OB_S | OB_MS);
+	failures += checkRange(db, SAMPLES - 1, SAMPLES - 1, OB_U);
+	failures += checkRange(db, 4999, 5001, OB_ALL);
+
+	printf("tsdb-test: %d samples, %lld bytes per sample on disk (%u blocks): %s\n",
+		SAMPLES, (long long)db->header->blocks * TSDB_BLOCK / SAMPLES, db->header->blocks,
+		(failures) ? "FAILED" : "passed");
+
+	tsdbClose(db);
+	unlink(path);
+	return (failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}